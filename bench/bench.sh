@@ -0,0 +1,81 @@
+#!/bin/sh
+# Throughput benchmark for check_tv_compat.
+#
+# Usage: bench.sh <check_tv_compat binary> <corpus dir> [copies]
+#
+# Generates a small corpus of short MKV/MP4/AVI samples with the ffmpeg CLI
+# (only with encoders this ffmpeg build provides), replicates it to the
+# requested number of files, and reports files/sec for several --jobs values.
+# The corpus is kept between runs; delete the directory to regenerate it.
+
+set -e
+
+BIN=$1
+CORPUS=$2
+COPIES=${3:-${BENCH_COPIES:-200}}
+FFMPEG=${FFMPEG:-ffmpeg}
+
+if [ -z "$BIN" ] || [ -z "$CORPUS" ]; then
+    echo "Usage: $0 <check_tv_compat binary> <corpus dir> [copies]" >&2
+    exit 1
+fi
+if ! command -v "$FFMPEG" >/dev/null 2>&1; then
+    echo "bench: '$FFMPEG' not found; set FFMPEG or install the ffmpeg CLI" >&2
+    exit 1
+fi
+
+has_encoder() {
+    "$FFMPEG" -hide_banner -encoders 2>/dev/null | grep -q " $1 "
+}
+
+# sample <name> <video args> <audio args>
+sample() {
+    out="$CORPUS/samples/$1"
+    [ -f "$out" ] && return 0
+    shift
+    "$FFMPEG" -hide_banner -loglevel error -y \
+        -f lavfi -i testsrc=duration=2:size=320x240:rate=25 \
+        -f lavfi -i sine=duration=2 \
+        $1 $2 -shortest "$out" || echo "bench: could not create $out" >&2
+}
+
+mkdir -p "$CORPUS/samples"
+
+sample mpeg4_xvid.avi "-c:v mpeg4 -vtag XVID" "-c:a mp2"
+sample mpeg2.mkv      "-c:v mpeg2video"       "-c:a ac3"
+sample mjpeg.avi      "-c:v mjpeg"            "-c:a pcm_s16le"
+sample flac.mkv       "-c:v mpeg4"            "-c:a flac"
+if has_encoder libx264; then
+    sample h264_aac.mp4 "-c:v libx264 -preset ultrafast" "-c:a aac"
+    sample h264_ac3.mkv "-c:v libx264 -preset ultrafast" "-c:a ac3"
+fi
+if has_encoder libmp3lame; then
+    sample mpeg4_mp3.mkv "-c:v mpeg4" "-c:a libmp3lame"
+fi
+
+# Replicate the samples so the run is dominated by probing, not startup
+if [ ! -f "$CORPUS/.copies-$COPIES" ]; then
+    rm -rf "$CORPUS/files"
+    mkdir -p "$CORPUS/files"
+    i=0
+    while [ "$i" -lt "$COPIES" ]; do
+        d="$CORPUS/files/$((i / 100))"
+        mkdir -p "$d"
+        for f in "$CORPUS"/samples/*; do
+            cp "$f" "$d/$i-$(basename "$f")"
+        done
+        i=$((i + 1))
+    done
+    touch "$CORPUS/.copies-$COPIES"
+fi
+
+nfiles=$(find "$CORPUS/files" -type f | wc -l)
+echo "Corpus: $nfiles files in $CORPUS/files"
+
+for jobs in 1 2 4 0; do
+    rate=$("$BIN" "$CORPUS/files" --brief --stats --jobs "$jobs" 2>&1 >/dev/null |
+        sed -n 's/^Throughput: \(.*\) files\/s$/\1/p')
+    label=$jobs
+    [ "$jobs" = 0 ] && label="auto"
+    echo "jobs=$label: $rate files/s"
+done
@@ -1,14 +1,25 @@
 /*
  * Samsung Frame 2024 TV Video File Checker
  * ----------------------------------------
- * Checks if video/audio/subtitle streams and containers are supported by Samsung Frame 2024 TV.
+ * Checks if video/audio/subtitle streams and containers are supported by Samsung Frame 2024 TV
+ * (or another TV selected with --profile).
  * Suggests ffmpeg remuxing or transcoding commands for unsupported files.
  *
  * Usage:
- *   check_tv_compat <file-or-directory> [--exclude dir1 ...] [--fullpath] [--brief] [--skip-ok] [--skip-unfixable]
+ *   check_tv_compat <file-directory-or-url> [--exclude PATTERN ...] [--exclude-from FILE] [--fullpath] [--brief] [--skip-ok] [--skip-unfixable] [--jobs N|auto]
+ *                   [--format text|jsonl] [--profile NAME[,NAME...]] [--list-profiles] [--cache FILE]
+ *                   [--fast] [--probesize BYTES] [--analyzeduration USEC]
+ *                   [--io-buffer SIZE] [--mmap-head] [--uring] [--prefetch SIZE] [--max-inflight-bytes SIZE] [--emit-script FILE]
+ *                   [--remux] [--remux-jobs N] [--deep] [--deep-jobs N] [--dedupe] [--skip-fixed]
+ *                   [--decode-sample] [--decode-jobs N] [--decode-rate SIZE] [--hwaccel TYPE]
+ *                   [--order newest|largest|path] [--limit N] [--since DATE] [--s3-endpoint URL]
+ *                   [--journal FILE] [--shard I/N] [--stats] [--watch] [--metrics [HOST:]PORT]
+ *   check_tv_compat [options] --merge FILE...
+ *   check_tv_compat --serve SOCKET [options]
+ *   check_tv_compat --client SOCKET [path...]
  *
  * Limitations:
- *   - Supported codec/container lists are based on public Samsung documentation, but may not be exhaustive.
+ *   - Supported codec/container lists are based on public manufacturer documentation, but may not be exhaustive.
  *   - POSIX only (uses dirent.h, unistd.h, etc).
  *   - Requires FFmpeg development libraries.
  */
@@ -17,15 +28,48 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <time.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+#include <libavutil/dovi_meta.h>
+#include <libavutil/hmac.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/sha.h>
 #include <libavutil/log.h>
+#include <libavutil/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+#include "check_tv_compat.h"
 
 #define COLOR_GREEN  "\033[32m"
 #define COLOR_RED    "\033[31m"
@@ -33,459 +77,7514 @@
 #define COLOR_RESET  "\033[0m"
 
 #define PATH_BUF_SIZE 4096
+#define MAX_PROFILES CTV_MAX_PROFILES
+#define LANG_BUF_SIZE 4          // an ISO 639 code and its NUL
+
+// Probe limits used by --fast; the fallback for incomplete headers uses FFmpeg's own default
+#define FAST_PROBESIZE (64 * 1024)
+#define FAST_ANALYZEDURATION 500000
+#define FFMPEG_DEFAULT_PROBESIZE 5000000
 
 typedef struct {
     int total;
-    int ok;
+    int ok;             // supported by every requested profile
     int not_supported;
     int errors;
+    int profile_ok[MAX_PROFILES];
+    int profile_not_supported[MAX_PROFILES];
+    int remuxed;
+    int remux_failed;
+    int duplicates;
+    int resumed;        // counted from the --journal of an earlier run
+    int sampled;        // --decode-sample
+    int sample_errors;
+    int resolved;       // --skip-fixed: sources reported through their fixed output
 } Summary;
 
-int brief_mode = 0;
-int skip_ok = 0;
-int skip_unfixable = 0;
+// Stream parameters the compatibility rules depend on, copied out of the
+// AVFormatContext into a fixed 20-byte record.  Nothing in it points
+// anywhere, so records are copied with memcpy and the --cache file holds
+// them as they are.
+typedef struct {
+    int32_t codec_id;       // enum AVCodecID
+    uint32_t codec_tag;
+    int16_t profile;
+    int16_t level;          // --deep: as FFmpeg reports it, FF_LEVEL_UNKNOWN if not found
+    char lang[LANG_BUF_SIZE];
+    int8_t codec_type;      // enum AVMediaType
+    // Video detail filled in by --deep; only meaningful when deep is set
+    int8_t dovi_profile;    // Dolby Vision profile, -1 without a configuration record
+    uint8_t bit_depth;      // luma bit depth, 0 if not found
+    uint8_t flags;          // deep and dovi_compat; see the accessors below
+} StreamParams;
+
+enum {
+    DEEP_NONE,
+    DEEP_HEADER,        // codec parameters and extradata looked at
+    DEEP_PACKETS,       // and the first keyframe, for what the header didn't say
+};
+
+// flags is spelled out in bits rather than as bitfields since the records
+// are written to the --cache image as they are, and bitfield layout is up
+// to the compiler.  Bits 0-1: DEEP_*; bits 2-5: dv_bl_signal_compatibility_id
+// (0 when the Dolby Vision base layer can't be shown without the enhancement).
+#define STREAM_DEEP_MASK 0x03
+#define STREAM_DOVI_COMPAT_SHIFT 2
+#define STREAM_DOVI_COMPAT_MASK 0x3c
+
+static inline int stream_deep(const StreamParams *sp) {
+    return sp->flags & STREAM_DEEP_MASK;
+}
+
+static inline void stream_set_deep(StreamParams *sp, int deep) {
+    sp->flags = (sp->flags & ~STREAM_DEEP_MASK) | (deep & STREAM_DEEP_MASK);
+}
+
+static inline int stream_dovi_compat(const StreamParams *sp) {
+    return (sp->flags & STREAM_DOVI_COMPAT_MASK) >> STREAM_DOVI_COMPAT_SHIFT;
+}
+
+static inline void stream_set_dovi_compat(StreamParams *sp, int compat) {
+    sp->flags = (sp->flags & ~STREAM_DOVI_COMPAT_MASK) | ((compat << STREAM_DOVI_COMPAT_SHIFT) & STREAM_DOVI_COMPAT_MASK);
+}
+
+typedef struct {
+    const char *container;  // interned
+    int nb_streams;
+    StreamParams *streams;
+} ProbeInfo;
+
+int brief_mode = 0;
+int skip_ok = 0;
+int skip_unfixable = 0;
+int num_jobs = 1;
+int adaptive_jobs = 0;               // --jobs auto
+int uring_mode = 0;
+
+enum { OUTPUT_TEXT, OUTPUT_JSONL };
+int output_format = OUTPUT_TEXT;
+int stats_mode = 0;
+int watch_mode = 0;
+int metrics_mode = 0;
+int remux_mode = 0;
+int deep_jobs = 0;                  // 0: same as --jobs
+int dedupe_mode = 0;
+int skip_fixed = 0;
+
+void quiet_ffmpeg_log(void *ptr, int level, const char *fmt, va_list vl) {
+    (void)ptr; (void)level; (void)fmt; (void)vl;
+}
+
+// FourCCs of MPEG-4 ASP encoders (XviD, DivX, ...) the TV refuses
+int is_mpeg4_asp_tag(uint32_t tag) {
+    return tag == MKTAG('X','V','I','D') ||
+           tag == MKTAG('x','v','i','d') ||
+           tag == MKTAG('D','I','V','X') ||
+           tag == MKTAG('d','i','v','x') ||
+           tag == MKTAG('D','X','5','0') ||
+           tag == MKTAG('M','P','4','V') ||
+           tag == MKTAG('m','p','4','v') ||
+           tag == MKTAG('F','M','P','4') ||
+           tag == MKTAG('f','m','p','4');
+}
+
+uint64_t hash_string(const char *str) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (; *str; str++) {
+        h ^= (unsigned char)*str;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Continues the FNV-1a hash h over len more bytes
+uint64_t hash_bytes_from(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t hash_bytes(const char *str, size_t len) {
+    return hash_bytes_from(14695981039346656037ULL, str, len);
+}
+
+/*
+ * Interned names.  A container name is copied into this table once and
+ * referred to by that copy from then on, so probe results never point into
+ * an AVFormatContext that is gone and stay small.  Names are never
+ * removed; a library only ever has a few dozen distinct ones.
+ */
+typedef struct {
+    const char **names;     // open addressing by hash_string
+    size_t capacity;        // power of two
+    size_t count;
+    pthread_mutex_t lock;
+} StringTable;
+
+StringTable interned = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+const char *intern(const char *name) {
+    pthread_mutex_lock(&interned.lock);
+    if ((interned.count + 1) * 2 > interned.capacity) {
+        const char **old = interned.names;
+        size_t old_capacity = interned.capacity;
+        interned.capacity = old_capacity ? 2 * old_capacity : 64;
+        interned.names = calloc(interned.capacity, sizeof(const char *));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (!old[i])
+                continue;
+            size_t j = hash_string(old[i]) & (interned.capacity - 1);
+            while (interned.names[j])
+                j = (j + 1) & (interned.capacity - 1);
+            interned.names[j] = old[i];
+        }
+        free(old);
+    }
+    size_t i = hash_string(name) & (interned.capacity - 1);
+    while (interned.names[i] && strcmp(interned.names[i], name) != 0)
+        i = (i + 1) & (interned.capacity - 1);
+    if (!interned.names[i]) {
+        interned.names[i] = strdup(name);
+        interned.count++;
+    }
+    const char *s = interned.names[i];
+    pthread_mutex_unlock(&interned.lock);
+    return s;
+}
+
+// The language of a stream as a 2 or 3 letter ISO 639 code: the primary
+// subtag of an IETF tag ("en" of "en-US"), "und" for anything else
+void lang_code(char lang[LANG_BUF_SIZE], const char *tag) {
+    size_t len = tag ? strcspn(tag, "-_") : 0;
+    int ok = len == 2 || len == 3;
+    for (size_t i = 0; ok && i < len; i++)
+        ok = isalpha((unsigned char)tag[i]);
+    memcpy(lang, ok ? tag : "und", ok ? len : 3);
+    lang[ok ? len : 3] = '\0';
+}
+
+/*
+ * TV profiles
+ *
+ * Each profile is a static definition of what one TV family plays.  The
+ * lists are based on public manufacturer documentation and may not be
+ * exhaustive.  At startup every definition is compiled into a bitset per
+ * media type, indexed by AVCodecID, and a hash set of demuxer names, so a
+ * stream check is a single bit test and a container check costs one hash
+ * probe per comma-separated demuxer name.
+ */
+typedef struct {
+    const char *name;
+    const char *description;
+    const enum AVCodecID *video;       // terminated by AV_CODEC_ID_NONE
+    const enum AVCodecID *audio;
+    const enum AVCodecID *subtitle;
+    const char *const *containers;     // demuxer names, NULL terminated
+    int reject_mpeg4_asp;              // MPEG-4 Part 2 only in Simple Profile
+    // Checked with --deep; 0 leaves a limit unchecked
+    int h264_max_level;                // level_idc, e.g. 51 for 5.1
+    int h264_max_bit_depth;
+    int hevc_max_level;                // general_level_idc, 30 x level, e.g. 153 for 5.1
+    int hevc_max_bit_depth;
+    int dovi_needs_base_layer;         // no Dolby Vision decoder: only profiles with an HDR10/SDR/HLG base layer play
+} ProfileDef;
+
+static const enum AVCodecID frame2024_video[] = {
+    AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_MPEG2VIDEO, AV_CODEC_ID_VP9,
+    AV_CODEC_ID_AV1, AV_CODEC_ID_MJPEG, AV_CODEC_ID_PNG, AV_CODEC_ID_MPEG4,
+    AV_CODEC_ID_NONE
+};
+static const enum AVCodecID frame2024_audio[] = {
+    AV_CODEC_ID_AAC, AV_CODEC_ID_AC3, AV_CODEC_ID_EAC3, AV_CODEC_ID_MP3,
+    AV_CODEC_ID_PCM_S16LE, AV_CODEC_ID_FLAC, AV_CODEC_ID_VORBIS, AV_CODEC_ID_OPUS,
+    AV_CODEC_ID_WMAV2,
+    AV_CODEC_ID_NONE
+};
+static const enum AVCodecID frame2024_subtitle[] = {
+    AV_CODEC_ID_SUBRIP,   // .srt
+    AV_CODEC_ID_ASS,      // .ass
+    AV_CODEC_ID_SSA,      // .ssa
+    AV_CODEC_ID_WEBVTT,   // .vtt
+    AV_CODEC_ID_MOV_TEXT, // .movtext
+    AV_CODEC_ID_MICRODVD, // .sub
+    AV_CODEC_ID_TEXT,
+    AV_CODEC_ID_NONE
+};
+static const char *const frame2024_containers[] = {
+    "matroska", "webm", "mov", "mp4", "mpegts", "mpegtsraw", "avi", "asf", "asf_o",
+    "wav", "flac", "mp3", "ogg",
+    NULL
+};
+
+// 2016-2019 Tizen sets: no AV1 or Opus, but DivX/XviD and VC-1 still play
+static const enum AVCodecID tizen_legacy_video[] = {
+    AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_MPEG2VIDEO, AV_CODEC_ID_MPEG4,
+    AV_CODEC_ID_VP8, AV_CODEC_ID_VP9, AV_CODEC_ID_VC1, AV_CODEC_ID_WMV3,
+    AV_CODEC_ID_MJPEG, AV_CODEC_ID_PNG,
+    AV_CODEC_ID_NONE
+};
+static const enum AVCodecID tizen_legacy_audio[] = {
+    AV_CODEC_ID_AAC, AV_CODEC_ID_AC3, AV_CODEC_ID_EAC3, AV_CODEC_ID_MP3,
+    AV_CODEC_ID_PCM_S16LE, AV_CODEC_ID_FLAC, AV_CODEC_ID_VORBIS, AV_CODEC_ID_WMAV2,
+    AV_CODEC_ID_WMAPRO,
+    AV_CODEC_ID_NONE
+};
+static const enum AVCodecID tizen_legacy_subtitle[] = {
+    AV_CODEC_ID_SUBRIP, AV_CODEC_ID_ASS, AV_CODEC_ID_SSA, AV_CODEC_ID_MOV_TEXT,
+    AV_CODEC_ID_MICRODVD, AV_CODEC_ID_SAMI, AV_CODEC_ID_TEXT,
+    AV_CODEC_ID_NONE
+};
+static const char *const tizen_legacy_containers[] = {
+    "matroska", "webm", "mov", "mp4", "mpegts", "mpegtsraw", "avi", "asf", "asf_o",
+    "wav", "flac", "mp3", "ogg", "flv",
+    NULL
+};
+
+static const enum AVCodecID webos_video[] = {
+    AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_MPEG2VIDEO, AV_CODEC_ID_MPEG4,
+    AV_CODEC_ID_VP9, AV_CODEC_ID_AV1, AV_CODEC_ID_MJPEG,
+    AV_CODEC_ID_NONE
+};
+static const enum AVCodecID webos_audio[] = {
+    AV_CODEC_ID_AAC, AV_CODEC_ID_AC3, AV_CODEC_ID_EAC3, AV_CODEC_ID_MP3,
+    AV_CODEC_ID_PCM_S16LE, AV_CODEC_ID_VORBIS, AV_CODEC_ID_OPUS, AV_CODEC_ID_WMAV2,
+    AV_CODEC_ID_NONE
+};
+static const enum AVCodecID webos_subtitle[] = {
+    AV_CODEC_ID_SUBRIP, AV_CODEC_ID_ASS, AV_CODEC_ID_SSA, AV_CODEC_ID_SAMI,
+    AV_CODEC_ID_MICRODVD, AV_CODEC_ID_TEXT,
+    AV_CODEC_ID_NONE
+};
+static const char *const webos_containers[] = {
+    "matroska", "webm", "mov", "mp4", "mpegts", "mpegtsraw", "avi", "asf", "asf_o",
+    "wav", "mp3", "ogg",
+    NULL
+};
+
+static const ProfileDef profile_defs[] = {
+    { "frame2024", "Samsung Frame 2024",
+      frame2024_video, frame2024_audio, frame2024_subtitle, frame2024_containers, 1,
+      51, 8, 153, 10, 1 },
+    { "tizen-legacy", "Samsung Tizen TVs, 2016-2019 models",
+      tizen_legacy_video, tizen_legacy_audio, tizen_legacy_subtitle, tizen_legacy_containers, 0,
+      51, 8, 153, 10, 1 },
+    { "webos", "LG webOS TVs, 2020 and later",
+      webos_video, webos_audio, webos_subtitle, webos_containers, 0,
+      51, 8, 156, 10, 0 },
+};
+#define NUM_PROFILES (sizeof(profile_defs) / sizeof(profile_defs[0]))
+
+typedef struct {
+    uint64_t *bits;
+    unsigned int nbits;
+} CodecSet;
+
+// Open-addressing set of names, keyed by their FNV-1a hash
+typedef struct {
+    uint64_t *hashes;
+    const char **names;
+    size_t mask;
+} NameSet;
+
+typedef struct {
+    const ProfileDef *def;
+    CodecSet video;
+    CodecSet audio;
+    CodecSet subtitle;
+    NameSet containers;
+} Profile;
+
+/*
+ * What a check depends on: the profiles to score against and how files are
+ * probed.  Each ctv_context (the command line's included) has its own,
+ * and probing and scoring only look at the CheckOptions they are handed.
+ */
+typedef struct {
+    Profile *profiles[MAX_PROFILES];
+    int num_profiles;
+    int fast_probe;
+    int64_t probesize_limit;        // 0: FFmpeg default
+    int64_t analyzeduration_limit;  // microseconds, 0: FFmpeg default
+    int io_buffer_size;             // 0: FFmpeg's file protocol (or FILE_IO_BUFFER_SIZE when custom IO is needed)
+    int mmap_head;
+    int deep_mode;
+} CheckOptions;
+
+void codec_set_build(CodecSet *set, const enum AVCodecID *ids) {
+    unsigned int max_id = 0;
+    for (const enum AVCodecID *id = ids; *id != AV_CODEC_ID_NONE; id++)
+        if ((unsigned int)*id > max_id) max_id = *id;
+    set->nbits = max_id + 1;
+    set->bits = calloc((set->nbits + 63) / 64, sizeof(uint64_t));
+    for (const enum AVCodecID *id = ids; *id != AV_CODEC_ID_NONE; id++)
+        set->bits[*id / 64] |= 1ULL << (*id % 64);
+}
+
+static inline int codec_set_has(const CodecSet *set, enum AVCodecID id) {
+    return (unsigned int)id < set->nbits && ((set->bits[id / 64] >> (id % 64)) & 1);
+}
+
+void name_set_build(NameSet *set, const char *const *names) {
+    size_t count = 0;
+    while (names[count]) count++;
+    size_t capacity = 8;
+    while (capacity < count * 2) capacity *= 2;
+    set->mask = capacity - 1;
+    set->hashes = calloc(capacity, sizeof(uint64_t));
+    set->names = calloc(capacity, sizeof(const char *));
+    for (size_t i = 0; i < count; i++) {
+        uint64_t h = hash_string(names[i]);
+        size_t slot = h & set->mask;
+        while (set->names[slot])
+            slot = (slot + 1) & set->mask;
+        set->hashes[slot] = h;
+        set->names[slot] = names[i];
+    }
+}
+
+int name_set_has(const NameSet *set, const char *name, size_t len) {
+    uint64_t h = hash_bytes(name, len);
+    for (size_t slot = h & set->mask; set->names[slot]; slot = (slot + 1) & set->mask) {
+        if (set->hashes[slot] == h && strncmp(set->names[slot], name, len) == 0 &&
+            set->names[slot][len] == '\0')
+            return 1;
+    }
+    return 0;
+}
+
+Profile *profile_compile(const ProfileDef *def) {
+    Profile *profile = calloc(1, sizeof(Profile));
+    profile->def = def;
+    codec_set_build(&profile->video, def->video);
+    codec_set_build(&profile->audio, def->audio);
+    codec_set_build(&profile->subtitle, def->subtitle);
+    name_set_build(&profile->containers, def->containers);
+    return profile;
+}
+
+void profile_free(Profile *profile) {
+    if (!profile) return;
+    free(profile->video.bits);
+    free(profile->audio.bits);
+    free(profile->subtitle.bits);
+    free(profile->containers.hashes);
+    free(profile->containers.names);
+    free(profile);
+}
+
+const ProfileDef *find_profile_def(const char *name) {
+    for (size_t i = 0; i < NUM_PROFILES; i++) {
+        if (strcmp(profile_defs[i].name, name) == 0)
+            return &profile_defs[i];
+    }
+    return NULL;
+}
+
+// Compiles a comma-separated list of profile names into o; -1 on an unknown name
+int check_options_set_profiles(CheckOptions *o, const char *list) {
+    char *copy = strdup(list);
+    int ret = 0;
+    for (char *save = NULL, *name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        const ProfileDef *profile_def = find_profile_def(name);
+        if (!profile_def) {
+            fprintf(stderr, "Unknown profile '%s'. Use --list-profiles to see the available ones.\n", name);
+            ret = -1;
+            break;
+        }
+        int duplicate = 0;
+        for (int p = 0; p < o->num_profiles; p++)
+            duplicate |= o->profiles[p]->def == profile_def;
+        if (!duplicate && o->num_profiles < MAX_PROFILES)
+            o->profiles[o->num_profiles++] = profile_compile(profile_def);
+    }
+    free(copy);
+    return ret;
+}
+
+void check_options_free(CheckOptions *o) {
+    for (int p = 0; p < o->num_profiles; p++)
+        profile_free(o->profiles[p]);
+    o->num_profiles = 0;
+}
+
+// --deep: what a TV that decodes the codec may still refuse
+int deep_params_supported(const ProfileDef *def, const StreamParams *par) {
+    if (par->codec_id == AV_CODEC_ID_H264) {
+        // 4:2:2 and 4:4:4 profiles; FFmpeg keeps constraint/intra flags above the profile_idc
+        int idc = par->profile & 0xff;
+        if (idc == 122 || idc == 244 || idc == 44)
+            return 0;
+        if (def->h264_max_level && par->level > def->h264_max_level)
+            return 0;
+        if (def->h264_max_bit_depth && par->bit_depth > def->h264_max_bit_depth)
+            return 0;
+    } else if (par->codec_id == AV_CODEC_ID_HEVC) {
+        if (par->profile == FF_PROFILE_HEVC_REXT)
+            return 0;
+        if (def->hevc_max_level && par->level > def->hevc_max_level)
+            return 0;
+        if (def->hevc_max_bit_depth && par->bit_depth > def->hevc_max_bit_depth)
+            return 0;
+    }
+    // Profile 5 has no fallback: without Dolby Vision it shows with wrong colours
+    if (par->dovi_profile >= 0 && def->dovi_needs_base_layer && stream_dovi_compat(par) == 0)
+        return 0;
+    return 1;
+}
+
+int is_video_codec_supported(const Profile *profile, const StreamParams *par, int deep) {
+    if (!codec_set_has(&profile->video, par->codec_id))
+        return 0;
+    if (deep && stream_deep(par) && !deep_params_supported(profile->def, par))
+        return 0;
+    if (par->codec_id == AV_CODEC_ID_MPEG4 && profile->def->reject_mpeg4_asp)
+        return !is_mpeg4_asp_tag(par->codec_tag) &&
+               !(par->profile == FF_PROFILE_MPEG4_ADVANCED_SIMPLE ||
+                 par->profile == FF_PROFILE_MPEG4_SIMPLE_STUDIO);
+    return 1;
+}
+
+int is_audio_codec_supported(const Profile *profile, enum AVCodecID id) {
+    return codec_set_has(&profile->audio, id);
+}
+
+// format_name is FFmpeg's comma-separated demuxer list, e.g. "mov,mp4,m4a,3gp,3g2,mj2"
+int is_container_supported(const Profile *profile, const char *format_name) {
+    if (!format_name)
+        return 0;
+    const char *p = format_name;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len && name_set_has(&profile->containers, p, len))
+            return 1;
+        p += len;
+        if (*p == ',') p++;
+    }
+    return 0;
+}
+
+int is_subtitle_codec_supported(const Profile *profile, enum AVCodecID id) {
+    return codec_set_has(&profile->subtitle, id);
+}
+
+int is_text_subtitle(enum AVCodecID id) {
+    return id == AV_CODEC_ID_SUBRIP ||
+           id == AV_CODEC_ID_ASS ||
+           id == AV_CODEC_ID_SSA ||
+           id == AV_CODEC_ID_WEBVTT ||
+           id == AV_CODEC_ID_MOV_TEXT ||
+           id == AV_CODEC_ID_MICRODVD ||
+           id == AV_CODEC_ID_TEXT;
+}
+
+int is_bitmap_subtitle(enum AVCodecID id) {
+    return id == AV_CODEC_ID_HDMV_PGS_SUBTITLE ||
+           id == AV_CODEC_ID_DVD_SUBTITLE;
+}
+
+// scheme://... as in RFC 3986; a local path containing "://" has a '/' before it
+int is_url(const char *path) {
+    const char *p = path;
+    while (isalnum((unsigned char)*p) || *p == '+' || *p == '-' || *p == '.')
+        p++;
+    return p > path && strncmp(p, "://", 3) == 0;
+}
+
+static inline int is_http_url(const char *path) {
+    return strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0;
+}
+
+// Length of the name part of a path; a URL's ends before its query string
+static inline size_t name_length(const char *path) {
+    return is_url(path) ? strcspn(path, "?#") : strlen(path);
+}
+
+static const char *const supported_exts[] = {
+    ".mkv", ".mp4", ".mov", ".webm", ".avi"
+};
+#define NUM_SUPPORTED_EXTS (sizeof(supported_exts) / sizeof(supported_exts[0]))
+
+int has_supported_extension(const char *filename) {
+    size_t len = name_length(filename);
+    for (size_t i = 0; i < NUM_SUPPORTED_EXTS; ++i) {
+        size_t ext_len = strlen(supported_exts[i]);
+        if (len >= ext_len && strncasecmp(filename + len - ext_len, supported_exts[i], ext_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+const char *get_basename(const char *path) {
+    const char *end = path + name_length(path);
+    const char *slash = end;
+    while (slash > path && slash[-1] != '/')
+        slash--;
+    return slash;
+}
+
+// Length of the directory part of filepath that outputs are written to; remote files write to the current directory
+static inline size_t output_dir_length(const char *filepath) {
+    return is_url(filepath) ? 0 : (size_t)(get_basename(filepath) - filepath);
+}
+
+void print_ffmpeg_error(FILE *out, const char *prefix, int errnum) {
+    char errbuf[256];
+    av_strerror(errnum, errbuf, sizeof(errbuf));
+    fprintf(out, "%s: " COLOR_YELLOW "error: %s" COLOR_RESET "\n", prefix, errbuf);
+}
+
+int is_media_stream(enum AVMediaType type) {
+    return type == AVMEDIA_TYPE_VIDEO ||
+           type == AVMEDIA_TYPE_AUDIO ||
+           type == AVMEDIA_TYPE_SUBTITLE;
+}
+
+// Whether the container header alone told us everything the rules look at
+int header_params_sufficient(const AVFormatContext *fmt_ctx) {
+    // Streams of header-less formats (e.g. MPEG-TS) only show up while reading packets
+    if ((fmt_ctx->ctx_flags & AVFMTCTX_NOHEADER) || fmt_ctx->nb_streams == 0)
+        return 0;
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        const AVCodecParameters *par = fmt_ctx->streams[i]->codecpar;
+        if (!is_media_stream(par->codec_type)) continue;
+        if (par->codec_id == AV_CODEC_ID_NONE)
+            return 0;
+        // MPEG-4 Part 2 is decided by profile unless the fourcc already rules it out
+        if (par->codec_id == AV_CODEC_ID_MPEG4 && par->profile == FF_PROFILE_UNKNOWN &&
+            !is_mpeg4_asp_tag(par->codec_tag))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Growable string with tracked length, used to build ffmpeg commands.
+ * It starts out in caller-provided (usually stack) storage and only moves
+ * to the heap for unusually long results, so there is no truncation and,
+ * for ordinary files, no allocation at all.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    char *inline_buf;       // initial storage, not owned
+    size_t inline_cap;
+} StrBuf;
+
+void sb_init(StrBuf *sb, char *storage, size_t size) {
+    sb->data = sb->inline_buf = storage;
+    sb->cap = sb->inline_cap = size;
+    sb->len = 0;
+    sb->data[0] = '\0';
+}
+
+// Releases heap storage; sb stays usable, empty and back in its initial storage
+void sb_free(StrBuf *sb) {
+    if (sb->data != sb->inline_buf)
+        free(sb->data);
+    sb->data = sb->inline_buf;
+    sb->cap = sb->inline_cap;
+    sb->len = 0;
+    sb->data[0] = '\0';
+}
+
+static inline void sb_reset(StrBuf *sb) {
+    sb->len = 0;
+    sb->data[0] = '\0';
+}
+
+// Makes room for extra more bytes plus the terminator
+void sb_reserve(StrBuf *sb, size_t extra) {
+    if (sb->len + extra < sb->cap)
+        return;
+    size_t cap = sb->cap * 2;
+    while (cap <= sb->len + extra)
+        cap *= 2;
+    if (sb->data == sb->inline_buf) {
+        char *data = malloc(cap);
+        memcpy(data, sb->data, sb->len + 1);
+        sb->data = data;
+    } else {
+        sb->data = realloc(sb->data, cap);
+    }
+    sb->cap = cap;
+}
+
+void sb_append_len(StrBuf *sb, const char *s, size_t len) {
+    sb_reserve(sb, len);
+    memcpy(sb->data + sb->len, s, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+static inline void sb_append(StrBuf *sb, const char *s) {
+    sb_append_len(sb, s, strlen(s));
+}
+
+void sb_appendf(StrBuf *sb, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= sb->cap - sb->len) {
+        sb_reserve(sb, n);
+        va_start(ap, fmt);
+        vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
+    }
+    sb->len += n;
+}
+
+// Appends s[0..len) for use inside a single-quoted shell word
+void sb_append_quoted_part(StrBuf *sb, const char *s, size_t len) {
+    const char *end = s + len;
+    while (s < end) {
+        const char *quote = memchr(s, '\'', end - s);
+        size_t n = quote ? (size_t)(quote - s) : (size_t)(end - s);
+        sb_append_len(sb, s, n);
+        if (!quote)
+            break;
+        sb_append_len(sb, "'\\''", 4);
+        s = quote + 1;
+    }
+}
+
+// Appends s as one shell-safe single-quoted word
+void sb_append_quoted(StrBuf *sb, const char *s) {
+    sb_append_len(sb, "'", 1);
+    sb_append_quoted_part(sb, s, strlen(s));
+    sb_append_len(sb, "'", 1);
+}
+
+void probe_info_free(ProbeInfo *info) {
+    free(info->streams);
+    info->streams = NULL;
+    info->nb_streams = 0;
+}
+
+// Per-file I/O and timing figures collected by probe_file for --stats
+typedef struct {
+    int64_t open_us;
+    int64_t info_us;
+    int64_t deep_us;        // --deep packet stage
+    int64_t hash_us;        // --dedupe content hashing
+    int64_t bytes_read;
+    int reads;              // read(2) calls, or HTTP requests for remote files
+    int seeks;
+    int connects;           // HTTP connections opened, for remote files
+    int probed;             // probe_file ran, successfully or not; not set for cache hits
+} ProbeStats;
+
+// Plain file behind our own AVIOContext. Every read and seek FFmpeg issues is
+// counted for --stats; --io-buffer sizes the buffer so network mounts see few
+// large reads, and --mmap-head serves the probed head of the file from a mapping.
+typedef struct {
+    int fd;
+    int64_t size;
+    int64_t pos;
+    int buffer_size;
+    const uint8_t *head;    // mapped or prefetched [0, head_size), or NULL
+    size_t head_size;
+    uint8_t *head_buf;      // head when it was prefetched (--uring), from the head pool
+    int64_t bytes_read;
+    int reads;              // read(2) calls; bytes copied from the head are not counted
+    int seeks;
+} FileIO;
+
+// The start of a file, opened and read ahead of its probe (--uring).  file_io_open
+// takes over fd and buf; whoever holds the FileHead frees what is left of it.
+typedef struct {
+    int fd;
+    uint8_t *buf;           // from the head pool
+    size_t len;
+} FileHead;
+
+/*
+ * Head pool: the buffers file heads are prefetched into, all prefetch_size
+ * bytes.  Freed buffers are kept for the next files (up to HEAD_POOL_MAX) so
+ * a scan does not map and unmap one for every file.
+ */
+#define HEAD_POOL_MAX 256
+
+int64_t prefetch_size = 128 * 1024; // --prefetch
+
+struct {
+    uint8_t *free[HEAD_POOL_MAX];
+    int count;
+    pthread_mutex_t lock;
+} head_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+uint8_t *head_pool_get(void) {
+    uint8_t *buf = NULL;
+    pthread_mutex_lock(&head_pool.lock);
+    if (head_pool.count > 0)
+        buf = head_pool.free[--head_pool.count];
+    pthread_mutex_unlock(&head_pool.lock);
+    return buf ? buf : malloc(prefetch_size);
+}
+
+void head_pool_put(uint8_t *buf) {
+    if (!buf)
+        return;
+    pthread_mutex_lock(&head_pool.lock);
+    if (head_pool.count < HEAD_POOL_MAX) {
+        head_pool.free[head_pool.count++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&head_pool.lock);
+    free(buf);
+}
+
+void head_pool_drain(void) {
+    while (head_pool.count > 0)
+        free(head_pool.free[--head_pool.count]);
+}
+
+void file_head_free(FileHead *h) {
+    if (!h)
+        return;
+    if (h->fd >= 0)
+        close(h->fd);
+    head_pool_put(h->buf);
+    free(h);
+}
+
+#define FILE_IO_BUFFER_SIZE 32768
+#define IO_BUFFER_MIN (4 * 1024)
+#define IO_BUFFER_MAX (64 * 1024 * 1024)
+
+int file_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    FileIO *io = opaque;
+    if (io->head && io->pos < (int64_t)io->head_size) {
+        size_t n = io->head_size - io->pos;
+        if (n > (size_t)buf_size)
+            n = buf_size;
+        memcpy(buf, io->head + io->pos, n);
+        io->pos += n;
+        io->bytes_read += n;
+        return (int)n;
+    }
+    ssize_t n;
+    do {
+        n = pread(io->fd, buf, buf_size, io->pos);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return AVERROR(errno);
+    if (n == 0)
+        return AVERROR_EOF;
+    io->pos += n;
+    io->reads++;
+    io->bytes_read += n;
+    return (int)n;
+}
+
+int64_t file_io_seek(void *opaque, int64_t offset, int whence) {
+    FileIO *io = opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return io->size;
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = io->pos + offset; break;
+    case SEEK_END:
+        if (io->size < 0) return AVERROR(ENOSYS);
+        pos = io->size + offset;
+        break;
+    default: return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    // Jumps (e.g. to Matroska cues or an MP4 moov at the end) start a new sequential run
+    if (pos != io->pos)
+        posix_fadvise(io->fd, pos, io->buffer_size, POSIX_FADV_WILLNEED);
+    io->pos = pos;
+    io->seeks++;
+    return pos;
+}
+
+// Parses a byte count with an optional K/M/G suffix (powers of 1024)
+int parse_size(const char *str, int64_t *out) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(str, &end, 10);
+    if (errno || end == str || value < 0)
+        return -1;
+    switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (*end == 'B' || *end == 'b')
+        end++;
+    if (*end)
+        return -1;
+    *out = value;
+    return 0;
+}
+
+// How much of the file a probe is expected to touch from the start
+int64_t probe_head_size(const CheckOptions *o) {
+    if (o->probesize_limit)
+        return o->probesize_limit;
+    return o->fast_probe ? FAST_PROBESIZE : FFMPEG_DEFAULT_PROBESIZE;
+}
+
+// Creates an AVIOContext reading filepath, starting with head if given (and
+// taking its fd and buffer); returns an AVERROR on failure
+int file_io_open(const char *filepath, const CheckOptions *o, FileHead *head, FileIO *io, AVIOContext **pb) {
+    memset(io, 0, sizeof(*io));
+    if (head && head->fd >= 0) {
+        io->fd = head->fd;
+        io->head = io->head_buf = head->buf;
+        io->head_size = head->len;
+        head->fd = -1;
+        head->buf = NULL;
+    } else {
+        io->fd = open(filepath, O_RDONLY);
+    }
+    if (io->fd < 0)
+        return AVERROR(errno);
+    struct stat st;
+    io->size = fstat(io->fd, &st) == 0 ? st.st_size : -1;
+    int buffer_size = o->io_buffer_size ? o->io_buffer_size : FILE_IO_BUFFER_SIZE;
+    io->buffer_size = buffer_size;
+
+    // Probing reads the head sequentially; let the kernel (or NFS/SMB client) read ahead
+    posix_fadvise(io->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(io->fd, io->head_size, buffer_size, POSIX_FADV_WILLNEED);
+
+    if (o->mmap_head && !io->head && S_ISREG(st.st_mode) && io->size > 0) {
+        int64_t head = probe_head_size(o);
+        io->head_size = head < io->size ? (size_t)head : (size_t)io->size;
+        void *map = mmap(NULL, io->head_size, PROT_READ, MAP_PRIVATE, io->fd, 0);
+        if (map != MAP_FAILED) {
+            io->head = map;
+            madvise(map, io->head_size, MADV_WILLNEED);
+        } else {
+            io->head_size = 0;  // fall back to reads
+        }
+    }
+
+    unsigned char *buffer = av_malloc(buffer_size);
+    *pb = buffer ? avio_alloc_context(buffer, buffer_size, 0, io, file_io_read, NULL, file_io_seek) : NULL;
+    if (!*pb) {
+        av_free(buffer);
+        if (io->head_buf)
+            head_pool_put(io->head_buf);
+        else if (io->head)
+            munmap((void *)io->head, io->head_size);
+        close(io->fd);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+void file_io_close(FileIO *io, AVIOContext **pb) {
+    if (*pb) {
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+    if (io->head_buf)
+        head_pool_put(io->head_buf);
+    else if (io->head)
+        munmap((void *)io->head, io->head_size);
+    close(io->fd);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * --uring: the directory walk's metadata and the first reads of every file
+ * go through an io_uring, so one system call carries a whole batch instead
+ * of a round trip per file.  The walker stats up to URING_BATCH entries of
+ * a directory at once, and dispatch_file collects URING_BATCH files before
+ * opening them and reading their first prefetch_size bytes in two more
+ * batches.  Used from the main thread only; liburing is not needed, the
+ * rings are set up with the raw system calls.
+ */
+#define URING_BATCH 64
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending;       // SQEs queued since the last uring_run
+} Uring;
+
+Uring *walk_ring = NULL;
+
+void uring_free(Uring *r) {
+    if (!r)
+        return;
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+// NULL (with errno set) where the kernel has no io_uring or doesn't allow it
+Uring *uring_new(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    Uring *r = calloc(1, sizeof(Uring));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq_ring :
+        mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        int err = errno;
+        uring_free(r);
+        errno = err;
+        return NULL;
+    }
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+// The next SQE, cleared; at most URING_BATCH between two uring_run calls
+struct io_uring_sqe *uring_sqe(Uring *r, uint64_t user_data) {
+    unsigned tail = *r->sq_tail + r->pending;
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    r->pending++;
+    return sqe;
+}
+
+// Submits the queued SQEs and waits for all of them; res[user_data] gets each result
+int uring_run(Uring *r, int *res) {
+    unsigned n = r->pending;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->pending = 0;
+    unsigned submitted = 0, done = 0;
+    while (done < n) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+            return -errno;
+        if (ret > 0)
+            submitted += ret;
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, done++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void stat_from_statx(struct stat *st, const struct statx *stx) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+/*
+ * Remote inputs.  http(s) URLs are read by RemoteIO through FFmpeg's http
+ * protocol with ranged requests (its offset and end_offset options).  The
+ * http protocol opens a new connection for every request, seeks included,
+ * and keeps none for the next URL, so what RemoteIO saves is requests: the
+ * first one covers the whole probe head, a demuxer that reads it through gets
+ * the rest of the object in a second one, and each seek (say to an MP4 moov
+ * at the end) costs one more, bounded to a probe head again.  Redirects,
+ * credentials in the URL and chunked responses are left to FFmpeg.
+ */
+#define REMOTE_WINDOW_MIN (256 * 1024)  // smallest bounded request, for --fast and small --probesize
+#define REMOTE_SKIP_MAX (64 * 1024)     // a forward seek this short reads on instead of requesting again
+#define REMOTE_TIMEOUT_US 30000000
+
+/*
+ * S3 request signing (AWS Signature Version 4).  With AWS_ACCESS_KEY_ID and
+ * AWS_SECRET_ACCESS_KEY set (and AWS_SESSION_TOKEN for temporary
+ * credentials), the listing and every object GET below the S3 endpoint are
+ * signed for AWS_REGION (or AWS_DEFAULT_REGION, else us-east-1); without
+ * them requests go out anonymously.
+ */
+#define S3_DEFAULT_ENDPOINT "https://s3.amazonaws.com"
+#define S3_EMPTY_PAYLOAD "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"    // SHA-256 of ""
+
+const char *s3_endpoint = S3_DEFAULT_ENDPOINT;
+
+typedef struct {
+    char endpoint[512];     // s3_endpoint without trailing slashes, or the regional AWS one
+    char region[64];
+    char key_id[256];       // empty: requests are not signed
+    char secret[256];
+    char token[4096];
+} S3Signer;
+
+S3Signer s3_signer;
+static pthread_once_t s3_signer_once = PTHREAD_ONCE_INIT;
+
+void s3_signer_setup(void) {
+    S3Signer *s = &s3_signer;
+    const char *region = getenv("AWS_REGION");
+    if (!region || !region[0])
+        region = getenv("AWS_DEFAULT_REGION");
+    snprintf(s->region, sizeof(s->region), "%s", region && region[0] ? region : "us-east-1");
+    // Path-style requests on AWS go to the bucket's region
+    if (strcmp(s3_endpoint, S3_DEFAULT_ENDPOINT) == 0 && strcmp(s->region, "us-east-1") != 0)
+        snprintf(s->endpoint, sizeof(s->endpoint), "https://s3.%.*s.amazonaws.com", (int)sizeof(s->region), s->region);
+    else
+        snprintf(s->endpoint, sizeof(s->endpoint), "%s", s3_endpoint);
+    size_t len = strlen(s->endpoint);
+    while (len > 0 && s->endpoint[len - 1] == '/')
+        s->endpoint[--len] = '\0';
+
+    const char *key_id = getenv("AWS_ACCESS_KEY_ID");
+    const char *secret = getenv("AWS_SECRET_ACCESS_KEY");
+    const char *token = getenv("AWS_SESSION_TOKEN");
+    if (key_id && key_id[0] && secret && secret[0]) {
+        snprintf(s->key_id, sizeof(s->key_id), "%s", key_id);
+        snprintf(s->secret, sizeof(s->secret), "%s", secret);
+        snprintf(s->token, sizeof(s->token), "%s", token ? token : "");
+    }
+}
+
+// Whether requests for url are signed: S3 credentials are set and url is below the S3 endpoint
+int s3_signs(const char *url) {
+    const S3Signer *s = &s3_signer;
+    size_t len = strlen(s->endpoint);
+    return s->key_id[0] && len && strncmp(url, s->endpoint, len) == 0 && url[len] == '/';
+}
+
+void hex_encode(char *out, const uint8_t *data, int len) {
+    for (int i = 0; i < len; i++)
+        sprintf(out + 2 * i, "%02x", data[i]);
+}
+
+/*
+ * Appends the headers that sign a GET of url: Host (so FFmpeg sends exactly
+ * the signed one), x-amz-date, x-amz-content-sha256, x-amz-security-token
+ * and Authorization.  The path and query of url are used as they are, so
+ * they must already be percent-encoded and the query sorted by name.
+ */
+void s3_sign_request(const char *url, StrBuf *headers) {
+    const S3Signer *s = &s3_signer;
+    char proto[16], hostname[256], path[PATH_BUF_SIZE], host[300];
+    int port;
+    av_url_split(proto, sizeof(proto), NULL, 0, hostname, sizeof(hostname), &port, path, sizeof(path), url);
+    const char *open = strchr(hostname, ':') ? "[" : "";
+    const char *close = *open ? "]" : "";
+    if (port >= 0)
+        snprintf(host, sizeof(host), "%s%s%s:%d", open, hostname, close, port);
+    else
+        snprintf(host, sizeof(host), "%s%s%s", open, hostname, close);
+    char *query = strchr(path, '?');
+    if (query)
+        *query++ = '\0';
+
+    char date[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &tm);
+    const char *signed_headers = s->token[0] ? "host;x-amz-content-sha256;x-amz-date;x-amz-security-token"
+                                             : "host;x-amz-content-sha256;x-amz-date";
+
+    char storage[PATH_BUF_SIZE];
+    StrBuf sb;
+    sb_init(&sb, storage, sizeof(storage));
+    sb_appendf(&sb, "GET\n%s\n%s\nhost:%s\nx-amz-content-sha256:" S3_EMPTY_PAYLOAD "\nx-amz-date:%s\n",
+        path[0] ? path : "/", query ? query : "", host, date);
+    if (s->token[0])
+        sb_appendf(&sb, "x-amz-security-token:%s\n", s->token);
+    sb_appendf(&sb, "\n%s\n" S3_EMPTY_PAYLOAD, signed_headers);
+
+    uint8_t digest[32];
+    char hex[65];
+    struct AVSHA *sha = av_sha_alloc();
+    av_sha_init(sha, 256);
+    av_sha_update(sha, (const uint8_t *)sb.data, sb.len);
+    av_sha_final(sha, digest);
+    av_free(sha);
+    hex_encode(hex, digest, sizeof(digest));
+    sb_reset(&sb);
+    sb_appendf(&sb, "AWS4-HMAC-SHA256\n%s\n%.8s/%s/s3/aws4_request\n%s", date, date, s->region, hex);
+
+    // The signing key is derived from the secret through the credential scope
+    AVHMAC *hmac = av_hmac_alloc(AV_HMAC_SHA256);
+    char secret[sizeof(s->secret) + 5];
+    snprintf(secret, sizeof(secret), "AWS4%.*s", (int)sizeof(s->secret), s->secret);
+    char day[9];
+    snprintf(day, sizeof(day), "%.8s", date);
+    const char *scope[] = { day, s->region, "s3", "aws4_request" };
+    uint8_t key[32];
+    av_hmac_calc(hmac, (const uint8_t *)scope[0], strlen(scope[0]), (const uint8_t *)secret, strlen(secret), key, sizeof(key));
+    for (int i = 1; i < 4; i++)
+        av_hmac_calc(hmac, (const uint8_t *)scope[i], strlen(scope[i]), key, sizeof(key), key, sizeof(key));
+    av_hmac_calc(hmac, (const uint8_t *)sb.data, sb.len, key, sizeof(key), digest, sizeof(digest));
+    av_hmac_free(hmac);
+    hex_encode(hex, digest, sizeof(digest));
+    sb_free(&sb);
+
+    sb_appendf(headers, "Host: %s\r\nx-amz-date: %s\r\nx-amz-content-sha256: " S3_EMPTY_PAYLOAD "\r\n", host, date);
+    if (s->token[0])
+        sb_appendf(headers, "x-amz-security-token: %s\r\n", s->token);
+    sb_appendf(headers, "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s/%s/s3/aws4_request, SignedHeaders=%s, Signature=%s\r\n",
+        s->key_id, day, s->region, signed_headers, hex);
+}
+
+// Options every request for url gets: timeout, reconnects and the S3 signature
+void remote_request_options(const char *url, AVDictionary **opts) {
+    av_dict_set_int(opts, "rw_timeout", REMOTE_TIMEOUT_US, 0);
+    av_dict_set_int(opts, "reconnect", 1, 0);
+    if (s3_signs(url)) {
+        char storage[2048];
+        StrBuf headers;
+        sb_init(&headers, storage, sizeof(storage));
+        s3_sign_request(url, &headers);
+        av_dict_set(opts, "headers", headers.data, 0);
+        sb_free(&headers);
+    }
+}
+
+// GETs all of url into body
+int remote_get(const char *url, StrBuf *body) {
+    AVDictionary *opts = NULL;
+    AVIOContext *io = NULL;
+    remote_request_options(url, &opts);
+    int ret = avio_open2(&io, url, AVIO_FLAG_READ, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+        return ret;
+    unsigned char buf[16384];
+    while ((ret = avio_read(io, buf, sizeof(buf))) > 0)
+        sb_append_len(body, (const char *)buf, ret);
+    avio_closep(&io);
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+typedef struct {
+    char *url;
+    AVIOContext *http;      // the window being read; NULL between windows
+    int streamed;           // the server ignores ranges: one response from the start, read through
+    int64_t size;           // -1 until a response told
+    int64_t pos;
+    int64_t window_end;     // object offset where the window being read ends
+    int64_t window;         // size of the next request; 0 asks for the rest of the object
+    int64_t window_max;     // size of a request after a seek
+    int64_t bytes_read;
+    int reads;              // requests, each on a connection of its own
+    int seeks;
+} RemoteIO;
+
+// Requests the next window from rio->pos
+int remote_io_request(RemoteIO *rio) {
+    if (rio->streamed && rio->pos > 0)
+        return AVERROR(ENOSYS);
+    int64_t end = rio->window ? rio->pos + rio->window : -1;
+    if (rio->size >= 0 && (end < 0 || end > rio->size))
+        end = rio->size;
+    AVDictionary *opts = NULL;
+    remote_request_options(rio->url, &opts);
+    if (rio->pos > 0)
+        av_dict_set_int(&opts, "offset", rio->pos, 0);
+    if (!rio->streamed && end >= 0)
+        av_dict_set_int(&opts, "end_offset", end, 0);
+    rio->reads++;
+    int ret = avio_open2(&rio->http, rio->url, AVIO_FLAG_READ, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+        return ret;
+    int64_t size = avio_size(rio->http);
+    if (size >= 0)
+        rio->size = size;
+    if (!rio->streamed && !(rio->http->seekable & AVIO_SEEKABLE_NORMAL)) {
+        // Range ignored (a 200 with the whole body): ask again for all of it, read sequentially
+        avio_closep(&rio->http);
+        if (rio->pos > 0)
+            return AVERROR(ENOSYS);
+        rio->streamed = 1;
+        return remote_io_request(rio);
+    }
+    if (rio->streamed || end < 0)
+        end = rio->size >= 0 ? rio->size : INT64_MAX;
+    rio->window_end = end;
+    return 0;
+}
+
+// Reads the window on up to pos instead of requesting again
+int remote_io_skip(RemoteIO *rio, int64_t pos) {
+    unsigned char buf[4096];
+    while (rio->pos < pos) {
+        int64_t n = pos - rio->pos;
+        int ret = avio_read(rio->http, buf, n < (int64_t)sizeof(buf) ? (int)n : (int)sizeof(buf));
+        if (ret <= 0) {
+            avio_closep(&rio->http);
+            return ret < 0 ? ret : AVERROR(EIO);
+        }
+        rio->pos += ret;
+        rio->bytes_read += ret;
+    }
+    return 0;
+}
+
+int remote_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    RemoteIO *rio = opaque;
+    if (rio->size >= 0 && rio->pos >= rio->size)
+        return AVERROR_EOF;
+    if (!rio->http) {
+        int ret = remote_io_request(rio);
+        if (ret < 0)
+            return ret;
+    }
+    int64_t left = rio->window_end - rio->pos;
+    int n = avio_read_partial(rio->http, buf, left < buf_size ? (int)left : buf_size);
+    if (n <= 0) {
+        avio_closep(&rio->http);
+        if (rio->window_end == INT64_MAX && rio->size < 0 && (n == 0 || n == AVERROR_EOF)) {
+            // A response of unknown length ends where the server stops
+            rio->size = rio->pos;
+            return AVERROR_EOF;
+        }
+        return n == 0 || n == AVERROR_EOF ? AVERROR(EIO) : n;
+    }
+    rio->pos += n;
+    rio->bytes_read += n;
+    if (rio->pos == rio->window_end) {
+        // Read through: the demuxer is past probing, take the rest in one request
+        avio_closep(&rio->http);
+        rio->window = 0;
+    }
+    return n;
+}
+
+int64_t remote_io_seek(void *opaque, int64_t offset, int whence) {
+    RemoteIO *rio = opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return rio->size >= 0 ? rio->size : AVERROR(ENOSYS);
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = rio->pos + offset; break;
+    case SEEK_END:
+        if (rio->size < 0) return AVERROR(ENOSYS);
+        pos = rio->size + offset;
+        break;
+    default: return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    if (pos == rio->pos)
+        return pos;
+    rio->seeks++;
+    // A short skip within the window: cheaper than another request
+    if (rio->http && pos > rio->pos && pos < rio->window_end && pos - rio->pos <= REMOTE_SKIP_MAX &&
+        remote_io_skip(rio, pos) == 0)
+        return pos;
+    if (rio->streamed)
+        return AVERROR(ENOSYS);
+    avio_closep(&rio->http);
+    rio->pos = pos;
+    rio->window = rio->window_max;
+    return pos;
+}
+
+// Creates an AVIOContext reading url; the probe head is requested right away and tells the size
+int remote_io_open(const char *url, const CheckOptions *o, RemoteIO *rio, AVIOContext **pb) {
+    memset(rio, 0, sizeof(*rio));
+    rio->url = strdup(url);
+    rio->size = -1;
+    rio->window_max = probe_head_size(o) > REMOTE_WINDOW_MIN ? probe_head_size(o) : REMOTE_WINDOW_MIN;
+    rio->window = rio->window_max;
+    int ret = remote_io_request(rio);
+    int buffer_size = o->io_buffer_size ? o->io_buffer_size : FILE_IO_BUFFER_SIZE;
+    unsigned char *buffer = ret < 0 ? NULL : av_malloc(buffer_size);
+    *pb = buffer ? avio_alloc_context(buffer, buffer_size, 0, rio, remote_io_read, NULL, remote_io_seek) : NULL;
+    if (!*pb) {
+        av_free(buffer);
+        avio_closep(&rio->http);
+        free(rio->url);
+        return ret < 0 ? ret : AVERROR(ENOMEM);
+    }
+    if (rio->streamed)
+        (*pb)->seekable = 0;
+    return 0;
+}
+
+void remote_io_close(RemoteIO *rio, AVIOContext **pb) {
+    if (*pb) {
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+    avio_closep(&rio->http);
+    free(rio->url);
+}
+
+// A file opened by probe_file; kept open by callers that go on to read packets
+typedef struct {
+    AVFormatContext *fmt_ctx;
+    AVIOContext *pb;
+    FileIO io;              // must stay put: the AVIOContext points at it
+    RemoteIO rio;           // likewise, for http(s) URLs
+    int custom_io;
+    int remote;
+} ProbeInput;
+
+void probe_input_close(ProbeInput *in) {
+    // avformat_open_input frees the context itself when it fails
+    avformat_close_input(&in->fmt_ctx);
+    if (in->custom_io)
+        file_io_close(&in->io, &in->pb);
+    if (in->remote)
+        remote_io_close(&in->rio, &in->pb);
+    in->custom_io = 0;
+    in->remote = 0;
+}
+
+// Copies the I/O counters of whichever reader in uses to stats
+void probe_input_counters(const ProbeInput *in, ProbeStats *stats) {
+    if (in->remote) {
+        stats->bytes_read = in->rio.bytes_read;
+        stats->reads = in->rio.reads;
+        stats->seeks = in->rio.seeks;
+        stats->connects = in->rio.reads;    // the http protocol reuses none
+    } else {
+        stats->bytes_read = in->io.bytes_read;
+        stats->reads = in->io.reads;
+        stats->seeks = in->io.seeks;
+    }
+}
+
+/*
+ * --deep: profile, level, bit depth and Dolby Vision configuration of H.264
+ * and HEVC video.  Most of it comes with the codec parameters; what the
+ * demuxer left unset is parsed from the SPS (or, for HEVC, the VPS) in the
+ * extradata.  Streams that carry their parameter sets in-band only are
+ * finished by deep_read_packets from the first keyframe, without decoding.
+ */
+#define SPS_PARSE_BYTES 256     // more than the fields read below ever need
+#define DEEP_MAX_PACKETS 512    // give up on a missing keyframe after this many packets
+#define DEEP_MAX_BYTES (8 * 1024 * 1024)
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;        // bytes
+    size_t pos;         // bits; past size * 8 once the data ran out
+} BitReader;
+
+unsigned br_bits(BitReader *br, int n) {
+    unsigned v = 0;
+    for (; n > 0; n--, br->pos++) {
+        size_t byte = br->pos >> 3;
+        unsigned bit = byte < br->size ? (br->data[byte] >> (7 - (br->pos & 7))) & 1 : 0;
+        v = (v << 1) | bit;
+    }
+    return v;
+}
+
+static inline void br_skip(BitReader *br, size_t n) {
+    br->pos += n;
+}
+
+// Exp-Golomb ue(v)
+unsigned br_ue(BitReader *br) {
+    int zeros = 0;
+    while (!br_bits(br, 1)) {
+        if (++zeros == 32)
+            return 0;   // only happens past the end of the data
+    }
+    return ((1u << zeros) - 1) + br_bits(br, zeros);
+}
+
+static inline int br_overrun(const BitReader *br) {
+    return br->pos > br->size * 8;
+}
+
+// Copies a NAL unit payload without its emulation prevention bytes, up to size bytes
+size_t nal_to_rbsp(const uint8_t *nal, size_t len, uint8_t *out, size_t size) {
+    size_t n = 0;
+    int zeros = 0;
+    for (size_t i = 0; i < len && n < size; i++) {
+        if (zeros >= 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] == 0 ? zeros + 1 : 0;
+        out[n++] = nal[i];
+    }
+    return n;
+}
+
+// Fills in whatever is still unknown; parsed values never override the demuxer's
+void deep_set(StreamParams *sp, int profile, int level, int bit_depth) {
+    if (sp->profile == FF_PROFILE_UNKNOWN && profile > 0)
+        sp->profile = profile;
+    if (sp->level == FF_LEVEL_UNKNOWN && level > 0)
+        sp->level = level;
+    if (!sp->bit_depth && bit_depth > 0)
+        sp->bit_depth = bit_depth;
+}
+
+int deep_complete(const StreamParams *sp) {
+    return sp->profile != FF_PROFILE_UNKNOWN && sp->level != FF_LEVEL_UNKNOWN && sp->bit_depth > 0;
+}
+
+int parse_h264_sps(const uint8_t *nal, size_t len, StreamParams *sp) {
+    uint8_t rbsp[SPS_PARSE_BYTES];
+    if (len < 4)
+        return -1;
+    BitReader br = { rbsp, nal_to_rbsp(nal + 1, len - 1, rbsp, sizeof(rbsp)), 0 };
+    int profile_idc = br_bits(&br, 8);
+    br_skip(&br, 8);    // constraint_set flags
+    int level_idc = br_bits(&br, 8);
+    br_ue(&br);         // seq_parameter_set_id
+    int bit_depth = 8;
+    switch (profile_idc) {
+    case 100: case 110: case 122: case 244: case 44: case 83: case 86:
+    case 118: case 128: case 138: case 139: case 134: case 135:
+        if (br_ue(&br) == 3)    // chroma_format_idc
+            br_skip(&br, 1);    // separate_colour_plane_flag
+        bit_depth = 8 + br_ue(&br);
+        break;
+    }
+    if (br_overrun(&br) || bit_depth > 14)
+        return -1;
+    deep_set(sp, profile_idc, level_idc, bit_depth);
+    return 0;
+}
+
+// profile_tier_level() of an HEVC VPS or SPS
+void hevc_parse_ptl(BitReader *br, int max_sub_layers_minus1, int *profile, int *level) {
+    int sub_profile[8], sub_level[8];
+    br_skip(br, 3);     // general_profile_space, general_tier_flag
+    *profile = br_bits(br, 5);
+    br_skip(br, 32 + 48);   // compatibility and constraint flags
+    *level = br_bits(br, 8);
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+        sub_profile[i] = br_bits(br, 1);
+        sub_level[i] = br_bits(br, 1);
+    }
+    if (max_sub_layers_minus1 > 0)
+        br_skip(br, 2 * (8 - max_sub_layers_minus1));
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+        if (sub_profile[i]) br_skip(br, 88);
+        if (sub_level[i]) br_skip(br, 8);
+    }
+}
+
+int parse_hevc_vps(const uint8_t *nal, size_t len, StreamParams *sp) {
+    uint8_t rbsp[SPS_PARSE_BYTES];
+    if (len < 3)
+        return -1;
+    BitReader br = { rbsp, nal_to_rbsp(nal + 2, len - 2, rbsp, sizeof(rbsp)), 0 };
+    br_skip(&br, 4 + 2 + 6);    // vps_video_parameter_set_id, base layer flags, vps_max_layers_minus1
+    int max_sub_layers_minus1 = br_bits(&br, 3);
+    br_skip(&br, 1 + 16);       // vps_temporal_id_nesting_flag, vps_reserved_0xffff_16bits
+    int profile, level;
+    hevc_parse_ptl(&br, max_sub_layers_minus1, &profile, &level);
+    if (br_overrun(&br))
+        return -1;
+    deep_set(sp, profile, level, 0);
+    return 0;
+}
+
+int parse_hevc_sps(const uint8_t *nal, size_t len, StreamParams *sp) {
+    uint8_t rbsp[SPS_PARSE_BYTES];
+    if (len < 3)
+        return -1;
+    BitReader br = { rbsp, nal_to_rbsp(nal + 2, len - 2, rbsp, sizeof(rbsp)), 0 };
+    br_skip(&br, 4);            // sps_video_parameter_set_id
+    int max_sub_layers_minus1 = br_bits(&br, 3);
+    br_skip(&br, 1);            // sps_temporal_id_nesting_flag
+    int profile, level;
+    hevc_parse_ptl(&br, max_sub_layers_minus1, &profile, &level);
+    br_ue(&br);                 // sps_seq_parameter_set_id
+    if (br_ue(&br) == 3)        // chroma_format_idc
+        br_skip(&br, 1);
+    br_ue(&br);                 // pic_width_in_luma_samples
+    br_ue(&br);                 // pic_height_in_luma_samples
+    if (br_bits(&br, 1)) {      // conformance_window_flag
+        for (int i = 0; i < 4; i++)
+            br_ue(&br);
+    }
+    int bit_depth = 8 + br_ue(&br);
+    if (br_overrun(&br) || bit_depth > 16)
+        return -1;
+    deep_set(sp, profile, level, bit_depth);
+    return 0;
+}
+
+// Parses nal if it is a parameter set of the stream's codec
+int deep_parse_nal(enum AVCodecID codec_id, const uint8_t *nal, size_t len, StreamParams *sp) {
+    if (len < 1)
+        return -1;
+    if (codec_id == AV_CODEC_ID_H264)
+        return (nal[0] & 0x1f) == 7 ? parse_h264_sps(nal, len, sp) : -1;
+    int type = (nal[0] >> 1) & 0x3f;
+    if (type == 32)
+        return parse_hevc_vps(nal, len, sp);
+    if (type == 33)
+        return parse_hevc_sps(nal, len, sp);
+    return -1;
+}
+
+static inline int is_start_code(const uint8_t *p, size_t size) {
+    return (size >= 3 && p[0] == 0 && p[1] == 0 && p[2] == 1) ||
+           (size >= 4 && p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 1);
+}
+
+// Start-code delimited NAL units, as in MPEG-TS packets and some extradata
+void deep_parse_annexb(enum AVCodecID codec_id, const uint8_t *data, size_t size, StreamParams *sp) {
+    size_t i = 0;
+    while (i + 3 <= size && !deep_complete(sp)) {
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+            i++;
+            continue;
+        }
+        size_t start = i + 3, end = start;
+        while (end + 3 <= size && (data[end] != 0 || data[end + 1] != 0 || data[end + 2] != 1))
+            end++;
+        if (end + 3 > size)
+            end = size;
+        deep_parse_nal(codec_id, data + start, end - start, sp);
+        i = end;
+    }
+}
+
+// Extradata is either Annex B or an avcC/hvcC configuration record
+void deep_parse_extradata(enum AVCodecID codec_id, const uint8_t *data, size_t size, StreamParams *sp) {
+    if (is_start_code(data, size)) {
+        deep_parse_annexb(codec_id, data, size, sp);
+    } else if (codec_id == AV_CODEC_ID_H264 && size >= 8 && data[0] == 1) {
+        deep_set(sp, data[1], data[3], 0);
+        // The first SPS tells the bit depth: numOfSequenceParameterSets, then a 16-bit length
+        size_t len = (size_t)data[6] << 8 | data[7];
+        if ((data[5] & 0x1f) && len <= size - 8)
+            parse_h264_sps(data + 8, len, sp);
+    } else if (codec_id == AV_CODEC_ID_HEVC && size >= 23) {
+        deep_set(sp, data[1] & 0x1f, data[12], 8 + (data[17] & 7));
+    }
+}
+
+const AVDOVIDecoderConfigurationRecord *stream_dovi_config(const AVStream *st) {
+    const uint8_t *data;
+    size_t size;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 31, 102)
+    const AVPacketSideData *sd = av_packet_side_data_get(st->codecpar->coded_side_data,
+        st->codecpar->nb_coded_side_data, AV_PKT_DATA_DOVI_CONF);
+    data = sd ? sd->data : NULL;
+    size = sd ? sd->size : 0;
+#else
+    data = av_stream_get_side_data(st, AV_PKT_DATA_DOVI_CONF, &size);
+#endif
+    return data && size >= sizeof(AVDOVIDecoderConfigurationRecord) ? (const void *)data : NULL;
+}
+
+static inline int deep_needs_packets(const StreamParams *sp) {
+    return stream_deep(sp) == DEEP_HEADER && !deep_complete(sp) &&
+           (sp->codec_id == AV_CODEC_ID_H264 || sp->codec_id == AV_CODEC_ID_HEVC);
+}
+
+// Whether the --deep packet stage still has work for the file
+int deep_pending(const ProbeInfo *info) {
+    for (int i = 0; i < info->nb_streams; i++) {
+        if (deep_needs_packets(&info->streams[i]))
+            return 1;
+    }
+    return 0;
+}
+
+// Whether a cached probe result already went through --deep
+int deep_checked(const ProbeInfo *info) {
+    for (int i = 0; i < info->nb_streams; i++) {
+        if (info->streams[i].codec_type == AVMEDIA_TYPE_VIDEO && !stream_deep(&info->streams[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// The header part of --deep, for a video stream the probe just opened
+void deep_from_header(const AVStream *st, StreamParams *sp) {
+    const AVCodecParameters *par = st->codecpar;
+    stream_set_deep(sp, DEEP_HEADER);
+    sp->level = par->level > 0 ? par->level : FF_LEVEL_UNKNOWN;
+    const AVPixFmtDescriptor *desc = par->format >= 0 ? av_pix_fmt_desc_get(par->format) : NULL;
+    sp->bit_depth = desc ? desc->comp[0].depth : par->bits_per_raw_sample > 0 ? par->bits_per_raw_sample : 0;
+    sp->dovi_profile = -1;
+    stream_set_dovi_compat(sp, 0);
+    const AVDOVIDecoderConfigurationRecord *dovi = stream_dovi_config(st);
+    if (dovi) {
+        sp->dovi_profile = dovi->dv_profile;
+        stream_set_dovi_compat(sp, dovi->dv_bl_signal_compatibility_id);
+    }
+    if ((par->codec_id == AV_CODEC_ID_H264 || par->codec_id == AV_CODEC_ID_HEVC) &&
+        !deep_complete(sp) && par->extradata_size > 0)
+        deep_parse_extradata(par->codec_id, par->extradata, par->extradata_size, sp);
+}
+
+// One keyframe through extract_extradata; without the filter, in-band Annex B is parsed as is
+void deep_parse_keyframe(AVBSFContext *bsf, AVPacket *pkt, StreamParams *sp) {
+    if (!bsf) {
+        if (is_start_code(pkt->data, pkt->size))
+            deep_parse_annexb(sp->codec_id, pkt->data, pkt->size, sp);
+        return;
+    }
+    if (av_bsf_send_packet(bsf, pkt) < 0)
+        return;
+    while (av_bsf_receive_packet(bsf, pkt) >= 0) {
+        size_t size = 0;
+        const uint8_t *extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &size);
+        if (extradata)
+            deep_parse_extradata(sp->codec_id, extradata, size, sp);
+        else if (is_start_code(pkt->data, pkt->size))
+            deep_parse_annexb(sp->codec_id, pkt->data, pkt->size, sp);
+        av_packet_unref(pkt);
+    }
+}
+
+// The packet part of --deep: reads up to the first keyframe of every stream that
+// still needs it. The input is left somewhere past the header afterwards.
+void deep_read_packets(AVFormatContext *fmt_ctx, ProbeInfo *info) {
+    int nb = info->nb_streams < (int)fmt_ctx->nb_streams ? info->nb_streams : (int)fmt_ctx->nb_streams;
+    AVBSFContext **bsf = calloc(nb ? nb : 1, sizeof(AVBSFContext *));
+    const AVBitStreamFilter *filter = av_bsf_get_by_name("extract_extradata");
+    int waiting = 0;
+    for (int i = 0; i < nb; i++) {
+        AVStream *st = fmt_ctx->streams[i];
+        if (!deep_needs_packets(&info->streams[i])) {
+            st->discard = AVDISCARD_ALL;
+            continue;
+        }
+        waiting++;
+        if (filter && av_bsf_alloc(filter, &bsf[i]) >= 0) {
+            bsf[i]->time_base_in = st->time_base;
+            if (avcodec_parameters_copy(bsf[i]->par_in, st->codecpar) < 0 || av_bsf_init(bsf[i]) < 0)
+                av_bsf_free(&bsf[i]);
+        }
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+    int64_t bytes = 0;
+    for (int n = 0; pkt && waiting > 0 && n < DEEP_MAX_PACKETS && bytes < DEEP_MAX_BYTES; n++) {
+        if (av_read_frame(fmt_ctx, pkt) < 0)
+            break;
+        bytes += pkt->size;
+        int i = pkt->stream_index;
+        if (i < nb && (pkt->flags & AV_PKT_FLAG_KEY) && deep_needs_packets(&info->streams[i])) {
+            deep_parse_keyframe(bsf[i], pkt, &info->streams[i]);
+            // Only the first keyframe is looked at; what it didn't tell stays unknown
+            stream_set_deep(&info->streams[i], DEEP_PACKETS);
+            waiting--;
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    for (int i = 0; i < nb; i++) {
+        av_bsf_free(&bsf[i]);
+        if (deep_needs_packets(&info->streams[i]))
+            stream_set_deep(&info->streams[i], DEEP_PACKETS);
+    }
+    free(bsf);
+}
+
+// Opens the file with libavformat and copies out everything the rules need.
+// On failure returns the FFmpeg error and sets *failed_step for brief output.
+// With stats, --io-buffer, --mmap-head or a prefetched head, I/O goes through FileIO; with stats the phases are timed.
+// With keep, a successfully probed input is left open there for the caller to close.
+int probe_file(const char *filepath, const CheckOptions *o, FileHead *head, ProbeInfo *info, const char **failed_step, ProbeStats *stats, ProbeInput *keep) {
+    ProbeInput local;
+    ProbeInput *in = keep ? keep : &local;
+    AVDictionary *opts = NULL;
+    int ret;
+
+    memset(in, 0, sizeof(*in));
+    if (stats)
+        stats->probed = 1;
+    // http(s) goes through RemoteIO, so only the windows the demuxer reads are requested
+    if (is_http_url(filepath)) {
+        if ((ret = remote_io_open(filepath, o, &in->rio, &in->pb)) < 0) {
+            *failed_step = "could not open";
+            return ret;
+        }
+        in->remote = 1;
+        in->fmt_ctx = avformat_alloc_context();
+        in->fmt_ctx->pb = in->pb;
+    }
+    in->custom_io = !is_url(filepath) && (stats || o->io_buffer_size || o->mmap_head || (head && head->fd >= 0));
+    if (in->custom_io) {
+        if ((ret = file_io_open(filepath, o, head, &in->io, &in->pb)) < 0) {
+            *failed_step = "could not open";
+            in->custom_io = 0;
+            return ret;
+        }
+        in->fmt_ctx = avformat_alloc_context();
+        in->fmt_ctx->pb = in->pb;
+    }
+
+    int64_t probesize = o->probesize_limit ? o->probesize_limit : (o->fast_probe ? FAST_PROBESIZE : 0);
+    int64_t analyzeduration = o->analyzeduration_limit ? o->analyzeduration_limit : (o->fast_probe ? FAST_ANALYZEDURATION : 0);
+    if (probesize)
+        av_dict_set_int(&opts, "probesize", probesize, 0);
+    if (analyzeduration)
+        av_dict_set_int(&opts, "analyzeduration", analyzeduration, 0);
+
+    int64_t t0 = av_gettime_relative();
+    ret = avformat_open_input(&in->fmt_ctx, filepath, NULL, &opts);
+    av_dict_free(&opts);
+    int64_t t1 = av_gettime_relative();
+    AVFormatContext *fmt_ctx = in->fmt_ctx;
+    if (ret < 0) {
+        *failed_step = "could not open";
+    } else if (!o->fast_probe || !header_params_sufficient(fmt_ctx)) {
+        // Incomplete header in fast mode: fall back to a regular full probe
+        if (o->fast_probe && !o->probesize_limit)
+            fmt_ctx->probesize = FFMPEG_DEFAULT_PROBESIZE;
+        if (o->fast_probe && !o->analyzeduration_limit)
+            fmt_ctx->max_analyze_duration = 0;
+        if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+            *failed_step = "could not read stream info";
+    }
+    int64_t t2 = av_gettime_relative();
+
+    if (ret >= 0) {
+        info->container = intern(fmt_ctx->iformat && fmt_ctx->iformat->name ? fmt_ctx->iformat->name : "unknown");
+        info->nb_streams = fmt_ctx->nb_streams;
+        info->streams = calloc(fmt_ctx->nb_streams ? fmt_ctx->nb_streams : 1, sizeof(StreamParams));
+        for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+            AVStream *st = fmt_ctx->streams[i];
+            StreamParams *sp = &info->streams[i];
+            sp->codec_type = st->codecpar->codec_type;
+            sp->codec_id = st->codecpar->codec_id;
+            sp->codec_tag = st->codecpar->codec_tag;
+            sp->profile = st->codecpar->profile;
+            AVDictionaryEntry *tag = av_dict_get(st->metadata, "language", NULL, 0);
+            lang_code(sp->lang, tag ? tag->value : NULL);
+            if (o->deep_mode && sp->codec_type == AVMEDIA_TYPE_VIDEO)
+                deep_from_header(st, sp);
+        }
+    }
+
+    if (stats) {
+        stats->open_us = t1 - t0;
+        stats->info_us = t2 - t1;
+        probe_input_counters(in, stats);
+    }
+    if (ret < 0 || !keep)
+        probe_input_close(in);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * --max-inflight-bytes: caps the probe memory of all workers together.
+ * Each probe reserves a worst-case estimate (the probe buffer libavformat
+ * may fill, bounded by the file size, plus the I/O buffer) before opening
+ * the file and waits while the budget is exhausted.  A probe that alone
+ * exceeds the budget still runs once nothing else is in flight.
+ */
+typedef struct {
+    int64_t limit;          // 0: unlimited
+    int64_t inflight;
+    int64_t peak;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+} Budget;
+
+Budget probe_budget = { .lock = PTHREAD_MUTEX_INITIALIZER, .released = PTHREAD_COND_INITIALIZER };
+
+int64_t probe_memory_estimate(const CheckOptions *o, const struct stat *st) {
+    // --fast may fall back to a full probe, so budget for FFmpeg's default
+    int64_t probe = o->probesize_limit ? o->probesize_limit : FFMPEG_DEFAULT_PROBESIZE;
+    if (st && st->st_size < probe)
+        probe = st->st_size;
+    return probe + (o->io_buffer_size ? o->io_buffer_size : FILE_IO_BUFFER_SIZE);
+}
+
+void budget_acquire(Budget *b, int64_t bytes) {
+    pthread_mutex_lock(&b->lock);
+    while (b->limit && b->inflight > 0 && b->inflight + bytes > b->limit)
+        pthread_cond_wait(&b->released, &b->lock);
+    b->inflight += bytes;
+    if (b->inflight > b->peak)
+        b->peak = b->inflight;
+    pthread_mutex_unlock(&b->lock);
+}
+
+void budget_release(Budget *b, int64_t bytes) {
+    pthread_mutex_lock(&b->lock);
+    b->inflight -= bytes;
+    pthread_cond_broadcast(&b->released);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * --stats: per-phase timing and I/O figures for every probed file, reported
+ * as percentiles next to the summary.  Phases are the libavformat open
+ * (header read), find_stream_info, rule evaluation and output formatting.
+ */
+typedef struct {
+    char *path;
+    int64_t open_us;
+    int64_t info_us;
+    int64_t deep_us;
+    int64_t hash_us;
+    int64_t rules_us;
+    int64_t output_us;
+    int64_t total_us;
+    int64_t bytes_read;
+    int reads;
+    int seeks;
+    int connects;
+} FileStats;
+
+typedef struct {
+    FileStats *files;
+    size_t count;
+    size_t capacity;
+    int64_t dispatch_us;    // time the walk spent handing files over
+    pthread_mutex_t lock;
+} StatsCollector;
+
+StatsCollector scan_stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void stats_record(const char *path, const ProbeStats *probe, int64_t rules_us, int64_t output_us, int64_t total_us) {
+    pthread_mutex_lock(&scan_stats.lock);
+    if (scan_stats.count == scan_stats.capacity) {
+        scan_stats.capacity = scan_stats.capacity ? scan_stats.capacity * 2 : 256;
+        scan_stats.files = realloc(scan_stats.files, scan_stats.capacity * sizeof(FileStats));
+    }
+    FileStats *fs = &scan_stats.files[scan_stats.count++];
+    fs->path = strdup(path);
+    fs->open_us = probe->open_us;
+    fs->info_us = probe->info_us;
+    fs->deep_us = probe->deep_us;
+    fs->hash_us = probe->hash_us;
+    fs->rules_us = rules_us;
+    fs->output_us = output_us;
+    fs->total_us = total_us;
+    fs->bytes_read = probe->bytes_read;
+    fs->reads = probe->reads;
+    fs->seeks = probe->seeks;
+    fs->connects = probe->connects;
+    pthread_mutex_unlock(&scan_stats.lock);
+}
+
+int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int compare_total_desc(const void *a, const void *b) {
+    int64_t x = ((const FileStats *)a)->total_us, y = ((const FileStats *)b)->total_us;
+    return (x < y) - (x > y);
+}
+
+// Nearest-rank percentile of a sorted array
+int64_t percentile(const int64_t *sorted, size_t n, int pct) {
+    if (n == 0) return 0;
+    size_t rank = (n * pct + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+const char *format_duration(char *buf, size_t size, int64_t us) {
+    if (us < 1000)
+        snprintf(buf, size, "%lld us", (long long)us);
+    else if (us < 1000000)
+        snprintf(buf, size, "%.1f ms", us / 1000.0);
+    else
+        snprintf(buf, size, "%.2f s", us / 1000000.0);
+    return buf;
+}
+
+const char *format_bytes(char *buf, size_t size, int64_t bytes) {
+    if (bytes < 1024)
+        snprintf(buf, size, "%lld B", (long long)bytes);
+    else if (bytes < 1024 * 1024)
+        snprintf(buf, size, "%.1f KiB", bytes / 1024.0);
+    else
+        snprintf(buf, size, "%.1f MiB", bytes / (1024.0 * 1024.0));
+    return buf;
+}
+
+void print_stats_row(FILE *out, const char *label, int64_t *values, size_t n, int bytes) {
+    char p50[32], p95[32], p99[32], max[32], total[32];
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum += values[i];
+    qsort(values, n, sizeof(int64_t), compare_int64);
+    const char *(*format)(char *, size_t, int64_t) = bytes ? format_bytes : format_duration;
+    fprintf(out, "  %-12s %10s %10s %10s %10s %12s\n", label,
+        format(p50, sizeof(p50), percentile(values, n, 50)),
+        format(p95, sizeof(p95), percentile(values, n, 95)),
+        format(p99, sizeof(p99), percentile(values, n, 99)),
+        format(max, sizeof(max), n ? values[n - 1] : 0),
+        format(total, sizeof(total), sum));
+}
+
+void print_stats(FILE *out, const CheckOptions *o, int64_t wall_us, int64_t walk_us) {
+    size_t n = scan_stats.count;
+    int64_t *values = malloc((n ? n : 1) * sizeof(int64_t));
+    char buf[32];
+    long long reads = 0, seeks = 0, connects = 0;
+    size_t remote = 0;
+
+    fprintf(out, "\n--- Stats ---\n");
+    fprintf(out, "Wall time: %s\n", format_duration(buf, sizeof(buf), wall_us));
+    fprintf(out, "Throughput: %.1f files/s\n", wall_us > 0 ? n * 1e6 / wall_us : 0.0);
+    if (walk_us >= 0)
+        fprintf(out, "Directory walk: %s\n", format_duration(buf, sizeof(buf), walk_us));
+    fprintf(out, "  %-12s %10s %10s %10s %10s %12s\n", "phase", "p50", "p95", "p99", "max", "total");
+
+#define STATS_ROW(label, field, bytes) do { \
+        for (size_t i = 0; i < n; i++) values[i] = scan_stats.files[i].field; \
+        print_stats_row(out, label, values, n, bytes); \
+    } while (0)
+    STATS_ROW("open", open_us, 0);
+    STATS_ROW("stream_info", info_us, 0);
+    if (o->deep_mode)
+        STATS_ROW("deep", deep_us, 0);
+    if (dedupe_mode)
+        STATS_ROW("hash", hash_us, 0);
+    STATS_ROW("rules", rules_us, 0);
+    STATS_ROW("output", output_us, 0);
+    STATS_ROW("per file", total_us, 0);
+    STATS_ROW("bytes read", bytes_read, 1);
+#undef STATS_ROW
+
+    for (size_t i = 0; i < n; i++) {
+        reads += scan_stats.files[i].reads;
+        seeks += scan_stats.files[i].seeks;
+        connects += scan_stats.files[i].connects;
+        remote += scan_stats.files[i].connects > 0;
+    }
+    fprintf(out, "Reads: %lld, seeks: %lld\n", reads, seeks);
+    if (remote)
+        fprintf(out, "HTTP connections opened: %lld (%.1f per remote file)\n", connects, (double)connects / remote);
+    fprintf(out, "Peak in-flight probe budget: %s", format_bytes(buf, sizeof(buf), probe_budget.peak));
+    if (probe_budget.limit)
+        fprintf(out, " of %s", format_bytes(buf, sizeof(buf), probe_budget.limit));
+    fputc('\n', out);
+
+    qsort(scan_stats.files, n, sizeof(FileStats), compare_total_desc);
+    fprintf(out, "Slowest files:\n");
+    for (size_t i = 0; i < n && i < 10; i++) {
+        const FileStats *fs = &scan_stats.files[i];
+        char bytes[32];
+        fprintf(out, "  %10s %10s  %s\n", format_duration(buf, sizeof(buf), fs->total_us),
+            format_bytes(bytes, sizeof(bytes), fs->bytes_read), fs->path);
+    }
+    free(values);
+}
+
+void stats_free(void) {
+    for (size_t i = 0; i < scan_stats.count; i++)
+        free(scan_stats.files[i].path);
+    free(scan_stats.files);
+}
+
+/*
+ * Persistent probe cache (--cache FILE)
+ *
+ * Maps a path to the probe result of the file it named when the entry was
+ * written.  An entry is only reused while (dev, inode, size, mtime) still
+ * match, so replaced or rewritten files are probed again.  The file is an
+ * image of fixed-layout records that is mmap()ed and looked up in place,
+ * with nothing to parse when it is opened.  Opening checks the header, the
+ * section bounds and a checksum over the header and the two small tables
+ * (codecs and names); a record is only checked when a lookup reaches it,
+ * and one that points outside its sections counts as a miss.
+ *
+ *   CacheHeader
+ *   CacheRecord records[nb_records]
+ *   uint32_t slots[nb_slots]            by hash_string(path), open addressing: record index + 1, 0 if empty
+ *   StreamParams streams[nb_streams]    the streams of each record, one after the other
+ *   CacheCodec codecs[nb_codecs]        every codec ID the streams use, with its name
+ *   uint32_t names[nb_names]            the container names records refer to by index
+ *   char strings[strings_size]          paths and names, each NUL-terminated
+ *
+ * Entries stored during a run are kept in memory next to the mapping and
+ * take precedence over its records; a save writes both into a new image
+ * that replaces the mapped one.  Codec IDs may change between FFmpeg
+ * releases, so the stored IDs are translated through the codec table by
+ * name; a record using a codec the linked libavcodec doesn't know is a miss.
+ * An image written by a different kind of machine is ignored and rebuilt.
+ *
+ * Caches written before the image, and --journal files, use a line
+ * format: one "F" line per file followed by one "S" line per stream:
+ *
+ *   F <dev> <ino> <size> <mtime_sec> <mtime_nsec> <nb_streams> <container> <path>
+ *   S <codec_type> <codec_name> <codec_tag> <profile> <lang> [<deep> <level> <bit_depth> <dovi_profile> <dovi_compat>]
+ *
+ * Fields are tab separated; the bracketed ones are only written for streams
+ * inspected by --deep, so older readers still take the lines.  Codecs are
+ * stored by name; an entry naming a codec the linked libavcodec doesn't
+ * know is dropped and probed again.  An old cache is read once and saved
+ * as an image.
+ */
+#define CACHE_MAGIC "# check_tv_compat probe cache v1"
+#define CACHE_IMAGE_MAGIC "CTVcache"        // 8 bytes, no terminator
+#define CACHE_IMAGE_VERSION 3
+#define CACHE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // CACHE_BYTE_ORDER as the writer stored it
+    uint32_t record_size;       // the writer's sizeof(CacheRecord) and sizeof(StreamParams)
+    uint32_t stream_size;
+    uint32_t nb_records;
+    uint32_t nb_slots;          // power of two
+    uint32_t nb_streams;
+    uint32_t nb_codecs;
+    uint32_t nb_names;
+    uint32_t checksum;          // see cache_image_checksum
+    uint64_t strings_size;
+} CacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int32_t mtime_nsec;
+    uint32_t path;              // offset into the strings
+    uint32_t container;         // index into the names
+    uint32_t first_stream;
+    uint32_t nb_streams;
+    uint32_t unused;
+} CacheRecord;
+
+typedef struct {
+    int32_t id;
+    uint32_t name;              // offset into the strings
+} CacheCodec;
+
+// A stored codec ID and the linked libavcodec's ID for its name, -1 if it doesn't know it
+typedef struct {
+    int32_t stored;
+    int32_t id;
+} CacheCodecMap;
+
+// A mapped image; map is NULL without one
+typedef struct {
+    uint8_t *map;
+    size_t size;
+    const CacheHeader *header;
+    const CacheRecord *records;
+    const uint32_t *slots;
+    const StreamParams *streams;
+    const char *strings;
+    const char **names;         // the container names, interned once when the image is mapped
+    CacheCodecMap *codecs;      // nb_codecs
+} CacheImage;
+
+typedef struct {
+    char *path;
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    char kind;          // 'F'; a --journal also has 'E' (could not be probed), 'D' (duplicate) and 'R' (resolved by a fix)
+    int errnum;         // 'E' only
+    char *detail;       // 'E': the step that failed, 'D': the original, 'R': the fix; NULL if not recorded
+    ProbeInfo info;
+} CacheEntry;
+
+typedef struct {
+    const char *filename;
+    CacheEntry **slots;
+    size_t capacity;    // power of two
+    size_t count;
+    CacheImage image;   // --cache: the file as last saved, behind the entries above
+    int dirty;
+    int hits;
+    int misses;
+    pthread_mutex_t lock;
+} ProbeCache;
+
+long stat_mtime_nsec(const struct stat *st) {
+#if defined(__APPLE__)
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+// Whether a was modified after b
+int stat_newer(const struct stat *a, const struct stat *b) {
+    return a->st_mtime > b->st_mtime ||
+           (a->st_mtime == b->st_mtime && stat_mtime_nsec(a) > stat_mtime_nsec(b));
+}
+
+CacheEntry **cache_slot(ProbeCache *cache, const char *path) {
+    size_t mask = cache->capacity - 1;
+    size_t i = hash_string(path) & mask;
+    while (cache->slots[i] && strcmp(cache->slots[i]->path, path) != 0)
+        i = (i + 1) & mask;
+    return &cache->slots[i];
+}
+
+void cache_entry_free(CacheEntry *e) {
+    free(e->path);
+    free(e->detail);
+    probe_info_free(&e->info);
+    free(e);
+}
+
+// Inserts or replaces the entry for e->path; the cache takes ownership
+void cache_insert(ProbeCache *cache, CacheEntry *e) {
+    if ((cache->count + 1) * 10 > cache->capacity * 7) {
+        CacheEntry **old = cache->slots;
+        size_t old_capacity = cache->capacity;
+        cache->capacity *= 2;
+        cache->slots = calloc(cache->capacity, sizeof(CacheEntry *));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i])
+                *cache_slot(cache, old[i]->path) = old[i];
+        }
+        free(old);
+    }
+    CacheEntry **slot = cache_slot(cache, e->path);
+    if (*slot)
+        cache_entry_free(*slot);
+    else
+        cache->count++;
+    *slot = e;
+}
+
+// Splits off the next tab-separated field in place
+char *next_field(char **cursor) {
+    char *field = *cursor;
+    if (!field) return NULL;
+    char *tab = strchr(field, '\t');
+    if (tab) {
+        *tab = '\0';
+        *cursor = tab + 1;
+    } else {
+        *cursor = NULL;
+    }
+    return field;
+}
+
+int cache_parse_stream(char *line, StreamParams *sp) {
+    char *cursor = line;
+    char *kind = next_field(&cursor);
+    char *type = next_field(&cursor);
+    char *codec = next_field(&cursor);
+    char *tag = next_field(&cursor);
+    char *profile = next_field(&cursor);
+    char *lang = next_field(&cursor);
+    if (!kind || strcmp(kind, "S") != 0 || !lang)
+        return -1;
+    const AVCodecDescriptor *desc = avcodec_descriptor_get_by_name(codec);
+    if (!desc && strcmp(codec, "none") != 0)
+        return -1;
+    sp->codec_type = atoi(type);
+    sp->codec_id = desc ? desc->id : AV_CODEC_ID_NONE;
+    sp->codec_tag = (uint32_t)strtoul(tag, NULL, 16);
+    sp->profile = atoi(profile);
+    lang_code(sp->lang, lang);
+    char *deep = next_field(&cursor);
+    char *level = next_field(&cursor);
+    char *bit_depth = next_field(&cursor);
+    char *dovi_profile = next_field(&cursor);
+    char *dovi_compat = next_field(&cursor);
+    if (dovi_compat) {
+        stream_set_deep(sp, atoi(deep));
+        sp->level = atoi(level);
+        sp->bit_depth = atoi(bit_depth);
+        sp->dovi_profile = atoi(dovi_profile);
+        stream_set_dovi_compat(sp, atoi(dovi_compat));
+    }
+    return 0;
+}
+
+// Reads the next complete entry: an F line and its S lines, or in a journal
+// an E, D or R line; NULL at the end of the data.  A line without its newline
+// was cut short by a crash and ends the data as well.
+CacheEntry *cache_read_entry(FILE *fp, char **line, size_t *cap) {
+    ssize_t len;
+    while ((len = getline(line, cap, fp)) > 0) {
+        if ((*line)[len - 1] != '\n')
+            return NULL;
+        (*line)[--len] = '\0';
+        char *cursor = *line;
+        char *kind = next_field(&cursor);
+        char *dev = next_field(&cursor);
+        char *ino = next_field(&cursor);
+        char *size = next_field(&cursor);
+        char *mtime_sec = next_field(&cursor);
+        char *mtime_nsec = next_field(&cursor);
+        char *nb_streams = next_field(&cursor);
+        char *container = next_field(&cursor);
+        char *path = cursor;
+        if (!kind || !strchr("FEDR", kind[0]) || kind[1] || !path)
+            continue;
+
+        CacheEntry *e = calloc(1, sizeof(CacheEntry));
+        e->kind = kind[0];
+        e->dev = strtoull(dev, NULL, 10);
+        e->ino = strtoull(ino, NULL, 10);
+        e->size = strtoll(size, NULL, 10);
+        e->mtime_sec = strtoll(mtime_sec, NULL, 10);
+        e->mtime_nsec = strtol(mtime_nsec, NULL, 10);
+        e->path = strdup(path);
+        if (e->kind != 'F') {
+            // E: the probe's error code; D, R: unused
+            e->errnum = atoi(nb_streams);
+            if (container && strcmp(container, "-") != 0)
+                e->detail = strdup(container);
+            e->info.streams = calloc(1, sizeof(StreamParams));
+            return e;
+        }
+        e->info.container = intern(container ? container : "unknown");
+        e->info.nb_streams = atoi(nb_streams);
+        e->info.streams = calloc(e->info.nb_streams > 0 ? e->info.nb_streams : 1, sizeof(StreamParams));
+        int ok = e->info.nb_streams >= 0;
+        for (int i = 0; ok && i < e->info.nb_streams; i++) {
+            len = getline(line, cap, fp);
+            if (len <= 0 || (*line)[len - 1] != '\n') {
+                cache_entry_free(e);
+                return NULL;
+            }
+            (*line)[--len] = '\0';
+            if (cache_parse_stream(*line, &e->info.streams[i]) < 0) ok = 0;
+        }
+        if (ok)
+            return e;
+        cache_entry_free(e);
+    }
+    return NULL;
+}
+
+// Loads the entries of cache->filename; returns the offset after the last
+// complete entry, -1 if the file doesn't exist, -2 if it can't be opened and
+// -3 if it doesn't start with magic
+off_t cache_load(ProbeCache *cache, const char *magic) {
+    FILE *fp = fopen(cache->filename, "r");
+    if (!fp) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Could not open '%s': %s\n", cache->filename, strerror(errno));
+            return -2;
+        }
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, fp);
+    if (len < 0 || strncmp(line, magic, strlen(magic)) != 0 || line[len - 1] != '\n') {
+        free(line);
+        fclose(fp);
+        return -3;
+    }
+    off_t end = ftello(fp);
+    CacheEntry *e;
+    while ((e = cache_read_entry(fp, &line, &cap)) != NULL) {
+        cache_insert(cache, e);
+        end = ftello(fp);
+    }
+    free(line);
+    fclose(fp);
+    return end;
+}
+
+ProbeCache *cache_create(const char *filename) {
+    ProbeCache *cache = calloc(1, sizeof(ProbeCache));
+    cache->filename = filename;
+    cache->capacity = 1024;
+    cache->slots = calloc(cache->capacity, sizeof(CacheEntry *));
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void cache_image_unmap(CacheImage *img) {
+    if (img->map)
+        munmap(img->map, img->size);
+    free(img->names);
+    free(img->codecs);
+    memset(img, 0, sizeof(*img));
+}
+
+// FNV-1a over the header (with checksum as 0), the codec table and the name table
+uint32_t cache_image_checksum(const CacheHeader *h, const CacheCodec *codecs, const uint32_t *names) {
+    CacheHeader copy = *h;
+    copy.checksum = 0;
+    uint64_t sum = hash_bytes_from(14695981039346656037ULL, &copy, sizeof(copy));
+    sum = hash_bytes_from(sum, codecs, (size_t)h->nb_codecs * sizeof(CacheCodec));
+    sum = hash_bytes_from(sum, names, (size_t)h->nb_names * sizeof(uint32_t));
+    return (uint32_t)(sum ^ sum >> 32);
+}
+
+// Maps filename as a cache image; returns 0, -1 if the file doesn't exist,
+// -2 if it can't be read, -3 if it isn't an image and -4 if the image is
+// damaged or was written by an incompatible build
+int cache_image_map(CacheImage *img, const char *filename) {
+    memset(img, 0, sizeof(*img));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+            return -2;
+        }
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader)) {
+        close(fd);
+        return -3;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map '%s': %s\n", filename, strerror(errno));
+        return -2;
+    }
+    img->map = map;
+    img->size = st.st_size;
+    const CacheHeader *h = img->header = map;
+    if (memcmp(h->magic, CACHE_IMAGE_MAGIC, sizeof(h->magic)) != 0) {
+        cache_image_unmap(img);
+        return -3;
+    }
+
+    // Only the header and the small tables are looked at here; records are checked by the lookups
+    uint64_t offset = sizeof(CacheHeader);
+    uint64_t records = offset, slots, streams, codecs, names, strings;
+    int ok = h->version == CACHE_IMAGE_VERSION && h->byte_order == CACHE_BYTE_ORDER &&
+             h->record_size == sizeof(CacheRecord) && h->stream_size == sizeof(StreamParams) &&
+             h->nb_slots > h->nb_records && (h->nb_slots & (h->nb_slots - 1)) == 0 &&
+             h->strings_size > 0 && h->strings_size <= UINT32_MAX;
+    if (ok) {
+        offset += (uint64_t)h->nb_records * sizeof(CacheRecord);
+        slots = offset;
+        offset += (uint64_t)h->nb_slots * sizeof(uint32_t);
+        streams = offset;
+        offset += (uint64_t)h->nb_streams * sizeof(StreamParams);
+        codecs = offset;
+        offset += (uint64_t)h->nb_codecs * sizeof(CacheCodec);
+        names = offset;
+        offset += (uint64_t)h->nb_names * sizeof(uint32_t);
+        strings = offset;
+        offset += h->strings_size;
+        ok = offset == img->size && img->map[img->size - 1] == '\0';
+    }
+    const CacheCodec *codec = ok ? (const CacheCodec *)(img->map + codecs) : NULL;
+    const uint32_t *name = ok ? (const uint32_t *)(img->map + names) : NULL;
+    ok = ok && h->checksum == cache_image_checksum(h, codec, name);
+    for (uint32_t i = 0; ok && i < h->nb_codecs; i++)
+        ok = codec[i].name < h->strings_size;
+    for (uint32_t i = 0; ok && i < h->nb_names; i++)
+        ok = name[i] < h->strings_size;
+    if (ok) {
+        img->records = (const CacheRecord *)(img->map + records);
+        img->slots = (const uint32_t *)(img->map + slots);
+        img->streams = (const StreamParams *)(img->map + streams);
+        img->strings = (const char *)(img->map + strings);
+        // The IDs are those of the libavcodec that wrote them; names carry over to this one
+        img->codecs = calloc(h->nb_codecs ? h->nb_codecs : 1, sizeof(CacheCodecMap));
+        for (uint32_t i = 0; i < h->nb_codecs; i++) {
+            const char *codec_name = img->strings + codec[i].name;
+            const AVCodecDescriptor *desc = avcodec_descriptor_get_by_name(codec_name);
+            img->codecs[i].stored = codec[i].id;
+            img->codecs[i].id = desc ? (int)desc->id : strcmp(codec_name, "none") == 0 ? AV_CODEC_ID_NONE : -1;
+        }
+        img->names = calloc(h->nb_names ? h->nb_names : 1, sizeof(const char *));
+        for (uint32_t i = 0; i < h->nb_names; i++)
+            img->names[i] = intern(img->strings + name[i]);
+    }
+    if (!ok) {
+        cache_image_unmap(img);
+        return -4;
+    }
+    return 0;
+}
+
+// The linked libavcodec's ID for a codec ID stored in the image, -1 if there is none
+int cache_image_codec(const CacheImage *img, int32_t stored) {
+    for (uint32_t i = 0; i < img->header->nb_codecs; i++) {
+        if (img->codecs[i].stored == stored)
+            return img->codecs[i].id;
+    }
+    return -1;
+}
+
+// Whether record r lies within the image and all its codecs are known here
+int cache_image_record_usable(const CacheImage *img, const CacheRecord *r) {
+    const CacheHeader *h = img->header;
+    if (r->container >= h->nb_names || (uint64_t)r->first_stream + r->nb_streams > h->nb_streams)
+        return 0;
+    for (uint32_t i = 0; i < r->nb_streams; i++) {
+        if (cache_image_codec(img, img->streams[r->first_stream + i].codec_id) < 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Copies the streams of a usable record to out, with this libavcodec's codec IDs
+void cache_image_streams(const CacheImage *img, const CacheRecord *r, StreamParams *out) {
+    memcpy(out, img->streams + r->first_stream, r->nb_streams * sizeof(StreamParams));
+    for (uint32_t i = 0; i < r->nb_streams; i++)
+        out[i].codec_id = cache_image_codec(img, out[i].codec_id);
+}
+
+// Index of the usable record for path in the image, -1 if there is none
+long cache_image_find(const CacheImage *img, const char *path) {
+    if (!img->map)
+        return -1;
+    const CacheHeader *h = img->header;
+    uint32_t mask = h->nb_slots - 1;
+    uint32_t i = hash_string(path) & mask;
+    // Bounded, so a damaged slot table can't loop forever
+    for (uint32_t n = 0; n < h->nb_slots && img->slots[i]; n++) {
+        uint32_t index = img->slots[i] - 1;
+        if (index < h->nb_records) {
+            const CacheRecord *r = &img->records[index];
+            if ((uint64_t)r->path < h->strings_size && strcmp(img->strings + r->path, path) == 0)
+                return cache_image_record_usable(img, r) ? (long)index : -1;
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+ProbeCache *cache_open(const char *filename) {
+    ProbeCache *cache = cache_create(filename);
+    switch (cache_image_map(&cache->image, filename)) {
+    case -3:
+        // An older cache in the line format, or something else entirely
+        if (cache_load(cache, CACHE_MAGIC) == -3)
+            fprintf(stderr, "Ignoring cache '%s': unrecognized format\n", filename);
+        else
+            cache->dirty = 1;
+        break;
+    case -4:
+        fprintf(stderr, "Ignoring cache '%s': damaged or written by another build, rebuilding it\n", filename);
+        cache->dirty = 1;
+        break;
+    }
+    return cache;
+}
+
+// Appends e in the file format
+void cache_format_entry(StrBuf *sb, const CacheEntry *e) {
+    if (e->kind != 'F') {
+        const char *detail = e->detail && *e->detail && !strpbrk(e->detail, "\t\n") ? e->detail : "-";
+        sb_appendf(sb, "%c\t%llu\t%llu\t%lld\t%lld\t%ld\t%d\t%s\t%s\n", e->kind,
+            e->dev, e->ino, e->size, e->mtime_sec, e->mtime_nsec, e->errnum, detail, e->path);
+        return;
+    }
+    sb_appendf(sb, "F\t%llu\t%llu\t%lld\t%lld\t%ld\t%d\t%s\t%s\n",
+        e->dev, e->ino, e->size, e->mtime_sec, e->mtime_nsec,
+        e->info.nb_streams, e->info.container, e->path);
+    for (int j = 0; j < e->info.nb_streams; j++) {
+        const StreamParams *sp = &e->info.streams[j];
+        sb_appendf(sb, "S\t%d\t%s\t%08x\t%d\t%s",
+            (int)sp->codec_type, avcodec_get_name(sp->codec_id),
+            (unsigned)sp->codec_tag, sp->profile, *sp->lang ? sp->lang : "und");
+        if (stream_deep(sp))
+            sb_appendf(sb, "\t%d\t%d\t%d\t%d\t%d", stream_deep(sp), sp->level, sp->bit_depth,
+                sp->dovi_profile, stream_dovi_compat(sp));
+        sb_append(sb, "\n");
+    }
+}
+
+// Index of the interned name in names, appending it if it isn't there yet
+uint32_t cache_name_index(const char **names, uint32_t *count, const char *name) {
+    for (uint32_t i = 0; i < *count; i++) {
+        if (names[i] == name) return i;
+    }
+    names[*count] = name;
+    return (*count)++;
+}
+
+// Writes the entries and the image records they don't replace as a new
+// image, renames it over the old file and maps it in place of the old one;
+// the entries are released once the new image is mapped
+int cache_save(ProbeCache *cache) {
+    CacheImage *img = &cache->image;
+    uint32_t in_image = img->map ? img->header->nb_records : 0;
+    size_t max_records = cache->count + in_image;
+    if (max_records >= UINT32_MAX / 4) {
+        fprintf(stderr, "Could not write cache '%s': too many entries\n", cache->filename);
+        return -1;
+    }
+    // Each record's path and streams, from an entry or from the old image
+    typedef struct {
+        const char *path;
+        const StreamParams *streams;
+    } Source;
+    CacheRecord *records = calloc(max_records ? max_records : 1, sizeof(CacheRecord));
+    Source *sources = calloc(max_records ? max_records : 1, sizeof(Source));
+    // The image's streams, translated to this libavcodec's IDs
+    StreamParams *old_streams = calloc(in_image && img->header->nb_streams ? img->header->nb_streams : 1, sizeof(StreamParams));
+    uint32_t nb_old_streams = 0;
+    const char **names = calloc(max_records ? max_records : 1, sizeof(const char *));
+    uint32_t nb_records = 0, nb_names = 0, nb_streams = 0;
+    uint64_t strings_size = 0;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        const CacheEntry *e = cache->slots[i];
+        if (!e || e->kind != 'F') continue;
+        CacheRecord *r = &records[nb_records];
+        r->dev = e->dev;
+        r->ino = e->ino;
+        r->size = e->size;
+        r->mtime_sec = e->mtime_sec;
+        r->mtime_nsec = e->mtime_nsec;
+        r->container = cache_name_index(names, &nb_names, e->info.container);
+        r->first_stream = nb_streams;
+        r->nb_streams = e->info.nb_streams;
+        r->path = strings_size;
+        sources[nb_records++] = (Source){ e->path, e->info.streams };
+        nb_streams += r->nb_streams;
+        strings_size += strlen(e->path) + 1;
+    }
+    for (uint32_t i = 0; i < in_image; i++) {
+        const CacheRecord *old = &img->records[i];
+        // Records a lookup would ignore are dropped, as are streams a damaged image shares between records
+        if (old->path >= img->header->strings_size || !cache_image_record_usable(img, old) ||
+            nb_old_streams + old->nb_streams > img->header->nb_streams) continue;
+        const char *path = img->strings + old->path;
+        if (*cache_slot(cache, path)) continue;
+        CacheRecord *r = &records[nb_records];
+        *r = *old;
+        r->container = cache_name_index(names, &nb_names, img->names[old->container]);
+        r->first_stream = nb_streams;
+        r->path = strings_size;
+        cache_image_streams(img, old, old_streams + nb_old_streams);
+        sources[nb_records++] = (Source){ path, old_streams + nb_old_streams };
+        nb_old_streams += r->nb_streams;
+        nb_streams += r->nb_streams;
+        strings_size += strlen(path) + 1;
+    }
+
+    // Few codecs in practice, so a linear search is enough
+    CacheCodec *codecs = calloc(nb_streams ? nb_streams : 1, sizeof(CacheCodec));
+    uint32_t nb_codecs = 0;
+    for (uint32_t i = 0; i < nb_records; i++) {
+        for (uint32_t j = 0; j < records[i].nb_streams; j++) {
+            int32_t id = sources[i].streams[j].codec_id;
+            uint32_t k = 0;
+            while (k < nb_codecs && codecs[k].id != id) k++;
+            if (k == nb_codecs)
+                codecs[nb_codecs++].id = id;
+        }
+    }
+    uint32_t nb_slots = 16;
+    while (nb_slots * 7ULL < nb_records * 10ULL) nb_slots *= 2;
+    uint32_t *slots = calloc(nb_slots, sizeof(uint32_t));
+    for (uint32_t i = 0; i < nb_records; i++) {
+        uint32_t j = hash_string(sources[i].path) & (nb_slots - 1);
+        while (slots[j]) j = (j + 1) & (nb_slots - 1);
+        slots[j] = i + 1;
+    }
+    uint32_t *name_offsets = calloc(nb_names ? nb_names : 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < nb_names; i++) {
+        name_offsets[i] = strings_size;
+        strings_size += strlen(names[i]) + 1;
+    }
+    for (uint32_t i = 0; i < nb_codecs; i++) {
+        codecs[i].name = strings_size;
+        strings_size += strlen(avcodec_get_name(codecs[i].id)) + 1;
+    }
+
+    int ret = -1;
+    char tmp[PATH_BUF_SIZE];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", cache->filename, (long)getpid());
+    FILE *fp = NULL;
+    if (strings_size > UINT32_MAX) {
+        fprintf(stderr, "Could not write cache '%s': too many entries\n", cache->filename);
+        goto done;
+    }
+    // An empty image still has one byte of strings, so its last byte is always a terminator
+    if (strings_size == 0) strings_size = 1;
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write cache '%s': %s\n", tmp, strerror(errno));
+        goto done;
+    }
+    CacheHeader h = {
+        .version = CACHE_IMAGE_VERSION, .byte_order = CACHE_BYTE_ORDER,
+        .record_size = sizeof(CacheRecord), .stream_size = sizeof(StreamParams),
+        .nb_records = nb_records, .nb_slots = nb_slots, .nb_streams = nb_streams,
+        .nb_codecs = nb_codecs, .nb_names = nb_names, .strings_size = strings_size,
+    };
+    memcpy(h.magic, CACHE_IMAGE_MAGIC, sizeof(h.magic));
+    h.checksum = cache_image_checksum(&h, codecs, name_offsets);
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(records, sizeof(CacheRecord), nb_records, fp);
+    fwrite(slots, sizeof(uint32_t), nb_slots, fp);
+    for (uint32_t i = 0; i < nb_records; i++)
+        fwrite(sources[i].streams, sizeof(StreamParams), records[i].nb_streams, fp);
+    fwrite(codecs, sizeof(CacheCodec), nb_codecs, fp);
+    fwrite(name_offsets, sizeof(uint32_t), nb_names, fp);
+    for (uint32_t i = 0; i < nb_records; i++)
+        fwrite(sources[i].path, 1, strlen(sources[i].path) + 1, fp);
+    for (uint32_t i = 0; i < nb_names; i++)
+        fwrite(names[i], 1, strlen(names[i]) + 1, fp);
+    for (uint32_t i = 0; i < nb_codecs; i++) {
+        const char *name = avcodec_get_name(codecs[i].id);
+        fwrite(name, 1, strlen(name) + 1, fp);
+    }
+    if (nb_records + nb_names + nb_codecs == 0)
+        fputc('\0', fp);
+    int failed = ferror(fp);
+    if (fclose(fp) != 0 || failed || rename(tmp, cache->filename) != 0) {
+        fprintf(stderr, "Could not write cache '%s': %s\n", cache->filename, strerror(errno));
+        unlink(tmp);
+        goto done;
+    }
+
+    // The old mapping, and the entries, stay usable until the new one is in place
+    CacheImage saved;
+    if (cache_image_map(&saved, cache->filename) != 0) {
+        fprintf(stderr, "Could not reopen cache '%s'\n", cache->filename);
+        goto done;
+    }
+    cache_image_unmap(img);
+    *img = saved;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        if (cache->slots[i]) {
+            cache_entry_free(cache->slots[i]);
+            cache->slots[i] = NULL;
+        }
+    }
+    cache->count = 0;
+    ret = 0;
+done:
+    free(records);
+    free(sources);
+    free(old_streams);
+    free(names);
+    free(codecs);
+    free(slots);
+    free(name_offsets);
+    return ret;
+}
+
+// Saves the cache if anything changed since the last save
+void cache_flush(ProbeCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->dirty && cache_save(cache) == 0)
+        cache->dirty = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_close(ProbeCache *cache) {
+    if (cache->dirty)
+        cache_save(cache);
+    for (size_t i = 0; i < cache->capacity; i++) {
+        if (cache->slots[i])
+            cache_entry_free(cache->slots[i]);
+    }
+    free(cache->slots);
+    cache_image_unmap(&cache->image);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+int cache_entry_matches(const CacheEntry *e, const struct stat *st) {
+    return e->dev == (unsigned long long)st->st_dev &&
+           e->ino == (unsigned long long)st->st_ino &&
+           e->size == (long long)st->st_size &&
+           e->mtime_sec == (long long)st->st_mtime &&
+           e->mtime_nsec == stat_mtime_nsec(st);
+}
+
+void probe_info_copy(ProbeInfo *dst, const ProbeInfo *src) {
+    *dst = *src;
+    dst->streams = calloc(src->nb_streams > 0 ? src->nb_streams : 1, sizeof(StreamParams));
+    if (src->nb_streams > 0)
+        memcpy(dst->streams, src->streams, src->nb_streams * sizeof(StreamParams));
+}
+
+int cache_record_matches(const CacheRecord *r, const struct stat *st) {
+    return r->dev == (uint64_t)st->st_dev &&
+           r->ino == (uint64_t)st->st_ino &&
+           r->size == (int64_t)st->st_size &&
+           r->mtime_sec == (int64_t)st->st_mtime &&
+           r->mtime_nsec == stat_mtime_nsec(st);
+}
+
+// The still-valid entry or image record for path: returns 1 with *entry set,
+// 2 with *record set, 0 on a miss.  An entry hides the image's record even
+// when the entry itself is stale.  Called with the lock held.
+int cache_find(ProbeCache *cache, const char *path, const struct stat *st,
+               const CacheEntry **entry, long *record) {
+    const CacheEntry *e = *cache_slot(cache, path);
+    if (e) {
+        *entry = e;
+        return cache_entry_matches(e, st);
+    }
+    long index = cache_image_find(&cache->image, path);
+    if (index < 0 || !cache_record_matches(&cache->image.records[index], st))
+        return 0;
+    *record = index;
+    return 2;
+}
+
+// Fills info from a still-valid cache entry; returns 1 on hit
+int cache_lookup(ProbeCache *cache, const char *path, const struct stat *st, ProbeInfo *info) {
+    const CacheEntry *e;
+    long index;
+    pthread_mutex_lock(&cache->lock);
+    int found = cache_find(cache, path, st, &e, &index);
+    if (found == 1) {
+        probe_info_copy(info, &e->info);
+    } else if (found == 2) {
+        const CacheRecord *r = &cache->image.records[index];
+        info->container = cache->image.names[r->container];
+        info->nb_streams = r->nb_streams;
+        info->streams = calloc(r->nb_streams > 0 ? r->nb_streams : 1, sizeof(StreamParams));
+        cache_image_streams(&cache->image, r, info->streams);
+    }
+    if (found)
+        cache->hits++;
+    else
+        cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return found != 0;
+}
+
+// Whether cache_lookup would hit, without counting it or copying the entry
+int cache_has(ProbeCache *cache, const char *path, const struct stat *st) {
+    const CacheEntry *e;
+    long index;
+    pthread_mutex_lock(&cache->lock);
+    int hit = cache_find(cache, path, st, &e, &index) != 0;
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+void cache_store(ProbeCache *cache, const char *path, const struct stat *st, const ProbeInfo *info) {
+    CacheEntry *e = calloc(1, sizeof(CacheEntry));
+    e->path = strdup(path);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime_sec = st->st_mtime;
+    e->mtime_nsec = stat_mtime_nsec(st);
+    e->kind = 'F';
+    probe_info_copy(&e->info, info);
+    pthread_mutex_lock(&cache->lock);
+    cache_insert(cache, e);
+    cache->dirty = 1;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Writes s as a JSON string literal; invalid UTF-8 bytes become U+FFFD
+void json_write_string(FILE *out, const char *s) {
+    const unsigned char *p = (const unsigned char *)s;
+    fputc('"', out);
+    while (*p) {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+            p++;
+        } else if (c < 0x20) {
+            switch (c) {
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default: fprintf(out, "\\u%04x", c); break;
+            }
+            p++;
+        } else if (c < 0x80) {
+            fputc(c, out);
+            p++;
+        } else {
+            int len = (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 : (c & 0xf8) == 0xf0 ? 4 : 0;
+            int valid = len > 0;
+            for (int k = 1; valid && k < len; k++)
+                valid = (p[k] & 0xc0) == 0x80;
+            if (valid) {
+                fwrite(p, 1, len, out);
+                p += len;
+            } else {
+                fputs("\\ufffd", out);
+                p++;
+            }
+        }
+    }
+    fputc('"', out);
+}
+
+int hex_digit(int c) {
+    return c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+}
+
+// Four hex digits at p, -1 if they aren't
+long json_read_hex4(const char *p) {
+    long v = 0;
+    for (int k = 0; k < 4; k++) {
+        int d = hex_digit((unsigned char)p[k]);
+        if (d < 0)
+            return -1;
+        v = v << 4 | d;
+    }
+    return v;
+}
+
+/*
+ * The JSON string literal at p, unescaped and NUL-terminated in a new
+ * allocation; *endp is set past its closing quote.  NULL if p is not a
+ * complete string literal.
+ */
+char *json_read_string(const char *p, const char **endp) {
+    if (*p++ != '"')
+        return NULL;
+    char storage[512];
+    StrBuf sb;
+    sb_init(&sb, storage, sizeof(storage));
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            const char *run = p;
+            while (*p && *p != '"' && *p != '\\')
+                p++;
+            sb_append_len(&sb, run, p - run);
+            continue;
+        }
+        char c = p[1];
+        const char *simple = strchr("\"\\/bfnrt", c);
+        if (c && simple) {
+            static const char unescaped[] = "\"\\/\b\f\n\r\t";
+            sb_append_len(&sb, &unescaped[simple - "\"\\/bfnrt"], 1);
+            p += 2;
+            continue;
+        }
+        long cp = c == 'u' ? json_read_hex4(p + 2) : -1;
+        if (cp < 0)
+            break;
+        p += 6;
+        if (cp >= 0xd800 && cp < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+            long low = json_read_hex4(p + 2);
+            if (low >= 0xdc00 && low < 0xe000) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                p += 6;
+            }
+        }
+        if (cp >= 0xd800 && cp < 0xe000)
+            cp = 0xfffd;            // an unpaired surrogate
+        char utf8[4];
+        size_t n;
+        if (cp < 0x80) {
+            utf8[0] = cp; n = 1;
+        } else if (cp < 0x800) {
+            utf8[0] = 0xc0 | cp >> 6; utf8[1] = 0x80 | (cp & 0x3f); n = 2;
+        } else if (cp < 0x10000) {
+            utf8[0] = 0xe0 | cp >> 12; utf8[1] = 0x80 | (cp >> 6 & 0x3f); utf8[2] = 0x80 | (cp & 0x3f); n = 3;
+        } else {
+            utf8[0] = 0xf0 | cp >> 18; utf8[1] = 0x80 | (cp >> 12 & 0x3f);
+            utf8[2] = 0x80 | (cp >> 6 & 0x3f); utf8[3] = 0x80 | (cp & 0x3f); n = 4;
+        }
+        sb_append_len(&sb, utf8, n);
+    }
+    char *s = NULL;
+    if (*p == '"') {
+        s = sb.data == storage ? strdup(sb.data) : sb.data;
+        if (endp)
+            *endp = p + 1;
+    } else if (sb.data != storage) {
+        free(sb.data);
+    }
+    return s;
+}
+
+const char *media_type_name(enum AVMediaType type) {
+    switch (type) {
+    case AVMEDIA_TYPE_VIDEO: return "video";
+    case AVMEDIA_TYPE_AUDIO: return "audio";
+    case AVMEDIA_TYPE_SUBTITLE: return "subtitle";
+    default: return NULL;
+    }
+}
+
+// deep: judge the --deep detail of par too
+int is_stream_supported(const Profile *profile, const StreamParams *par, int deep) {
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+        return is_video_codec_supported(profile, par, deep);
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO)
+        return is_audio_codec_supported(profile, par->codec_id);
+    if (par->codec_type == AVMEDIA_TYPE_SUBTITLE)
+        return is_subtitle_codec_supported(profile, par->codec_id);
+    return 1;
+}
+
+// Outcome of scoring one file against one profile
+typedef struct {
+    int container_ok;
+    int all_supported;
+    int has_video;
+    int has_audio;
+    int can_transcode;
+    int has_unsupported_bitmap_subtitle;
+} Verdict;
+
+// One media stream of an analysed file
+typedef struct {
+    int index;                  // stream index in the file, as used by ffmpeg -map
+    enum AVMediaType type;
+    enum AVCodecID codec_id;
+    const char *codec_name;     // static string from avcodec_get_name
+    char lang[LANG_BUF_SIZE];
+    uint32_t supported;         // bit p set when profiles[p] supports the stream
+    int text_subtitle;
+    int bitmap_subtitle;
+    // --deep detail of video streams
+    int deep;
+    int profile;
+    int level;
+    int bit_depth;
+    int dovi_profile;
+    int dovi_compat;
+} StreamAnalysis;
+
+/*
+ * Everything the output modes and the command builders need about a file,
+ * computed once from its ProbeInfo.  It is self-contained, so it can be
+ * kept or handed to another thread after the probe result is freed.
+ */
+typedef struct {
+    const char *container;      // interned
+    int nb_streams;             // media streams only
+    StreamAnalysis *streams;
+    Verdict verdicts[MAX_PROFILES];
+    int all_profiles_ok;
+    int all_unfixable;          // every failing profile is unfixable
+    int any_av;
+    // Set by --remux
+    const char *remux_status;   // NULL: not attempted, "done", "up to date" or "failed"
+    char *remux_output;
+    int remux_error;
+    // Set by --skip-fixed when the file stands in for the source it is a fix of
+    const char *source;
+    const char *source_name;    // as the source is displayed
+    const CheckOptions *options;    // what the verdicts were scored against
+} FileAnalysis;
+
+int verdict_is_unfixable(const Verdict *v) {
+    return !v->all_supported && !v->can_transcode && v->has_unsupported_bitmap_subtitle;
+}
+
+const char *verdict_fix(const Verdict *v) {
+    return v->all_supported ? "none" :
+           v->can_transcode ? "transcode" :
+           v->has_unsupported_bitmap_subtitle ? "unfixable" : "remux";
+}
+
+void analyze_file(const CheckOptions *o, const ProbeInfo *info, FileAnalysis *a) {
+    memset(a, 0, sizeof(*a));
+    a->options = o;
+    a->container = info->container;
+    a->streams = calloc(info->nb_streams ? info->nb_streams : 1, sizeof(StreamAnalysis));
+    for (int p = 0; p < o->num_profiles; p++) {
+        Verdict *v = &a->verdicts[p];
+        v->container_ok = is_container_supported(o->profiles[p], info->container);
+        v->all_supported = v->container_ok;
+    }
+
+    for (int i = 0; i < info->nb_streams; i++) {
+        const StreamParams *par = &info->streams[i];
+        if (!is_media_stream(par->codec_type)) continue;
+        StreamAnalysis *sa = &a->streams[a->nb_streams++];
+        sa->index = i;
+        sa->type = par->codec_type;
+        sa->codec_id = par->codec_id;
+        sa->codec_name = avcodec_get_name(par->codec_id);
+        memcpy(sa->lang, par->lang, sizeof(sa->lang));
+        if (o->deep_mode && stream_deep(par)) {
+            sa->deep = 1;
+            sa->profile = par->profile;
+            sa->level = par->level;
+            sa->bit_depth = par->bit_depth;
+            sa->dovi_profile = par->dovi_profile;
+            sa->dovi_compat = stream_dovi_compat(par);
+        }
+        if (par->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+            sa->text_subtitle = is_text_subtitle(par->codec_id);
+            sa->bitmap_subtitle = is_bitmap_subtitle(par->codec_id);
+        }
+        for (int p = 0; p < o->num_profiles; p++) {
+            Verdict *v = &a->verdicts[p];
+            int supported = is_stream_supported(o->profiles[p], par, o->deep_mode);
+            if (supported) sa->supported |= 1u << p;
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+                v->has_video = 1;
+                if (!supported) v->can_transcode = 1;
+            } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+                v->has_audio = 1;
+                if (!supported) v->can_transcode = 1;
+            } else if (!supported) {
+                if (sa->bitmap_subtitle)
+                    v->has_unsupported_bitmap_subtitle = 1;
+                else
+                    v->can_transcode = 1;
+            }
+            if (!supported) v->all_supported = 0;
+        }
+    }
+
+    a->all_profiles_ok = 1;
+    a->all_unfixable = 1;
+    for (int p = 0; p < o->num_profiles; p++) {
+        const Verdict *v = &a->verdicts[p];
+        if (!v->all_supported) a->all_profiles_ok = 0;
+        if (!v->all_supported && !verdict_is_unfixable(v)) a->all_unfixable = 0;
+        if (v->has_video || v->has_audio) a->any_av = 1;
+    }
+}
+
+void summary_count(Summary *summary, const FileAnalysis *a) {
+    for (int p = 0; p < a->options->num_profiles; p++) {
+        if (a->verdicts[p].all_supported) summary->profile_ok[p]++;
+        else summary->profile_not_supported[p]++;
+    }
+    if (a->all_profiles_ok) summary->ok++;
+    else summary->not_supported++;
+    summary->total++;
+}
+
+void analysis_free(FileAnalysis *a) {
+    free(a->remux_output);
+    a->remux_output = NULL;
+    free(a->streams);
+    a->streams = NULL;
+    a->nb_streams = 0;
+}
+
+static inline int stream_supported(const StreamAnalysis *sa, int p) {
+    return (sa->supported >> p) & 1;
+}
+
+// Level in its usual notation, e.g. "5.1"; NULL if unknown
+const char *format_level(char *buf, size_t size, enum AVCodecID codec_id, int level) {
+    if (level == FF_LEVEL_UNKNOWN)
+        return NULL;
+    if (codec_id == AV_CODEC_ID_H264)
+        snprintf(buf, size, "%d.%d", level / 10, level % 10);
+    else if (codec_id == AV_CODEC_ID_HEVC)
+        snprintf(buf, size, "%d.%d", level / 30, level % 30 / 3);
+    else
+        snprintf(buf, size, "%d", level);
+    return buf;
+}
+
+// "Main 10, L5.1, 10-bit, DV 8.1": what --deep found, for text output
+void format_deep_detail(char *buf, size_t size, const StreamAnalysis *sa) {
+    char level[16];
+    StrBuf sb;
+    sb_init(&sb, buf, size);
+    const char *profile = avcodec_profile_name(sa->codec_id, sa->profile);
+    if (profile)
+        sb_append(&sb, profile);
+    if (format_level(level, sizeof(level), sa->codec_id, sa->level))
+        sb_appendf(&sb, "%sL%s", sb.len ? ", " : "", level);
+    if (sa->bit_depth)
+        sb_appendf(&sb, "%s%d-bit", sb.len ? ", " : "", sa->bit_depth);
+    if (sa->dovi_profile >= 0) {
+        sb_appendf(&sb, "%sDV %d", sb.len ? ", " : "", sa->dovi_profile);
+        if (sa->dovi_compat)
+            sb_appendf(&sb, ".%d", sa->dovi_compat);
+    }
+    if (sb.data != buf)
+        snprintf(buf, size, "%s", sb.data);   // outgrew buf: keep what fits
+    sb_free(&sb);
+}
+
+// The profile name a transcode for profiles[p] is tagged with (fixed_<stem>.<profile>.mkv); NULL with one profile
+const char *output_tag(const CheckOptions *o, int p) {
+    return o->num_profiles > 1 ? o->profiles[p]->def->name : NULL;
+}
+
+// Appends the default output name for a fix of filepath (remuxed_<name>.mkv or fixed_<stem>[.<tag>].mkv), unquoted
+void append_output_name(StrBuf *sb, const char *filepath, int transcode, const char *tag) {
+    const char *base = get_basename(filepath);
+    size_t base_len = filepath + name_length(filepath) - base;
+    if (!transcode) {
+        sb_append(sb, "remuxed_");
+        sb_append_len(sb, base, base_len);
+        sb_append(sb, ".mkv");
+        return;
+    }
+    // Always output to .mkv for transcoded files; tag it with the profile when checking several
+    size_t stem_len = base_len;
+    while (stem_len > 0 && base[stem_len - 1] != '.')
+        stem_len--;
+    sb_append(sb, "fixed_");
+    sb_append_len(sb, base, stem_len ? stem_len - 1 : base_len);
+    if (tag) {
+        sb_append(sb, ".");
+        sb_append(sb, tag);
+    }
+    sb_append(sb, ".mkv");
+}
+
+// Appends output quoted, or the default output name in the current directory when it is NULL
+void append_output(StrBuf *sb, const char *output, const char *filepath, int transcode, const char *tag) {
+    if (output) {
+        sb_append_quoted(sb, output);
+        return;
+    }
+    char storage[512];
+    StrBuf name;
+    sb_init(&name, storage, sizeof(storage));
+    append_output_name(&name, filepath, transcode, tag);
+    sb_append_quoted(sb, name.data);
+    sb_free(&name);
+}
+
+// Builds an "ffmpeg ... -c copy" command changing only the container into sb
+const char *build_remux_command(StrBuf *sb, const char *filepath, const char *output) {
+    sb_reset(sb);
+    sb_append(sb, "ffmpeg -i ");
+    sb_append_quoted(sb, filepath);
+    sb_append(sb, " -map 0 -c copy ");
+    append_output(sb, output, filepath, 0, NULL);
+    return sb->data;
+}
+
+// Builds an ffmpeg command re-encoding only the streams profiles[p] doesn't support into sb
+const char *build_transcode_command(StrBuf *sb, const FileAnalysis *a, int p, const char *filepath, const char *output) {
+    static const enum AVMediaType types[] = { AVMEDIA_TYPE_VIDEO, AVMEDIA_TYPE_AUDIO, AVMEDIA_TYPE_SUBTITLE };
+    int has_type[3] = {0};
+    int i, t;
+
+    sb_reset(sb);
+    sb_append(sb, "ffmpeg -i ");
+    sb_append_quoted(sb, filepath);
+
+    // -map per stream type, in the order the types first appear
+    for (i = 0; i < a->nb_streams; i++) {
+        const StreamAnalysis *sa = &a->streams[i];
+        t = sa->type == AVMEDIA_TYPE_VIDEO ? 0 : sa->type == AVMEDIA_TYPE_AUDIO ? 1 : 2;
+        if (has_type[t]) continue;
+        has_type[t] = 1;
+        sb_append(sb, t == 0 ? " -map 0:v" : t == 1 ? " -map 0:a" : " -map 0:s");
+    }
+
+    // Then the per-stream codecs, grouped by type
+    for (t = 0; t < 3; t++) {
+        int n = 0;
+        for (i = 0; i < a->nb_streams; i++) {
+            const StreamAnalysis *sa = &a->streams[i];
+            if (sa->type != types[t]) continue;
+            int supported = stream_supported(sa, p);
+            const char *codec;
+            if (t == 0)
+                codec = supported ? "copy" : "libx264";
+            else if (t == 1)
+                codec = supported ? "copy" : "aac";
+            else // Bitmap subtitles can't become srt; they are copied as-is
+                codec = !supported && sa->text_subtitle ? "srt" : "copy";
+            sb_appendf(sb, " -c:%c:%d %s", "vas"[t], n, codec);
+            // libx264 would keep 10-bit input in High 10, which the profile's limit just ruled out
+            if (t == 0 && !supported && sa->deep && sa->bit_depth > 8)
+                sb_appendf(sb, " -pix_fmt:v:%d yuv420p", n);
+            n++;
+        }
+    }
+
+    sb_append(sb, " ");
+    append_output(sb, output, filepath, 1, output_tag(a->options, p));
+    return sb->data;
+}
+
+// Prints "OK" / "NOT SUPPORTED" style results, prefixed by the profile name when checking several
+void print_profile_results(FILE *out, const CheckOptions *o, const int *ok, const char *ok_text, const char *bad_text) {
+    for (int p = 0; p < o->num_profiles; p++) {
+        if (p > 0) fputs(" | ", out);
+        if (o->num_profiles > 1) fprintf(out, "%s: ", o->profiles[p]->def->name);
+        fprintf(out, "%s%s%s", ok[p] ? COLOR_GREEN : COLOR_RED, ok[p] ? ok_text : bad_text, COLOR_RESET);
+    }
+}
+
+void print_json_commands(FILE *out, StrBuf *sb, const char *filepath, const FileAnalysis *a, int p) {
+    const Verdict *v = &a->verdicts[p];
+    fputs("\"commands\":{", out);
+    if (!v->all_supported && (v->has_video || v->has_audio)) {
+        fputs("\"remux\":", out);
+        json_write_string(out, build_remux_command(sb, filepath, NULL));
+        if (v->can_transcode) {
+            fputs(",\"transcode\":", out);
+            json_write_string(out, build_transcode_command(sb, a, p, filepath, NULL));
+        }
+    }
+    fputc('}', out);
+}
+
+void print_json_deep(FILE *out, const StreamAnalysis *sa) {
+    char level[16];
+    const char *profile = avcodec_profile_name(sa->codec_id, sa->profile);
+    const char *level_str = format_level(level, sizeof(level), sa->codec_id, sa->level);
+    fputs(",\"deep\":{\"profile\":", out);
+    if (profile) json_write_string(out, profile);
+    else fputs("null", out);
+    fputs(",\"level\":", out);
+    if (level_str) json_write_string(out, level_str);
+    else fputs("null", out);
+    if (sa->bit_depth)
+        fprintf(out, ",\"bit_depth\":%d", sa->bit_depth);
+    else
+        fputs(",\"bit_depth\":null", out);
+    if (sa->dovi_profile >= 0)
+        fprintf(out, ",\"dolby_vision\":{\"profile\":%d,\"compatibility_id\":%d}", sa->dovi_profile, sa->dovi_compat);
+    fputc('}', out);
+}
+
+// One self-contained JSON object per file for --format jsonl. The top-level
+// verdict is for the first profile; with several, "profiles" has one per profile.
+void print_json_report(FILE *out, StrBuf *sb, const char *filepath, const FileAnalysis *a) {
+    const CheckOptions *o = a->options;
+    const Verdict *verdicts = a->verdicts;
+    fputs("{\"path\":", out);
+    json_write_string(out, filepath);
+    fputs(",\"container\":", out);
+    json_write_string(out, a->container);
+    fprintf(out, ",\"container_ok\":%s,\"streams\":[", verdicts[0].container_ok ? "true" : "false");
+    for (int i = 0; i < a->nb_streams; i++) {
+        const StreamAnalysis *sa = &a->streams[i];
+        fprintf(out, "%s{\"index\":%d,\"type\":\"%s\",\"codec\":", i ? "," : "", sa->index, media_type_name(sa->type));
+        json_write_string(out, sa->codec_name);
+        fputs(",\"lang\":", out);
+        json_write_string(out, sa->lang);
+        if (sa->deep)
+            print_json_deep(out, sa);
+        fprintf(out, ",\"supported\":%s}", stream_supported(sa, 0) ? "true" : "false");
+    }
+    fprintf(out, "],\"profile\":\"%s\",\"ok\":%s,\"fix\":\"%s\",", o->profiles[0]->def->name,
+        verdicts[0].all_supported ? "true" : "false", verdict_fix(&verdicts[0]));
+    print_json_commands(out, sb, filepath, a, 0);
+    if (a->remux_status) {
+        fputs(",\"remux_result\":{\"output\":", out);
+        json_write_string(out, a->remux_output);
+        fprintf(out, ",\"status\":\"%s\"", a->remux_status);
+        if (a->remux_error < 0) {
+            char errbuf[256];
+            av_strerror(a->remux_error, errbuf, sizeof(errbuf));
+            fputs(",\"error\":", out);
+            json_write_string(out, errbuf);
+        }
+        fputc('}', out);
+    }
+    if (a->source) {
+        fputs(",\"source\":", out);
+        json_write_string(out, a->source);
+    }
+    if (o->num_profiles > 1) {
+        fputs(",\"profiles\":{", out);
+        for (int p = 0; p < o->num_profiles; p++) {
+            const Verdict *v = &verdicts[p];
+            fprintf(out, "%s\"%s\":{\"container_ok\":%s,\"ok\":%s,\"fix\":\"%s\",\"unsupported\":[",
+                p ? "," : "", o->profiles[p]->def->name, v->container_ok ? "true" : "false",
+                v->all_supported ? "true" : "false", verdict_fix(v));
+            int first = 1;
+            for (int i = 0; i < a->nb_streams; i++) {
+                if (stream_supported(&a->streams[i], p)) continue;
+                fprintf(out, "%s%d", first ? "" : ",", a->streams[i].index);
+                first = 0;
+            }
+            fputs("],", out);
+            print_json_commands(out, sb, filepath, a, p);
+            fputc('}', out);
+        }
+        fputc('}', out);
+    }
+    fputs("}\n", out);
+}
+
+void print_json_error(FILE *out, const char *filepath, const char *failed_step, int errnum) {
+    char errbuf[256];
+    av_strerror(errnum, errbuf, sizeof(errbuf));
+    fputs("{\"path\":", out);
+    json_write_string(out, filepath);
+    fputs(",\"error\":", out);
+    json_write_string(out, errbuf);
+    fputs(",\"step\":", out);
+    json_write_string(out, failed_step);
+    fputs("}\n", out);
+}
+
+// "<prefix>: remuxed to <output>" and friends, for text output
+void print_remux_result(FILE *out, const char *prefix, const FileAnalysis *a) {
+    if (strcmp(a->remux_status, "failed") == 0) {
+        char errbuf[256];
+        av_strerror(a->remux_error, errbuf, sizeof(errbuf));
+        fprintf(out, "%s: " COLOR_RED "remux to %s failed: %s" COLOR_RESET "\n", prefix, a->remux_output, errbuf);
+    } else if (strcmp(a->remux_status, "done") == 0) {
+        fprintf(out, "%s: " COLOR_GREEN "remuxed to %s" COLOR_RESET "\n", prefix, a->remux_output);
+    } else {
+        fprintf(out, "%s: %s is up to date\n", prefix, a->remux_output);
+    }
+}
+
+// Prints the report for one analysed file in the selected output mode
+void report_file(FILE *out, StrBuf *sb, const char *filepath, const char *filename, const FileAnalysis *a) {
+    const CheckOptions *o = a->options;
+    const Verdict *verdicts = a->verdicts;
+    int i, p;
+
+    if (brief_mode && output_format == OUTPUT_TEXT) {
+        // Brief output: one line per file (per failing profile), all tracks, color-coded
+        for (p = 0; p < o->num_profiles; p++) {
+            if (verdicts[p].all_supported) continue;
+            if (o->num_profiles > 1)
+                fprintf(out, "%s [%s]:", filename, o->profiles[p]->def->name);
+            else
+                fprintf(out, "%s:", filename);
+            if (!verdicts[p].container_ok)
+                fprintf(out, COLOR_RED "[container:%s]" COLOR_RESET, a->container);
+            for (i = 0; i < a->nb_streams; i++) {
+                const StreamAnalysis *sa = &a->streams[i];
+                fprintf(out, "%s[%d:%s:%s:%s]%s",
+                    stream_supported(sa, p) ? COLOR_GREEN : COLOR_RED,
+                    sa->index, media_type_name(sa->type), sa->codec_name, sa->lang,
+                    COLOR_RESET
+                );
+            }
+            fputc('\n', out);
+        }
+        if (a->remux_status)
+            print_remux_result(out, filename, a);
+        if (a->source)
+            fprintf(out, "%s: resolved by %s\n", a->source_name, filename);
+        return;
+    }
+
+    if ((skip_ok && a->all_profiles_ok) || (skip_unfixable && !a->all_profiles_ok && a->all_unfixable)) {
+        return;
+    }
+
+    if (output_format == OUTPUT_JSONL) {
+        print_json_report(out, sb, filepath, a);
+        return;
+    }
+
+    // Verbose/tree output
+    int ok[MAX_PROFILES];
+    fprintf(out, "----------------\n\n%s\n", filename);
+    if (a->source)
+        fprintf(out, "  fix of: %s (checked in its place)\n", a->source_name);
+    for (p = 0; p < o->num_profiles; p++)
+        ok[p] = verdicts[p].container_ok;
+    fprintf(out, "  container: %s | ", a->container);
+    print_profile_results(out, o, ok, "OK", "NOT SUPPORTED");
+    fputc('\n', out);
+    for (i = 0; i < a->nb_streams; i++) {
+        const StreamAnalysis *sa = &a->streams[i];
+        for (p = 0; p < o->num_profiles; p++)
+            ok[p] = stream_supported(sa, p);
+        char detail[128] = "";
+        if (sa->deep)
+            format_deep_detail(detail, sizeof(detail), sa);
+        fprintf(out, "    [%d] %s | %s%s%s%s | %s | ", sa->index, media_type_name(sa->type), sa->codec_name,
+            detail[0] ? " (" : "", detail, detail[0] ? ")" : "", sa->lang);
+        print_profile_results(out, o, ok, "OK", "NOT SUPPORTED");
+        fputc('\n', out);
+        // Bitmap subtitles are only "unsupported" in the sense that no profile takes them as-is
+        uint32_t all = (1u << o->num_profiles) - 1;
+        if (sa->bitmap_subtitle && (sa->supported & all) != all) {
+            fprintf(out, COLOR_YELLOW "  Note: Subtitle stream %d (%s) is bitmap-based and cannot be converted to srt. It will be copied as-is (may not be supported on your TV).\n" COLOR_RESET, sa->index, sa->codec_name);
+        }
+    }
+    for (p = 0; p < o->num_profiles; p++)
+        ok[p] = verdicts[p].all_supported;
+    fputs("  overall: ", out);
+    print_profile_results(out, o, ok, "ALL TRACKS SUPPORTED", "SOME TRACKS UNSUPPORTED");
+    fputc('\n', out);
+
+    // Suggested remuxing command for unsupported files (only if video or audio present);
+    // it doesn't depend on the profile
+    if (!a->all_profiles_ok && a->any_av) {
+        fprintf(out, "\n  Suggested remuxing command:\n    %s\n", build_remux_command(sb, filepath, NULL));
+        fprintf(out, COLOR_YELLOW "    (This changes only the container; streams are copied without re-encoding)\n" COLOR_RESET);
+    }
+    if (a->remux_status) {
+        fputc('\n', out);
+        print_remux_result(out, "  Remux", a);
+    }
+
+    // Only suggest ffmpeg command if re-encoding can help
+    for (p = 0; p < o->num_profiles; p++) {
+        const Verdict *v = &verdicts[p];
+        if (v->all_supported || !(v->has_video || v->has_audio) || !v->can_transcode) continue;
+        const char *cmd = build_transcode_command(sb, a, p, filepath, NULL);
+        if (o->num_profiles > 1)
+            fprintf(out, "\n  Suggested ffmpeg command for %s:\n    %s\n", o->profiles[p]->def->name, cmd);
+        else
+            fprintf(out, "\n  Suggested ffmpeg command:\n    %s\n", cmd);
+    }
+
+    fprintf(out, "\n");
+}
+
+/*
+ * --emit-script: fix jobs collected over the whole scan and written out as
+ * one shell script.  Remuxes (stream copy, I/O bound) and transcodes (CPU
+ * bound) go into separate groups that run side by side with their own
+ * concurrency.  Outputs are placed next to their source, and every output
+ * path is used by exactly one job.
+ */
+typedef struct {
+    int transcode;
+    char *source;
+    char *target;
+    char *command;
+} ScriptJob;
+
+typedef struct {
+    ScriptJob *jobs;
+    size_t count;
+    size_t capacity;
+    size_t *slots;          // open addressing by target: job index + 1, 0 = empty
+    size_t slots_capacity;
+    pthread_mutex_t lock;
+} FixScript;
+
+FixScript *fix_script = NULL;
+
+size_t *script_slot(FixScript *fs, const char *target) {
+    size_t mask = fs->slots_capacity - 1;
+    size_t i = hash_string(target) & mask;
+    while (fs->slots[i] && strcmp(fs->jobs[fs->slots[i] - 1].target, target) != 0)
+        i = (i + 1) & mask;
+    return &fs->slots[i];
+}
+
+void script_grow(FixScript *fs) {
+    if (fs->count == fs->capacity) {
+        fs->capacity = fs->capacity ? fs->capacity * 2 : 64;
+        fs->jobs = realloc(fs->jobs, fs->capacity * sizeof(ScriptJob));
+    }
+    if ((fs->count + 1) * 10 >= fs->slots_capacity * 7) {
+        free(fs->slots);
+        fs->slots_capacity = fs->slots_capacity ? fs->slots_capacity * 2 : 128;
+        fs->slots = calloc(fs->slots_capacity, sizeof(size_t));
+        for (size_t i = 0; i < fs->count; i++)
+            *script_slot(fs, fs->jobs[i].target) = i + 1;
+    }
+}
+
+// Adds one job unless this source already has it. A target taken by another
+// source (movie.mp4 and movie.avi both want fixed_movie.mkv) gets a number.
+void script_add_job(FixScript *fs, StrBuf *sb, const char *filepath, const FileAnalysis *a, int transcode, int p) {
+    char storage[PATH_BUF_SIZE];
+    StrBuf target;
+    sb_init(&target, storage, sizeof(storage));
+    sb_append_len(&target, filepath, output_dir_length(filepath));
+    append_output_name(&target, filepath, transcode, transcode ? output_tag(a->options, p) : NULL);
+    size_t stem_len = target.len - strlen(".mkv");
+
+    pthread_mutex_lock(&fs->lock);
+    script_grow(fs);
+    size_t *slot;
+    for (int n = 2; *(slot = script_slot(fs, target.data)); n++) {
+        if (strcmp(fs->jobs[*slot - 1].source, filepath) == 0) {
+            pthread_mutex_unlock(&fs->lock);
+            sb_free(&target);
+            return;
+        }
+        target.len = stem_len;
+        sb_appendf(&target, "-%d.mkv", n);
+    }
+    ScriptJob *job = &fs->jobs[fs->count];
+    *slot = ++fs->count;
+    job->transcode = transcode;
+    job->source = strdup(filepath);
+    job->target = strdup(target.data);
+
+    // ffmpeg writes <target>.partial.mkv, which the script renames once it succeeds
+    sb_append(&target, ".partial.mkv");
+    if (transcode)
+        build_transcode_command(sb, a, p, filepath, target.data);
+    else
+        build_remux_command(sb, filepath, target.data);
+    job->command = strdup(sb->data);
+    pthread_mutex_unlock(&fs->lock);
+    sb_free(&target);
+}
+
+// Whether an earlier profile already needs the very same transcode (same streams re-encoded)
+int same_transcode_as_earlier(const FileAnalysis *a, int p) {
+    for (int q = 0; q < p; q++) {
+        if (strcmp(verdict_fix(&a->verdicts[q]), "transcode") != 0) continue;
+        int same = 1;
+        for (int i = 0; same && i < a->nb_streams; i++)
+            same = stream_supported(&a->streams[i], p) == stream_supported(&a->streams[i], q);
+        if (same) return 1;
+    }
+    return 0;
+}
+
+void script_add_file(FixScript *fs, StrBuf *sb, const char *filepath, const FileAnalysis *a) {
+    if (strchr(filepath, '\n')) {
+        fprintf(stderr, "Not adding '%s' to the fix script: newline in path\n", filepath);
+        return;
+    }
+    for (int p = 0; p < a->options->num_profiles; p++) {
+        const char *fix = verdict_fix(&a->verdicts[p]);
+        if (strcmp(fix, "transcode") == 0 && !same_transcode_as_earlier(a, p))
+            script_add_job(fs, sb, filepath, a, 1, p);
+        else if (strcmp(fix, "remux") == 0)
+            script_add_job(fs, sb, filepath, a, 0, p);
+    }
+}
+
+int compare_script_jobs(const void *a, const void *b) {
+    const ScriptJob *x = a, *y = b;
+    int c = strcmp(x->source, y->source);
+    return c ? c : strcmp(x->target, y->target);
+}
+
+void script_write_group(FILE *fp, const FixScript *fs, int transcode, const char *jobs_var, int background) {
+    const char *delim = transcode ? "CTV_TRANSCODE_JOBS" : "CTV_REMUX_JOBS";
+    fprintf(fp, "run_group \"$%s\" <<'%s'%s\n", jobs_var, delim, background ? " &" : " || status=1");
+    for (size_t i = 0; i < fs->count; i++) {
+        const ScriptJob *job = &fs->jobs[i];
+        if (job->transcode != transcode) continue;
+        StrBuf line;
+        char storage[PATH_BUF_SIZE];
+        sb_init(&line, storage, sizeof(storage));
+        sb_append(&line, "run_job ");
+        sb_append_quoted(&line, job->target);
+        sb_append(&line, " ");
+        sb_append_quoted(&line, job->source);
+        fprintf(fp, "%s %s\n", line.data, job->command);
+        sb_free(&line);
+    }
+    fprintf(fp, "%s\n", delim);
+}
+
+int script_write(FixScript *fs, const char *filename, const char *input) {
+    int remux = 0, transcode = 0;
+    qsort(fs->jobs, fs->count, sizeof(ScriptJob), compare_script_jobs);
+    for (size_t i = 0; i < fs->count; i++) {
+        if (fs->jobs[i].transcode) transcode++;
+        else remux++;
+    }
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write script '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+    fprintf(fp,
+        "#!/bin/sh\n"
+        "# Fix script generated by check_tv_compat for %s\n"
+        "# %d remux job(s) (stream copy, I/O bound) and %d transcode job(s) (CPU bound).\n"
+        "# Both groups run at the same time. Concurrency per group:\n"
+        "#   REMUX_JOBS      parallel remuxes (default 2; about one per disk)\n"
+        "#   TRANSCODE_JOBS  parallel transcodes (default: number of CPUs)\n"
+        "# Jobs whose target is newer than the source are skipped, so an interrupted\n"
+        "# run can simply be started again.\n"
+        "\n"
+        "REMUX_JOBS=${REMUX_JOBS:-2}\n"
+        "TRANSCODE_JOBS=${TRANSCODE_JOBS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)}\n"
+        "\n"
+        "# Runs one job line: run_job TARGET SOURCE COMMAND..., COMMAND writing TARGET.partial.mkv\n"
+        "JOB_RUNNER='\n"
+        "run_job() {\n"
+        "    target=$1 source=$2\n"
+        "    shift 2\n"
+        "    if [ -e \"$target\" ] && [ \"$target\" -nt \"$source\" ]; then\n"
+        "        echo \"up to date: $target\"\n"
+        "        return 0\n"
+        "    fi\n"
+        "    rm -f \"$target.partial.mkv\"\n"
+        "    if \"$@\" </dev/null; then\n"
+        "        mv -f \"$target.partial.mkv\" \"$target\" && echo \"done: $target\"\n"
+        "    else\n"
+        "        rm -f \"$target.partial.mkv\"\n"
+        "        echo \"FAILED: $target\" >&2\n"
+        "        return 1\n"
+        "    fi\n"
+        "}\n"
+        "eval \"$1\"\n"
+        "'\n"
+        "\n"
+        "run_group() {\n"
+        "    tr '\\n' '\\0' | xargs -0 -n 1 -P \"$1\" sh -c \"$JOB_RUNNER\" job\n"
+        "}\n"
+        "\n"
+        "status=0\n",
+        input, remux, transcode);
+    if (remux) {
+        script_write_group(fp, fs, 0, "REMUX_JOBS", transcode > 0);
+        if (transcode)
+            fprintf(fp, "remux_pid=$!\n");
+    }
+    if (transcode)
+        script_write_group(fp, fs, 1, "TRANSCODE_JOBS", 0);
+    if (remux && transcode)
+        fprintf(fp, "wait \"$remux_pid\" || status=1\n");
+    fprintf(fp, "exit $status\n");
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Could not write script '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+    chmod(filename, 0755);
+    return 0;
+}
+
+void script_free(FixScript *fs) {
+    for (size_t i = 0; i < fs->count; i++) {
+        free(fs->jobs[i].source);
+        free(fs->jobs[i].target);
+        free(fs->jobs[i].command);
+    }
+    free(fs->jobs);
+    free(fs->slots);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs);
+}
+
+/*
+ * --remux: performs the container change in-process.  The input that was
+ * just probed stays open and its packets are copied straight into a
+ * Matroska muxer, so there is no second probe and no ffmpeg process.
+ * Output goes next to the source as remuxed_<name>.mkv, written to a
+ * .partial.mkv file and renamed on success; a target newer than its source
+ * is left alone.  remux_slots bounds how many remuxes write at once.
+ */
+Budget remux_slots = { .limit = 2, .lock = PTHREAD_MUTEX_INITIALIZER, .released = PTHREAD_COND_INITIALIZER };
+
+// Copies every stream Matroska can hold from in to a new file at output
+int remux_to_matroska(AVFormatContext *in, const char *output) {
+    AVFormatContext *out = NULL;
+    AVPacket *pkt = NULL;
+    int *stream_map = NULL;
+    int ret = avformat_alloc_output_context2(&out, NULL, "matroska", output);
+    if (ret < 0)
+        return ret;
+
+    stream_map = malloc((in->nb_streams ? in->nb_streams : 1) * sizeof(int));
+    int nb_out = 0;
+    for (unsigned int i = 0; i < in->nb_streams; i++) {
+        const AVStream *in_st = in->streams[i];
+        stream_map[i] = -1;
+        // Like "-map 0", but streams the muxer can't store are dropped instead of failing the file
+        if (avformat_query_codec(out->oformat, in_st->codecpar->codec_id, FF_COMPLIANCE_NORMAL) != 1 &&
+            in_st->codecpar->codec_type != AVMEDIA_TYPE_ATTACHMENT)
+            continue;
+        AVStream *out_st = avformat_new_stream(out, NULL);
+        if (!out_st || (ret = avcodec_parameters_copy(out_st->codecpar, in_st->codecpar)) < 0) {
+            ret = out_st ? ret : AVERROR(ENOMEM);
+            goto end;
+        }
+        out_st->codecpar->codec_tag = 0;
+        out_st->time_base = in_st->time_base;
+        out_st->disposition = in_st->disposition;
+        av_dict_copy(&out_st->metadata, in_st->metadata, 0);
+        stream_map[i] = nb_out++;
+    }
+    av_dict_copy(&out->metadata, in->metadata, 0);
+
+    if ((ret = avio_open(&out->pb, output, AVIO_FLAG_WRITE)) < 0)
+        goto end;
+    if ((ret = avformat_write_header(out, NULL)) < 0)
+        goto end;
+
+    pkt = av_packet_alloc();
+    if (!pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    while ((ret = av_read_frame(in, pkt)) >= 0) {
+        int idx = pkt->stream_index;
+        if (idx < 0 || idx >= (int)in->nb_streams || stream_map[idx] < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        av_packet_rescale_ts(pkt, in->streams[idx]->time_base, out->streams[stream_map[idx]]->time_base);
+        pkt->stream_index = stream_map[idx];
+        pkt->pos = -1;
+        // Takes ownership of the packet's data
+        if ((ret = av_interleaved_write_frame(out, pkt)) < 0)
+            goto end;
+    }
+    if (ret != AVERROR_EOF)
+        goto end;
+    ret = av_write_trailer(out);
+
+end:
+    av_packet_free(&pkt);
+    if (out && out->pb)
+        avio_closep(&out->pb);
+    avformat_free_context(out);
+    free(stream_map);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Directory listings for --skip-fixed.  Pairing a file with its fix, or a
+ * fix with its source, only stat()s names its directory actually has:
+ * a directory is read once into sorted lists of its supported files, by
+ * name and by stem (the name without its extension), and candidates are
+ * looked up there.  The FIXED_DIRS most recently used listings are kept;
+ * --watch and --remux drop the listing of a directory they see new files
+ * in, so it is read again when next needed.
+ */
+#define FIXED_DIRS 256
+
+typedef struct {
+    char *dir;              // with its trailing slash
+    size_t dir_len;
+    char **names;           // sorted with strcmp
+    char **by_stem;         // the same names, sorted by stem
+    size_t count;
+    uint64_t used;          // fixed_dirs.clock when last looked at
+} FixedDir;
+
+struct {
+    FixedDir dirs[FIXED_DIRS];
+    int count;
+    uint64_t clock;
+    pthread_mutex_t lock;
+} fixed_dirs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline size_t name_stem_length(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot ? (size_t)(dot - name) : strlen(name);
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Orders by stem, then by name
+int compare_stems(const void *a, const void *b) {
+    const char *x = *(char *const *)a, *y = *(char *const *)b;
+    size_t xl = name_stem_length(x), yl = name_stem_length(y);
+    int c = memcmp(x, y, xl < yl ? xl : yl);
+    if (c == 0 && xl != yl)
+        c = xl < yl ? -1 : 1;
+    return c ? c : strcmp(x, y);
+}
+
+void fixed_dir_release(FixedDir *d) {
+    for (size_t i = 0; i < d->count; i++)
+        free(d->names[i]);
+    free(d->names);
+    free(d->by_stem);
+    free(d->dir);
+    memset(d, 0, sizeof(*d));
+}
+
+// The listing of the directory path[0..dir_len) (with its slash), read if
+// it isn't kept; called with the lock held
+FixedDir *fixed_dir_get(const char *path, size_t dir_len) {
+    fixed_dirs.clock++;
+    for (int i = 0; i < fixed_dirs.count; i++) {
+        FixedDir *d = &fixed_dirs.dirs[i];
+        if (d->dir_len == dir_len && memcmp(d->dir, path, dir_len) == 0) {
+            d->used = fixed_dirs.clock;
+            return d;
+        }
+    }
+    FixedDir *d = &fixed_dirs.dirs[0];
+    if (fixed_dirs.count < FIXED_DIRS) {
+        d = &fixed_dirs.dirs[fixed_dirs.count++];
+    } else {
+        for (int i = 1; i < fixed_dirs.count; i++) {
+            if (fixed_dirs.dirs[i].used < d->used)
+                d = &fixed_dirs.dirs[i];
+        }
+        fixed_dir_release(d);
+    }
+    d->dir = strndup(path, dir_len);
+    d->dir_len = dir_len;
+    d->used = fixed_dirs.clock;
+    size_t capacity = 0;
+    DIR *dp = opendir(dir_len ? d->dir : ".");
+    struct dirent *entry;
+    while (dp && (entry = readdir(dp)) != NULL) {
+        if (!has_supported_extension(entry->d_name))
+            continue;
+        if (d->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            d->names = realloc(d->names, capacity * sizeof(char *));
+        }
+        d->names[d->count++] = strdup(entry->d_name);
+    }
+    if (dp)
+        closedir(dp);
+    if (d->count > 0) {
+        qsort(d->names, d->count, sizeof(char *), compare_names);
+        d->by_stem = malloc(d->count * sizeof(char *));
+        memcpy(d->by_stem, d->names, d->count * sizeof(char *));
+        qsort(d->by_stem, d->count, sizeof(char *), compare_stems);
+    }
+    return d;
+}
+
+// Whether the directory of path lists it
+int fixed_dir_has(const char *path) {
+    const char *name = get_basename(path);
+    pthread_mutex_lock(&fixed_dirs.lock);
+    FixedDir *d = fixed_dir_get(path, name - path);
+    int found = d->count > 0 && bsearch(&name, d->names, d->count, sizeof(char *), compare_names) != NULL;
+    pthread_mutex_unlock(&fixed_dirs.lock);
+    return found;
+}
+
+// The files of the directory path[0..dir_len) whose stem is stem[0..stem_len),
+// as paths; NULL-terminated, freed by the caller with free_string_list
+char **fixed_dir_by_stem(const char *path, size_t dir_len, const char *stem, size_t stem_len) {
+    pthread_mutex_lock(&fixed_dirs.lock);
+    FixedDir *d = fixed_dir_get(path, dir_len);
+    // The first name whose stem isn't less than stem
+    size_t lo = 0, hi = d->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *name = d->by_stem[mid];
+        size_t len = name_stem_length(name);
+        int c = memcmp(name, stem, len < stem_len ? len : stem_len);
+        if (c < 0 || (c == 0 && len < stem_len))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t end = lo;
+    while (end < d->count && name_stem_length(d->by_stem[end]) == stem_len &&
+           memcmp(d->by_stem[end], stem, stem_len) == 0)
+        end++;
+    char **paths = calloc(end - lo + 1, sizeof(char *));
+    for (size_t i = lo; i < end; i++) {
+        size_t len = strlen(d->by_stem[i]);
+        paths[i - lo] = malloc(dir_len + len + 1);
+        memcpy(paths[i - lo], path, dir_len);
+        memcpy(paths[i - lo] + dir_len, d->by_stem[i], len + 1);
+    }
+    pthread_mutex_unlock(&fixed_dirs.lock);
+    return paths;
+}
+
+void free_string_list(char **list) {
+    for (char **p = list; *p; p++)
+        free(*p);
+    free(list);
+}
+
+// Drops the listing of path's directory, which has a new file
+void fixed_dir_forget(const char *path) {
+    size_t dir_len = get_basename(path) - path;
+    pthread_mutex_lock(&fixed_dirs.lock);
+    for (int i = 0; i < fixed_dirs.count; i++) {
+        FixedDir *d = &fixed_dirs.dirs[i];
+        if (d->dir_len == dir_len && memcmp(d->dir, path, dir_len) == 0) {
+            fixed_dir_release(d);
+            fixed_dirs.dirs[i] = fixed_dirs.dirs[--fixed_dirs.count];
+            memset(&fixed_dirs.dirs[fixed_dirs.count], 0, sizeof(FixedDir));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fixed_dirs.lock);
+}
+
+void fixed_dirs_free(void) {
+    for (int i = 0; i < fixed_dirs.count; i++)
+        fixed_dir_release(&fixed_dirs.dirs[i]);
+    fixed_dirs.count = 0;
+}
+
+// Whether any requested profile is fixed by a container change alone
+int remux_wanted(const FileAnalysis *a) {
+    for (int p = 0; p < a->options->num_profiles; p++) {
+        if (strcmp(verdict_fix(&a->verdicts[p]), "remux") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Remuxes filepath next to itself; uses in when the probe left it open, else opens the file again
+void remux_file(const char *filepath, const struct stat *st, ProbeInput *in, FileAnalysis *a) {
+    char storage[PATH_BUF_SIZE];
+    StrBuf target;
+    sb_init(&target, storage, sizeof(storage));
+    sb_append_len(&target, filepath, output_dir_length(filepath));
+    append_output_name(&target, filepath, 0, NULL);
+    a->remux_output = strdup(target.data);
+
+    struct stat target_st;
+    if (st && stat(target.data, &target_st) == 0 && stat_newer(&target_st, st)) {
+        a->remux_status = "up to date";
+        sb_free(&target);
+        return;
+    }
+
+    budget_acquire(&remux_slots, 1);
+    int ret = 0;
+    ProbeInput reopened;
+    if (!in->fmt_ctx) {
+        // Cache hit: nothing is open yet
+        ProbeInfo info = {0};
+        const char *failed_step = NULL;
+        ret = probe_file(filepath, a->options, NULL, &info, &failed_step, NULL, &reopened);
+        probe_info_free(&info);
+        in = &reopened;
+    }
+    size_t target_len = target.len;
+    sb_append(&target, ".partial.mkv");
+    if (ret >= 0 && (ret = remux_to_matroska(in->fmt_ctx, target.data)) >= 0) {
+        char *final = strndup(target.data, target_len);
+        if (rename(target.data, final) != 0)
+            ret = AVERROR(errno);
+        else if (skip_fixed)
+            fixed_dir_forget(final);
+        free(final);
+    }
+    if (ret < 0)
+        unlink(target.data);
+    if (in == &reopened)
+        probe_input_close(&reopened);
+    budget_release(&remux_slots, 1);
+
+    a->remux_status = ret < 0 ? "failed" : "done";
+    a->remux_error = ret;
+    sb_free(&target);
+}
+
+/*
+ * --dedupe: a file with the same content as one already checked is reported
+ * as its duplicate instead of being probed (and fixed) again.  Files are
+ * grouped by the size the walk's stat() returned; the first file of a size
+ * costs nothing.  Later ones are compared with the earlier files of their
+ * size by a hash of the first and last DEDUPE_CHUNK bytes, and only when
+ * that matches by a hash of the whole file.  Hashes are computed lazily, by
+ * whichever worker checks the newer file, so hashing overlaps with the
+ * probes running in the other workers.  Hard links match without hashing.
+ */
+#define DEDUPE_CHUNK (4 * 1024 * 1024)
+#define DEDUPE_READ_SIZE (1024 * 1024)
+
+enum { HASH_NONE, HASH_PARTIAL, HASH_FULL, HASH_FAILED };
+
+typedef struct DedupeFile {
+    char *path;
+    struct stat st;         // as found by the walk
+    int hashed;             // HASH_*; HASH_FULL implies partial is set too
+    uint64_t partial;
+    uint64_t full;
+    pthread_mutex_t lock;   // held while this file is hashed
+    struct DedupeFile *next;    // next newer file of the same size
+} DedupeFile;
+
+// Open addressing by file size; each slot holds the oldest file of its size
+typedef struct {
+    DedupeFile **groups;
+    size_t capacity;        // power of two
+    size_t count;
+    pthread_mutex_t lock;
+} DedupeTable;
+
+DedupeTable *dedupe = NULL;
+
+// FNV-1a over 64-bit words with an extra shift so high bits reach the low ones; continues from h
+uint64_t hash_data(uint64_t h, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 1099511628211ULL;
+        h ^= h >> 32;
+    }
+    for (; i < len; i++)
+        h = (h ^ data[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Hashes the head and tail of the file, or all of it with full; -1 if it can't be read
+int hash_file(const char *path, int64_t size, int full, uint64_t *out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int64_t ranges[2][2] = { { 0, size }, { 0, 0 } };
+    if (!full && size > 2 * DEDUPE_CHUNK) {
+        ranges[0][1] = DEDUPE_CHUNK;
+        ranges[1][0] = size - DEDUPE_CHUNK;
+        ranges[1][1] = size;
+    }
+    uint8_t *buf = malloc(DEDUPE_READ_SIZE);
+    uint64_t h = 14695981039346656037ULL;
+    int ret = buf ? 0 : -1;
+    for (int r = 0; ret == 0 && r < 2; r++) {
+        for (int64_t pos = ranges[r][0]; pos < ranges[r][1]; ) {
+            size_t want = ranges[r][1] - pos < DEDUPE_READ_SIZE ? (size_t)(ranges[r][1] - pos) : DEDUPE_READ_SIZE;
+            ssize_t n = pread(fd, buf, want, pos);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                ret = -1;   // shrank or unreadable
+                break;
+            }
+            h = hash_data(h, buf, n);
+            pos += n;
+        }
+    }
+    free(buf);
+    close(fd);
+    *out = h;
+    return ret;
+}
+
+// Brings f's hash up to level unless that happened already; returns the state reached
+int dedupe_hash(DedupeFile *f, int level, ProbeStats *stats) {
+    pthread_mutex_lock(&f->lock);
+    if (f->hashed < level && f->hashed != HASH_FAILED) {
+        int64_t t0 = av_gettime_relative();
+        uint64_t h;
+        // Small files are hashed whole right away; their partial hash is the full one
+        int small = f->st.st_size <= 2 * DEDUPE_CHUNK;
+        int whole = level == HASH_FULL || small;
+        if (hash_file(f->path, f->st.st_size, whole, &h) < 0) {
+            f->hashed = HASH_FAILED;
+        } else {
+            if (!whole || small)
+                f->partial = h;
+            if (whole)
+                f->full = h;
+            f->hashed = whole ? HASH_FULL : HASH_PARTIAL;
+        }
+        if (stats)
+            stats->hash_us += av_gettime_relative() - t0;
+    }
+    int state = f->hashed;
+    pthread_mutex_unlock(&f->lock);
+    return state;
+}
+
+// Whether an earlier file still is what the walk saw, so its hash can be trusted
+int dedupe_unchanged(const DedupeFile *f) {
+    struct stat now;
+    return stat(f->path, &now) == 0 && now.st_dev == f->st.st_dev && now.st_ino == f->st.st_ino &&
+           now.st_size == f->st.st_size && now.st_mtime == f->st.st_mtime &&
+           stat_mtime_nsec(&now) == stat_mtime_nsec(&f->st);
+}
+
+DedupeFile **dedupe_slot(DedupeTable *t, int64_t size) {
+    size_t mask = t->capacity - 1;
+    size_t i = ((uint64_t)size * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+    while (t->groups[i] && t->groups[i]->st.st_size != size)
+        i = (i + 1) & mask;
+    return &t->groups[i];
+}
+
+// Adds the file to its size group; returns a copy of the path of an earlier
+// file with the same content (to be freed), or NULL if it has to be checked
+char *dedupe_check(DedupeTable *t, const char *path, const struct stat *st, ProbeStats *stats) {
+    DedupeFile *self = calloc(1, sizeof(DedupeFile));
+    self->path = strdup(path);
+    self->st = *st;
+    pthread_mutex_init(&self->lock, NULL);
+
+    pthread_mutex_lock(&t->lock);
+    if ((t->count + 1) * 10 > t->capacity * 7) {
+        DedupeFile **old = t->groups;
+        size_t old_capacity = t->capacity;
+        t->capacity *= 2;
+        t->groups = calloc(t->capacity, sizeof(DedupeFile *));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i])
+                *dedupe_slot(t, old[i]->st.st_size) = old[i];
+        }
+        free(old);
+    }
+    DedupeFile **slot = dedupe_slot(t, st->st_size);
+    if (!*slot) {
+        *slot = self;
+        t->count++;
+        pthread_mutex_unlock(&t->lock);
+        return NULL;
+    }
+    // Files are appended and never removed, so the earlier part of the chain is stable
+    DedupeFile *first = *slot, *last = first;
+    while (last->next)
+        last = last->next;
+    last->next = self;
+    pthread_mutex_unlock(&t->lock);
+
+    for (DedupeFile *f = first; f != self; f = f->next) {
+        // A re-check of the same path (--watch) or an earlier file that changed since
+        if (strcmp(f->path, path) == 0 || !dedupe_unchanged(f))
+            continue;
+        if (f->st.st_dev == st->st_dev && f->st.st_ino == st->st_ino)
+            return strdup(f->path);
+        if (dedupe_hash(f, HASH_PARTIAL, stats) == HASH_FAILED)
+            continue;
+        if (dedupe_hash(self, HASH_PARTIAL, stats) == HASH_FAILED)
+            return NULL;
+        if (f->partial != self->partial)
+            continue;
+        if (dedupe_hash(f, HASH_FULL, stats) == HASH_FAILED)
+            continue;
+        if (dedupe_hash(self, HASH_FULL, stats) == HASH_FAILED)
+            return NULL;
+        if (f->full == self->full)
+            return strdup(f->path);
+    }
+    return NULL;
+}
+
+DedupeTable *dedupe_create(void) {
+    DedupeTable *t = calloc(1, sizeof(DedupeTable));
+    t->capacity = 1024;
+    t->groups = calloc(t->capacity, sizeof(DedupeFile *));
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+}
+
+void dedupe_free(DedupeTable *t) {
+    for (size_t i = 0; i < t->capacity; i++) {
+        DedupeFile *f = t->groups[i];
+        while (f) {
+            DedupeFile *next = f->next;
+            pthread_mutex_destroy(&f->lock);
+            free(f->path);
+            free(f);
+            f = next;
+        }
+    }
+    free(t->groups);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+void report_duplicate(FILE *out, const char *filepath, const char *filename, const char *original) {
+    if (output_format == OUTPUT_JSONL) {
+        fputs("{\"path\":", out);
+        json_write_string(out, filepath);
+        fputs(",\"duplicate_of\":", out);
+        json_write_string(out, original);
+        fputs("}\n", out);
+    } else if (brief_mode) {
+        fprintf(out, "%s: " COLOR_YELLOW "duplicate of %s" COLOR_RESET "\n", filename, original);
+    } else {
+        fprintf(out, "----------------\n\n%s\n  " COLOR_YELLOW "duplicate of %s, not checked again" COLOR_RESET "\n\n", filename, original);
+    }
+}
+
+// A file that could not be probed
+void report_error(FILE *out, const char *filepath, const char *filename, const char *failed_step, int errnum) {
+    if (output_format == OUTPUT_JSONL)
+        print_json_error(out, filepath, failed_step, errnum);
+    else if (!brief_mode)
+        print_ffmpeg_error(out, filename, errnum);
+    else
+        fprintf(out, "%s: " COLOR_YELLOW "error: %s (%d)\n" COLOR_RESET, filename, failed_step, errnum);
+}
+
+/*
+ * --decode-sample: a playback check for files that pass on paper.  The
+ * main video stream is decoded for DECODE_FRAMES frames at each of
+ * DECODE_POSITIONS evenly spaced points, and what the demuxer reads there
+ * over DECODE_WINDOW_US of stream time gives the bitrate at that point;
+ * the highest is reported as the peak, with the packets the demuxer
+ * flagged as corrupt and the errors the decoder ran into.  Decoding goes
+ * through the --hwaccel device (VAAPI or NVDEC) where the decoder supports
+ * it, else through FFmpeg's threaded software decoder.  Files are sampled
+ * by their own --decode-jobs workers once their report is out, from a
+ * queue that never fills, so the scan doesn't wait for them, and the
+ * sample reads are paced to --decode-rate bytes per second.
+ */
+#define DECODE_POSITIONS 5
+#define DECODE_FRAMES 8
+#define DECODE_WINDOW_US 1000000
+#define DECODE_MAX_PACKETS 4096         // per position; ends the window of a stream without timestamps
+#define DECODE_RATE_DEFAULT (32 * 1024 * 1024)
+
+int decode_sample = 0;
+int decode_jobs = 1;
+int64_t decode_rate = DECODE_RATE_DEFAULT;     // bytes per second over all decode workers, 0: unlimited
+const char *hwaccel_name = "auto";
+AVBufferRef *hw_device = NULL;                  // shared by every decoder
+enum AVHWDeviceType hw_device_type = AV_HWDEVICE_TYPE_NONE;
+
+typedef struct {
+    int error;              // the FFmpeg error the sample failed with, else 0
+    const char *failed_step;
+    int positions;
+    int frames;
+    int corrupt;            // packets of any stream flagged by the demuxer
+    int decode_errors;      // errors returned by the decoder, and frames it marked
+    int64_t peak_bitrate;   // bits per second, 0 if no window was long enough to tell
+    const char *decoder;    // the --hwaccel device type or "software"
+} DecodeSample;
+
+// When the reads handed out so far are paid for, at decode_rate
+int64_t decode_pace_us = 0;
+pthread_mutex_t decode_pace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Charges bytes to --decode-rate, sleeping off what earlier reads ran ahead
+void decode_throttle(int64_t bytes) {
+    if (!decode_rate)
+        return;
+    pthread_mutex_lock(&decode_pace_lock);
+    int64_t now = av_gettime_relative();
+    // An idle stage doesn't save up for a burst
+    if (decode_pace_us < now)
+        decode_pace_us = now;
+    int64_t wait = decode_pace_us - now;
+    decode_pace_us += bytes * 1000000 / decode_rate;
+    pthread_mutex_unlock(&decode_pace_lock);
+    if (wait > 0)
+        av_usleep(wait);
+}
+
+// Opens the --hwaccel device; "auto" quietly tries VAAPI, then CUDA (NVDEC)
+void hw_device_open(const char *name) {
+    static const enum AVHWDeviceType auto_types[] = { AV_HWDEVICE_TYPE_VAAPI, AV_HWDEVICE_TYPE_CUDA };
+    if (strcmp(name, "none") == 0)
+        return;
+    if (strcmp(name, "auto") == 0) {
+        for (size_t i = 0; i < sizeof(auto_types) / sizeof(auto_types[0]) && !hw_device; i++) {
+            if (av_hwdevice_ctx_create(&hw_device, auto_types[i], NULL, NULL, 0) >= 0)
+                hw_device_type = auto_types[i];
+        }
+        return;
+    }
+    enum AVHWDeviceType type = av_hwdevice_find_type_by_name(name);
+    if (av_hwdevice_ctx_create(&hw_device, type, NULL, NULL, 0) < 0)
+        fprintf(stderr, "Could not open the %s device; decoding in software\n", name);
+    else
+        hw_device_type = type;
+}
+
+// The device's surface format if the decoder offers it; otherwise it decodes in software
+enum AVPixelFormat decode_get_format(AVCodecContext *ctx, const enum AVPixelFormat *fmts) {
+    enum AVPixelFormat *hw_fmt = ctx->opaque;
+    for (const enum AVPixelFormat *f = fmts; *f != AV_PIX_FMT_NONE; f++) {
+        if (*f == *hw_fmt)
+            return *f;
+    }
+    *hw_fmt = AV_PIX_FMT_NONE;
+    return avcodec_default_get_format(ctx, fmts);
+}
+
+// A decoder for st, on hw_device when the codec has a configuration for it;
+// *hw_fmt is left AV_PIX_FMT_NONE for a software decoder
+AVCodecContext *decode_open(const AVStream *st, enum AVPixelFormat *hw_fmt) {
+    const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+    *hw_fmt = AV_PIX_FMT_NONE;
+    if (!codec)
+        return NULL;
+    for (int i = 0; hw_device; i++) {
+        const AVCodecHWConfig *cfg = avcodec_get_hw_config(codec, i);
+        if (!cfg)
+            break;
+        if ((cfg->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && cfg->device_type == hw_device_type) {
+            *hw_fmt = cfg->pix_fmt;
+            break;
+        }
+    }
+    for (;;) {
+        AVCodecContext *ctx = avcodec_alloc_context3(codec);
+        if (!ctx)
+            return NULL;
+        if (avcodec_parameters_to_context(ctx, st->codecpar) >= 0) {
+            ctx->pkt_timebase = st->time_base;
+            if (*hw_fmt != AV_PIX_FMT_NONE) {
+                ctx->hw_device_ctx = av_buffer_ref(hw_device);
+                ctx->opaque = hw_fmt;
+                ctx->get_format = decode_get_format;
+            } else {
+                ctx->thread_count = 0;      // one per processor
+                ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            }
+            if (avcodec_open2(ctx, codec, NULL) >= 0)
+                return ctx;
+        }
+        avcodec_free_context(&ctx);
+        if (*hw_fmt == AV_PIX_FMT_NONE)
+            return NULL;
+        // The device refused the stream: once more in software
+        *hw_fmt = AV_PIX_FMT_NONE;
+    }
+}
+
+// Sends pkt to the decoder; returns how many frames came out
+int decode_packet(AVCodecContext *dec, const AVPacket *pkt, AVFrame *frame, DecodeSample *ds) {
+    int frames = 0;
+    int ret = avcodec_send_packet(dec, pkt);
+    if (ret < 0 && ret != AVERROR(EAGAIN)) {
+        ds->decode_errors++;
+        return 0;
+    }
+    while ((ret = avcodec_receive_frame(dec, frame)) >= 0) {
+        if (frame->decode_error_flags || (frame->flags & AV_FRAME_FLAG_CORRUPT))
+            ds->decode_errors++;
+        frames++;
+        av_frame_unref(frame);
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        ds->decode_errors++;
+    return frames;
+}
+
+void decode_sample_input(AVFormatContext *fmt_ctx, DecodeSample *ds) {
+    int vi = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (vi < 0) {
+        ds->error = vi;
+        ds->failed_step = "no video stream";
+        return;
+    }
+    AVStream *st = fmt_ctx->streams[vi];
+    enum AVPixelFormat hw_fmt;
+    AVCodecContext *dec = decode_open(st, &hw_fmt);
+    if (!dec) {
+        ds->error = AVERROR_DECODER_NOT_FOUND;
+        ds->failed_step = "could not open decoder";
+        return;
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int64_t start = fmt_ctx->start_time != AV_NOPTS_VALUE ? fmt_ctx->start_time : 0;
+    int positions = fmt_ctx->duration > 0 ? DECODE_POSITIONS : 1;
+    for (int k = 0; k < positions && pkt && frame; k++) {
+        if (positions > 1) {
+            // The middle of the k-th of `positions` equal parts
+            int64_t ts = start + fmt_ctx->duration * (2 * k + 1) / (2 * positions);
+            if (av_seek_frame(fmt_ctx, -1, ts, AVSEEK_FLAG_BACKWARD) < 0)
+                break;
+            avcodec_flush_buffers(dec);
+        }
+        ds->positions++;
+        int frames = 0;
+        int64_t bytes = 0;
+        int64_t first = AV_NOPTS_VALUE, end = AV_NOPTS_VALUE;
+        int64_t span = 0;
+        for (int n = 0; n < DECODE_MAX_PACKETS; n++) {
+            if (av_read_frame(fmt_ctx, pkt) < 0)
+                break;
+            decode_throttle(pkt->size);
+            bytes += pkt->size;
+            if (pkt->flags & AV_PKT_FLAG_CORRUPT)
+                ds->corrupt++;
+            if (pkt->stream_index == vi) {
+                int64_t t = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+                if (t != AV_NOPTS_VALUE) {
+                    if (first == AV_NOPTS_VALUE)
+                        first = t;
+                    end = t + pkt->duration;
+                    span = av_rescale_q(end - first, st->time_base, AV_TIME_BASE_Q);
+                }
+                if (frames < DECODE_FRAMES)
+                    frames += decode_packet(dec, pkt, frame, ds);
+            }
+            av_packet_unref(pkt);
+            if (frames >= DECODE_FRAMES && span >= DECODE_WINDOW_US)
+                break;
+        }
+        ds->frames += frames;
+        // Too short a window (the end of the file) says little about the rate
+        if (span >= DECODE_WINDOW_US / 2 && bytes * 8 * AV_TIME_BASE / span > ds->peak_bitrate)
+            ds->peak_bitrate = bytes * 8 * AV_TIME_BASE / span;
+    }
+    ds->decoder = hw_fmt != AV_PIX_FMT_NONE ? av_hwdevice_get_type_name(hw_device_type) : "software";
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+}
+
+// Opens filepath again, its probe being long closed, and samples it
+void decode_sample_run(const CheckOptions *o, const char *filepath, DecodeSample *ds) {
+    ProbeInput in;
+    ProbeInfo info = {0};
+    memset(ds, 0, sizeof(*ds));
+    int ret = probe_file(filepath, o, NULL, &info, &ds->failed_step, NULL, &in);
+    probe_info_free(&info);
+    if (ret < 0) {
+        ds->error = ret;
+        return;
+    }
+    decode_sample_input(in.fmt_ctx, ds);
+    probe_input_close(&in);
+}
+
+static inline int decode_sample_bad(const DecodeSample *ds) {
+    return ds->error || ds->corrupt || ds->decode_errors;
+}
+
+void report_decode_sample(FILE *out, const char *filepath, const char *filename, const DecodeSample *ds) {
+    if (skip_ok && !decode_sample_bad(ds))
+        return;
+    char errbuf[256] = "";
+    if (ds->error)
+        av_strerror(ds->error, errbuf, sizeof(errbuf));
+
+    if (output_format == OUTPUT_JSONL) {
+        fputs("{\"path\":", out);
+        json_write_string(out, filepath);
+        fputs(",\"decode_sample\":{", out);
+        if (ds->error) {
+            fputs("\"error\":", out);
+            json_write_string(out, errbuf);
+            fputs(",\"step\":", out);
+            json_write_string(out, ds->failed_step);
+        } else {
+            fprintf(out, "\"decoder\":\"%s\",\"positions\":%d,\"frames\":%d,\"peak_bitrate\":", ds->decoder, ds->positions, ds->frames);
+            if (ds->peak_bitrate)
+                fprintf(out, "%lld", (long long)ds->peak_bitrate);
+            else
+                fputs("null", out);
+            fprintf(out, ",\"corrupt_packets\":%d,\"decode_errors\":%d", ds->corrupt, ds->decode_errors);
+        }
+        fputs("}}\n", out);
+        return;
+    }
+
+    if (brief_mode)
+        fprintf(out, "%s: decode sample: ", filename);
+    else
+        fprintf(out, "----------------\n\n%s\n  decode sample: ", filename);
+    if (ds->error) {
+        fprintf(out, COLOR_YELLOW "%s: %s" COLOR_RESET, ds->failed_step, errbuf);
+    } else {
+        if (ds->peak_bitrate)
+            fprintf(out, "peak %.1f Mbit/s, ", ds->peak_bitrate / 1e6);
+        fprintf(out, "%d frames at %d positions (%s), ", ds->frames, ds->positions, ds->decoder);
+        if (decode_sample_bad(ds))
+            fprintf(out, COLOR_RED "%d corrupt packets, %d decode errors" COLOR_RESET, ds->corrupt, ds->decode_errors);
+        else
+            fputs(COLOR_GREEN "no errors" COLOR_RESET, out);
+    }
+    fputs(brief_mode ? "\n" : "\n\n", out);
+}
+
+void decode_check_file(const CheckOptions *o, const char *filepath, int show_full_path, Summary *summary, FILE *out) {
+    DecodeSample ds;
+    decode_sample_run(o, filepath, &ds);
+    summary->sampled++;
+    if (decode_sample_bad(&ds))
+        summary->sample_errors++;
+    report_decode_sample(out, filepath, show_full_path ? filepath : get_basename(filepath), &ds);
+}
+
+/*
+ * --journal FILE: a checkpoint of the scan in progress.  Every finished file
+ * is appended in the cache's line format, as an F entry, an E line for a
+ * file that could not be probed or a D line for a duplicate.  A source
+ * --skip-fixed checked through its fix gets the fix's F entry followed by
+ * an R line, keyed by the source and carrying the fix's (dev, inode, size,
+ * mtime), so --merge can report the pair as it was:
+ *
+ *   E <dev> <ino> <size> <mtime_sec> <mtime_nsec> <error> <failed step> <path>
+ *   D <dev> <ino> <size> <mtime_sec> <mtime_nsec> 0 <original> <path>
+ *   R <dev> <ino> <size> <mtime_sec> <mtime_nsec> 0 <fix> <source>
+ *
+ * Records are collected in memory and written every JOURNAL_WRITE_US or
+ * JOURNAL_BATCH_BYTES, and the file is fsync()ed at most every
+ * JOURNAL_SYNC_US, outside the lock, so the workers never wait for the disk.
+ * A run started with an existing journal replays it first: files it lists
+ * with the same (dev, inode, size, mtime) count towards the summary and
+ * --emit-script without being probed or reported again.  A record torn by a
+ * crash is cut off before appending.  Ctrl-C stops the walk and lets the
+ * running probes finish; once a scan completes the journal is removed,
+ * unless it is a --shard's result for --merge.
+ */
+#define JOURNAL_MAGIC "# check_tv_compat journal v1"
+#define JOURNAL_BATCH_BYTES (64 * 1024)
+#define JOURNAL_WRITE_US 1000000
+#define JOURNAL_SYNC_US 10000000
+
+typedef struct {
+    const char *filename;
+    ProbeCache *done;       // records of earlier runs, by path
+    int fd;
+    StrBuf pending;         // records not written yet
+    char scratch[4096];
+    int64_t last_write;
+    int64_t last_sync;
+    int syncing;
+    int failed;
+    pthread_mutex_t lock;
+} Journal;
+
+// Set by SIGINT/SIGTERM while a journal is kept: stop dispatching, finish what is running
+volatile sig_atomic_t scan_interrupted = 0;
+
+void journal_signal(int sig) {
+    (void)sig;
+    scan_interrupted = 1;
+}
+
+Journal *journal_open(const char *filename) {
+    Journal *j = calloc(1, sizeof(Journal));
+    j->filename = filename;
+    j->done = cache_create(filename);
+    off_t end = cache_load(j->done, JOURNAL_MAGIC);
+    if (end == -3)
+        fprintf(stderr, "'%s' is not a check_tv_compat journal\n", filename);
+    if (end >= -1)
+        j->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (end < -1 || j->fd < 0 || (end >= 0 && ftruncate(j->fd, end) != 0)) {
+        if (end >= -1)
+            fprintf(stderr, "Could not open journal '%s': %s\n", filename, strerror(errno));
+        if (j->fd > 0)
+            close(j->fd);
+        cache_close(j->done);
+        free(j);
+        return NULL;
+    }
+    sb_init(&j->pending, j->scratch, sizeof(j->scratch));
+    if (end < 0)
+        sb_appendf(&j->pending, "%s\n", JOURNAL_MAGIC);
+    j->last_write = j->last_sync = av_gettime_relative();
+    pthread_mutex_init(&j->lock, NULL);
+    return j;
+}
+
+// Writes out the pending records; called with the lock held
+void journal_write(Journal *j) {
+    const char *p = j->pending.data;
+    size_t left = j->pending.len;
+    while (left > 0 && !j->failed) {
+        ssize_t n = write(j->fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "Could not write journal '%s': %s\n", j->filename, strerror(errno));
+            j->failed = 1;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    sb_reset(&j->pending);
+    j->last_write = av_gettime_relative();
+}
+
+// detail: E's failed step or D's original, else NULL
+void journal_record(Journal *j, char kind, const char *path, const struct stat *st, const ProbeInfo *info, int errnum, const char *detail) {
+    // The line format can't hold these; such files are checked again
+    if (strpbrk(path, "\t\n"))
+        return;
+    CacheEntry e = {
+        .path = (char *)path, .dev = st->st_dev, .ino = st->st_ino, .size = st->st_size,
+        .mtime_sec = st->st_mtime, .mtime_nsec = stat_mtime_nsec(st),
+        .kind = kind, .errnum = errnum, .detail = (char *)detail,
+    };
+    if (info)
+        e.info = *info;
+
+    int sync = 0;
+    pthread_mutex_lock(&j->lock);
+    cache_format_entry(&j->pending, &e);
+    int64_t now = av_gettime_relative();
+    if (j->pending.len >= JOURNAL_BATCH_BYTES || now - j->last_write >= JOURNAL_WRITE_US)
+        journal_write(j);
+    if (!j->syncing && !j->failed && now - j->last_sync >= JOURNAL_SYNC_US) {
+        j->syncing = sync = 1;
+        j->last_sync = now;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    if (sync) {
+        fsync(j->fd);
+        pthread_mutex_lock(&j->lock);
+        j->syncing = 0;
+        pthread_mutex_unlock(&j->lock);
+    }
+}
+
+// Counts a file an earlier run finished, unchanged since, as checked; returns 1 if it did.
+// source is set when path is a fix checked in the source's place.
+int journal_replay(Journal *j, const CheckOptions *o, const char *path, const struct stat *st, const char *source, Summary *summary) {
+    pthread_mutex_lock(&j->done->lock);
+    CacheEntry *e = *cache_slot(j->done, path);
+    int found = e && e->kind != 'R' && cache_entry_matches(e, st);
+    char kind = found ? e->kind : 0;
+    ProbeInfo info = {0};
+    if (kind == 'F')
+        probe_info_copy(&info, &e->info);
+    pthread_mutex_unlock(&j->done->lock);
+    if (!found)
+        return 0;
+    if (kind == 'F' && o->deep_mode && !deep_checked(&info)) {
+        // Journaled by a run without --deep
+        probe_info_free(&info);
+        return 0;
+    }
+
+    if (kind == 'E') {
+        summary->errors++;
+    } else if (kind == 'D') {
+        summary->duplicates++;
+    } else {
+        FileAnalysis analysis;
+        analyze_file(o, &info, &analysis);
+        summary_count(summary, &analysis);
+        if (source)
+            summary->resolved++;
+        if (fix_script) {
+            char scratch[4096];
+            StrBuf sb;
+            sb_init(&sb, scratch, sizeof(scratch));
+            script_add_file(fix_script, &sb, path, &analysis);
+            sb_free(&sb);
+        }
+        analysis_free(&analysis);
+        // Later copies of it are still duplicates
+        if (dedupe)
+            free(dedupe_check(dedupe, path, st, NULL));
+    }
+    probe_info_free(&info);
+    summary->resumed++;
+    return 1;
+}
+
+// Writes and syncs what is pending; a completed scan's journal is removed
+void journal_close(Journal *j, int complete) {
+    journal_write(j);
+    if (!j->failed && fsync(j->fd) != 0)
+        fprintf(stderr, "Could not write journal '%s': %s\n", j->filename, strerror(errno));
+    close(j->fd);
+    if (complete && !j->failed)
+        unlink(j->filename);
+    sb_free(&j->pending);
+    cache_close(j->done);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
+
+// A file between probing and its report
+typedef struct {
+    ProbeInfo info;
+    ProbeInput input;       // open while the file was probed rather than found in the cache
+    ProbeStats probe_stats;
+    int64_t reserved;       // probe budget held until the file is done
+    int64_t t_start;
+    char *source;           // --skip-fixed: the source this fixed output is checked for
+} ProbedFile;
+
+/*
+ * What a check runs with (check_tv_compat.h): the CheckOptions and cache of
+ * a library context, or of the command line's, which adds its --journal and
+ * probe budget.  Checks on different contexts, or on one context from many
+ * threads, share no other state.
+ */
+struct ctv_context {
+    CheckOptions options;
+    ProbeCache *cache;
+    Journal *journal;       // --journal; NULL for library contexts
+    Budget *budget;         // --max-inflight-bytes; NULL: probes aren't held back
+};
+
+typedef struct ServeClient ServeClient;
+
+// A file found by the directory walk, waiting to be probed, a probed one
+// waiting for the --deep stage or a finished one waiting for --decode-sample
+typedef struct {
+    char *path;
+    struct stat st;
+    ProbedFile *probed;
+    ServeClient *client;    // --serve: who the report goes to
+    FileHead *head;         // --uring: prefetched start of the file
+    int decode;
+} FileJob;
+
+/*
+ * --jobs auto: a concurrency limit per device
+ * -------------------------------------------
+ * Files are queued per st_dev, and each device has its own limit on how
+ * many of its files are probed at once.  The limit follows the probe
+ * latency the device shows, AIMD style, one decision per round of `limit`
+ * probes: while the round's average stays within ADAPT_LATENCY_FACTOR of
+ * the device's best round the limit doubles (at first) or grows by one;
+ * beyond that it is multiplied by ADAPT_DECREASE.  Probes that were
+ * already running when the limit changed don't count towards the next
+ * round.  A worker takes the next file of any device below its limit, so a
+ * share that collapses under concurrent readers gets few of them while a
+ * local disk keeps the rest busy.
+ */
+#define ADAPT_LATENCY_FACTOR 2.0
+#define ADAPT_DECREASE 0.7
+#define ADAPT_MIN_LATENCY_US 1000   // a device this fast isn't what the scan waits for
+
+typedef struct {
+    dev_t dev;
+    FileJob **jobs;         // FIFO of the queue's capacity
+    int head;
+    int count;
+    int inflight;
+    double limit;           // fractional for the additive increase
+    int slow_start;
+    int64_t round_us;       // latencies of the current round, summed
+    int round_n;
+    int skip;               // probes started before the limit last changed, still to finish
+    int64_t last_us;        // average of the last round
+    int64_t base_us;        // the best round, slowly following the device
+    int peak;
+    int probes;
+    int cuts;
+} DevicePool;
+
+// Bounded queue of files between the directory walk and the probe workers
+typedef struct {
+    FileJob **jobs;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    // --jobs auto: per-device FIFOs instead of jobs, each limit at most max_limit
+    int max_limit;
+    DevicePool **devices;
+    int num_devices;
+    int next_device;
+    int unbounded;          // grows instead of blocking the pusher
+} PathQueue;
+
+typedef struct {
+    pthread_t thread;
+    PathQueue *queue;
+    ctv_context *ctx;
+    int show_full_path;
+    Summary summary;
+} Worker;
+
+PathQueue *work_queue = NULL;
+PathQueue *deep_queue = NULL;
+PathQueue *decode_queue = NULL;
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+// How long check_file spent probing the worker's current file, -1 if it didn't (a cache hit, a duplicate)
+static __thread int64_t probe_latency = -1;
+
+// max_limit > 0 queues per device (--jobs auto) and lets each device have up to max_limit files in flight
+void queue_init(PathQueue *q, int capacity, int max_limit) {
+    q->jobs = calloc(capacity, sizeof(FileJob *));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    q->max_limit = max_limit;
+    q->devices = NULL;
+    q->num_devices = 0;
+    q->next_device = 0;
+    q->unbounded = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+void queue_destroy(PathQueue *q) {
+    for (int i = 0; i < q->num_devices; i++) {
+        free(q->devices[i]->jobs);
+        free(q->devices[i]);
+    }
+    free(q->devices);
+    free(q->jobs);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+// Called with the lock held
+DevicePool *queue_device(PathQueue *q, dev_t dev) {
+    for (int i = 0; i < q->num_devices; i++)
+        if (q->devices[i]->dev == dev)
+            return q->devices[i];
+    q->devices = realloc(q->devices, (q->num_devices + 1) * sizeof(DevicePool *));
+    DevicePool *d = calloc(1, sizeof(DevicePool));
+    d->jobs = calloc(q->capacity, sizeof(FileJob *));
+    d->dev = dev;
+    d->limit = 1;
+    d->slow_start = 1;
+    d->peak = 1;
+    q->devices[q->num_devices++] = d;
+    return d;
+}
+
+// One probe of d finished after latency_us
+void device_adapt(DevicePool *d, int64_t latency_us, int max_limit) {
+    d->probes++;
+    if (d->skip > 0) {
+        d->skip--;
+        return;
+    }
+    d->round_us += latency_us;
+    if (++d->round_n < (int)d->limit)
+        return;
+
+    d->last_us = d->round_us / d->round_n > 0 ? d->round_us / d->round_n : 1;
+    d->round_us = 0;
+    d->round_n = 0;
+    if (!d->base_us || d->last_us < d->base_us)
+        d->base_us = d->last_us;
+    else
+        // Follows a device whose files simply take longer, by up to 1/16 per round
+        d->base_us += (d->last_us < 2 * d->base_us ? d->last_us - d->base_us : d->base_us) / 16;
+
+    if (d->last_us > d->base_us * ADAPT_LATENCY_FACTOR && d->last_us > ADAPT_MIN_LATENCY_US) {
+        d->limit = d->limit * ADAPT_DECREASE > 1 ? d->limit * ADAPT_DECREASE : 1;
+        d->slow_start = 0;
+        d->cuts++;
+    } else {
+        d->limit = d->slow_start ? 2 * d->limit : d->limit + 1;
+    }
+    // The probes still running were started under the old limit
+    d->skip = d->inflight;
+    if (d->limit > max_limit)
+        d->limit = max_limit;
+    if ((int)d->limit > d->peak)
+        d->peak = (int)d->limit;
+}
+
+// Blocks while the queue (with --jobs auto: the file's device) is full; takes ownership of job
+void queue_push(PathQueue *q, FileJob *job) {
+    pthread_mutex_lock(&q->lock);
+    if (q->max_limit) {
+        DevicePool *d = queue_device(q, job->st.st_dev);
+        while (d->count == q->capacity)
+            pthread_cond_wait(&q->not_full, &q->lock);
+        d->jobs[(d->head + d->count) % q->capacity] = job;
+        d->count++;
+    } else {
+        while (q->count == q->capacity && !q->unbounded)
+            pthread_cond_wait(&q->not_full, &q->lock);
+        if (q->count == q->capacity) {
+            FileJob **jobs = calloc(2 * q->capacity, sizeof(FileJob *));
+            for (int i = 0; i < q->count; i++)
+                jobs[i] = q->jobs[(q->head + i) % q->capacity];
+            free(q->jobs);
+            q->jobs = jobs;
+            q->head = 0;
+            q->capacity *= 2;
+        }
+        q->jobs[(q->head + q->count) % q->capacity] = job;
+    }
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Called with the lock held: the oldest file of the next device below its limit, round robin
+FileJob *queue_take_device(PathQueue *q) {
+    for (int k = 0; k < q->num_devices; k++) {
+        int i = (q->next_device + k) % q->num_devices;
+        DevicePool *d = q->devices[i];
+        if (d->count == 0 || d->inflight >= (int)d->limit)
+            continue;
+        FileJob *job = d->jobs[d->head];
+        d->head = (d->head + 1) % q->capacity;
+        d->count--;
+        d->inflight++;
+        q->next_device = i + 1;
+        return job;
+    }
+    return NULL;
+}
+
+// Returns NULL once the queue is closed and drained
+FileJob *queue_pop(PathQueue *q) {
+    FileJob *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        if (q->count > 0 && !q->max_limit) {
+            job = q->jobs[q->head];
+            q->head = (q->head + 1) % q->capacity;
+        } else if (q->count > 0) {
+            job = queue_take_device(q);
+        }
+        if (job || (q->count == 0 && q->closed))
+            break;
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (job) {
+        q->count--;
+        // With devices, the walker may be waiting on any of them
+        if (q->max_limit)
+            pthread_cond_broadcast(&q->not_full);
+        else
+            pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+// --jobs auto: job, taken from q, is done; latency_us is how long its probe took, -1 without one
+void queue_done(PathQueue *q, const FileJob *job, int64_t latency_us) {
+    if (!q->max_limit)
+        return;
+    pthread_mutex_lock(&q->lock);
+    DevicePool *d = queue_device(q, job->st.st_dev);
+    d->inflight--;
+    if (latency_us >= 0)
+        device_adapt(d, latency_us, q->max_limit);
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// --jobs auto, for --stats: where each device's limit ended up
+void queue_print_devices(FILE *out, PathQueue *q) {
+    for (int i = 0; i < q->num_devices; i++) {
+        DevicePool *d = q->devices[i];
+        fprintf(out, "Device %u:%u: %d probes, limit %d (peak %d, cut %d times), latency %.1f ms (best %.1f ms)\n",
+            major(d->dev), minor(d->dev), d->probes, (int)d->limit, d->peak, d->cuts,
+            d->last_us / 1000.0, d->base_us / 1000.0);
+    }
+}
+
+void queue_close(PathQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * --metrics [HOST:]PORT: a Prometheus text exposition of what a --watch or
+ * --serve process has been doing, served over HTTP at /metrics by a thread
+ * of its own.  Counters and histograms follow the files as they finish;
+ * like the Summary, the per-container and per-codec file counts count every
+ * check, so a file --watch checks again is counted again.  Label
+ * values are interned or static strings, so series are found by pointer.
+ */
+#define METRICS_BUCKETS 13
+#define METRICS_MAX_REQUEST 8192
+
+static const int64_t metrics_bounds_us[METRICS_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000,
+};
+
+enum { PHASE_OPEN, PHASE_INFO, PHASE_DEEP, PHASE_HASH, PHASE_RULES, PHASE_OUTPUT, NUM_PHASES };
+static const char *const phase_names[NUM_PHASES] = { "open", "stream_info", "deep", "hash", "rules", "output" };
+
+// Status label values; counts are keyed by these pointers
+static const char STATUS_OK[] = "ok";
+static const char STATUS_NOT_SUPPORTED[] = "not_supported";
+static const char STATUS_ERROR[] = "error";
+
+typedef struct {
+    int64_t buckets[METRICS_BUCKETS + 1];   // per bucket, the last one unbounded; cumulated when rendered
+    int64_t count;
+    int64_t sum_us;
+} Histogram;
+
+// One value per combination of up to three label values
+typedef struct {
+    const char *labels[3];
+    int64_t value;
+} MetricsSeries;
+
+typedef struct {
+    MetricsSeries *series;
+    int count;
+    int capacity;
+} MetricsFamily;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int64_t files_probed;
+    int64_t bytes_read;
+    int64_t reads;
+    int64_t duplicates;
+    Histogram phases[NUM_PHASES];
+    Histogram files;        // whole check of a file, probe to report
+    MetricsFamily errors;   // step, av_strerror text
+    MetricsFamily containers;   // container, status
+    MetricsFamily codecs;   // codec type, codec, status
+    ProbeCache *cache;      // --cache, for its hit counts
+    // The HTTP listener
+    int listen_fd;
+    int wake[2];
+    pthread_t thread;
+} Metrics;
+
+Metrics metrics = { .lock = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1 };
+
+void histogram_observe(Histogram *h, int64_t us) {
+    int i = 0;
+    while (i < METRICS_BUCKETS && us > metrics_bounds_us[i]) i++;
+    h->buckets[i]++;
+    h->count++;
+    h->sum_us += us;
+}
+
+void metrics_add(MetricsFamily *f, const char *a, const char *b, const char *c, int64_t n) {
+    for (int i = 0; i < f->count; i++) {
+        MetricsSeries *s = &f->series[i];
+        if (s->labels[0] == a && s->labels[1] == b && s->labels[2] == c) {
+            s->value += n;
+            return;
+        }
+    }
+    if (f->count == f->capacity) {
+        f->capacity = f->capacity ? f->capacity * 2 : 16;
+        f->series = realloc(f->series, f->capacity * sizeof(MetricsSeries));
+    }
+    f->series[f->count++] = (MetricsSeries){ { a, b, c }, n };
+}
+
+void metrics_probe(const ProbeStats *probe, int64_t total_us) {
+    if (probe->probed) {
+        metrics.files_probed++;
+        histogram_observe(&metrics.phases[PHASE_OPEN], probe->open_us);
+        histogram_observe(&metrics.phases[PHASE_INFO], probe->info_us);
+    }
+    // Only the files that went through these stages
+    if (probe->deep_us)
+        histogram_observe(&metrics.phases[PHASE_DEEP], probe->deep_us);
+    if (probe->hash_us)
+        histogram_observe(&metrics.phases[PHASE_HASH], probe->hash_us);
+    metrics.bytes_read += probe->bytes_read;
+    metrics.reads += probe->reads;
+    histogram_observe(&metrics.files, total_us);
+}
+
+// A file scored and reported
+void metrics_file(const FileAnalysis *a, const ProbeStats *probe, int64_t rules_us, int64_t output_us, int64_t total_us) {
+    const char *status = a->all_profiles_ok ? STATUS_OK : STATUS_NOT_SUPPORTED;
+    pthread_mutex_lock(&metrics.lock);
+    metrics_probe(probe, total_us);
+    histogram_observe(&metrics.phases[PHASE_RULES], rules_us);
+    histogram_observe(&metrics.phases[PHASE_OUTPUT], output_us);
+    metrics_add(&metrics.containers, a->container, status, NULL, 1);
+    for (int i = 0; i < a->nb_streams; i++) {
+        const StreamAnalysis *sa = &a->streams[i];
+        // Files, not streams: a codec counts once per file
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++)
+            seen = a->streams[j].codec_name == sa->codec_name && a->streams[j].type == sa->type;
+        if (!seen)
+            metrics_add(&metrics.codecs, av_get_media_type_string(sa->type), sa->codec_name, status, 1);
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+// A file that could not be probed
+void metrics_error(const char *step, int errnum, const ProbeStats *probe, int64_t total_us) {
+    char errbuf[256];
+    av_strerror(errnum, errbuf, sizeof(errbuf));
+    const char *error = intern(errbuf);
+    pthread_mutex_lock(&metrics.lock);
+    metrics_probe(probe, total_us);
+    metrics_add(&metrics.errors, step ? step : "", error, NULL, 1);
+    metrics_add(&metrics.containers, "", STATUS_ERROR, NULL, 1);
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+void metrics_duplicate(const ProbeStats *probe, int64_t total_us) {
+    pthread_mutex_lock(&metrics.lock);
+    metrics_probe(probe, total_us);
+    metrics.duplicates++;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+// A label value with backslashes, quotes and newlines escaped
+void metrics_write_label(FILE *out, const char *name, const char *value) {
+    fprintf(out, "%s=\"", name);
+    for (const char *p = value ? value : ""; *p; p++) {
+        if (*p == '\\' || *p == '"') fputc('\\', out);
+        if (*p == '\n') fputs("\\n", out);
+        else fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+void metrics_write_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write_family(FILE *out, const char *name, const char *type, const char *help,
+                          const MetricsFamily *f, const char *const label_names[3]) {
+    metrics_write_header(out, name, type, help);
+    for (int i = 0; i < f->count; i++) {
+        fprintf(out, "%s{", name);
+        for (int l = 0; l < 3 && label_names[l]; l++) {
+            if (l) fputc(',', out);
+            metrics_write_label(out, label_names[l], f->series[i].labels[l]);
+        }
+        fprintf(out, "} %lld\n", (long long)f->series[i].value);
+    }
+}
+
+// label is "" or one label pair, e.g. phase="open"
+void metrics_write_histogram(FILE *out, const char *name, const char *label, const Histogram *h) {
+    const char *sep = *label ? "," : "";
+    int64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += h->buckets[i];
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lld\n", name, label, sep, metrics_bounds_us[i] / 1e6, (long long)cumulative);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lld\n", name, label, sep, (long long)h->count);
+    const char *open = *label ? "{" : "", *close = *label ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %.6f\n", name, open, label, close, h->sum_us / 1e6);
+    fprintf(out, "%s_count%s%s%s %lld\n", name, open, label, close, (long long)h->count);
+}
+
+void metrics_render(FILE *out) {
+    static const char *const error_labels[3] = { "step", "error", NULL };
+    static const char *const container_labels[3] = { "container", "status", NULL };
+    static const char *const codec_labels[3] = { "codec_type", "codec", "status" };
+
+    if (metrics.cache) {
+        pthread_mutex_lock(&metrics.cache->lock);
+        int hits = metrics.cache->hits, misses = metrics.cache->misses;
+        pthread_mutex_unlock(&metrics.cache->lock);
+        metrics_write_header(out, "ctv_cache_hits_total", "counter", "Probe results taken from --cache.");
+        fprintf(out, "ctv_cache_hits_total %d\n", hits);
+        metrics_write_header(out, "ctv_cache_misses_total", "counter", "Files --cache had no valid result for.");
+        fprintf(out, "ctv_cache_misses_total %d\n", misses);
+    }
+    metrics_write_header(out, "ctv_queue_depth", "gauge", "Files waiting for a worker, per pool.");
+    PathQueue *queues[] = { work_queue, deep_queue, decode_queue };
+    const char *pools[] = { "probe", "deep", "decode" };
+    for (int i = 0; i < 3; i++) {
+        if (!queues[i]) continue;
+        pthread_mutex_lock(&queues[i]->lock);
+        int depth = queues[i]->count;
+        pthread_mutex_unlock(&queues[i]->lock);
+        fprintf(out, "ctv_queue_depth{pool=\"%s\"} %d\n", pools[i], depth);
+    }
+
+    pthread_mutex_lock(&metrics.lock);
+    metrics_write_header(out, "ctv_files_probed_total", "counter", "Files opened and probed with libavformat.");
+    fprintf(out, "ctv_files_probed_total %lld\n", (long long)metrics.files_probed);
+    metrics_write_header(out, "ctv_read_bytes_total", "counter", "Bytes read by probes.");
+    fprintf(out, "ctv_read_bytes_total %lld\n", (long long)metrics.bytes_read);
+    metrics_write_header(out, "ctv_reads_total", "counter", "read(2) calls, or HTTP requests for remote files, made by probes.");
+    fprintf(out, "ctv_reads_total %lld\n", (long long)metrics.reads);
+    if (dedupe) {
+        metrics_write_header(out, "ctv_duplicates_total", "counter", "Files found to be duplicates by --dedupe.");
+        fprintf(out, "ctv_duplicates_total %lld\n", (long long)metrics.duplicates);
+    }
+    metrics_write_family(out, "ctv_probe_errors_total", "counter", "Files that could not be probed, by failed step and error.",
+        &metrics.errors, error_labels);
+
+    metrics_write_header(out, "ctv_phase_seconds", "histogram", "Time spent in each phase of a file's check.");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        char label[64];
+        snprintf(label, sizeof(label), "phase=\"%s\"", phase_names[p]);
+        metrics_write_histogram(out, "ctv_phase_seconds", label, &metrics.phases[p]);
+    }
+    metrics_write_header(out, "ctv_file_seconds", "histogram", "Time from a file's probe to its report.");
+    metrics_write_histogram(out, "ctv_file_seconds", "", &metrics.files);
+
+    metrics_write_family(out, "ctv_files_checked_total", "counter", "Files checked, by container and result, as in the summary.",
+        &metrics.containers, container_labels);
+    metrics_write_family(out, "ctv_files_by_codec_total", "counter", "Files checked with a stream of each codec, by result.",
+        &metrics.codecs, codec_labels);
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+// Answers one scrape; a client that sends nothing within a few seconds is dropped
+void metrics_answer(int fd) {
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[METRICS_MAX_REQUEST];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+    request[len] = '\0';
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    const char *status = "200 OK";
+    int get = strncmp(request, "GET ", 4) == 0;
+    if (!get && strncmp(request, "HEAD ", 5) != 0) {
+        status = "405 Method Not Allowed";
+        fputs("Only GET is supported\n", out);
+    } else {
+        const char *target = request + (get ? 4 : 5);
+        size_t target_len = strcspn(target, " ?\r\n");
+        if (target_len == 8 && strncmp(target, "/metrics", 8) == 0) {
+            metrics_render(out);
+        } else {
+            status = "404 Not Found";
+            fputs("Metrics are at /metrics\n", out);
+        }
+    }
+    fclose(out);
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_len);
+    const char *parts[2] = { header, body };
+    size_t sizes[2] = { (size_t)header_len, get ? body_len : 0 };
+    for (int i = 0; i < 2; i++) {
+        for (size_t off = 0; off < sizes[i]; ) {
+            ssize_t n = send(fd, parts[i] + off, sizes[i] - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                i = 2;
+                break;
+            }
+            off += n;
+        }
+    }
+    free(body);
+}
+
+void *metrics_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        struct pollfd fds[2] = { { .fd = metrics.listen_fd, .events = POLLIN }, { .fd = metrics.wake[0], .events = POLLIN } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(metrics.listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                metrics_answer(fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Listens on addr ("PORT", "HOST:PORT" or "[IPv6]:PORT"; all interfaces without a host) and starts the thread
+int metrics_start(const char *addr, ProbeCache *cache) {
+    char host[256] = "";
+    const char *port = addr;
+    const char *colon = strrchr(addr, ':');
+    if (colon) {
+        const char *start = addr, *end = colon;
+        if (*start == '[' && end > start && end[-1] == ']') {
+            start++;
+            end--;
+        }
+        if ((size_t)(end - start) >= sizeof(host)) {
+            fprintf(stderr, "Invalid --metrics address '%s'\n", addr);
+            return -1;
+        }
+        memcpy(host, start, end - start);
+        host[end - start] = '\0';
+        port = colon + 1;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    int err = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Invalid --metrics address '%s': %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 16) != 0) {
+            err = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr, "Could not listen on '%s': %s\n", addr, strerror(err ? err : EADDRNOTAVAIL));
+        return -1;
+    }
+    if (pipe(metrics.wake) != 0) {
+        fprintf(stderr, "Could not create pipe: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    metrics.listen_fd = fd;
+    metrics.cache = cache;
+    if ((err = pthread_create(&metrics.thread, NULL, metrics_main, NULL)) != 0) {
+        fprintf(stderr, "Could not start metrics thread: %s\n", strerror(err));
+        close(fd);
+        close(metrics.wake[0]);
+        close(metrics.wake[1]);
+        metrics.listen_fd = -1;
+        return -1;
+    }
+    fprintf(stderr, "Serving metrics on http://%s/metrics\n", addr);
+    return 0;
+}
+
+// Before the queues the endpoint reports on go away
+void metrics_stop(void) {
+    if (metrics.listen_fd < 0)
+        return;
+    ssize_t n = write(metrics.wake[1], "", 1);
+    (void)n;
+    pthread_join(metrics.thread, NULL);
+    close(metrics.listen_fd);
+    close(metrics.wake[0]);
+    close(metrics.wake[1]);
+    metrics.listen_fd = -1;
+    free(metrics.errors.series);
+    free(metrics.containers.series);
+    free(metrics.codecs.series);
+}
+
+// The cache lookup and probe of a check, for check_path() and ctv_check(): returns 0 with
+// pf->info set, 1 when the --deep stage is still to run on pf->input, or the probe's error.
+// With keep, or with --deep, the probed input stays open (and its memory reserved) for the caller.
+int check_probe(ctv_context *ctx, const char *filepath, const struct stat *st, FileHead *head, ProbedFile *pf,
+                ProbeStats *stats, int keep, const char **failed_step) {
+    const CheckOptions *o = &ctx->options;
+    int hit = ctx->cache && st && cache_lookup(ctx->cache, filepath, st, &pf->info);
+    if (hit && o->deep_mode && !deep_checked(&pf->info)) {
+        // Cached by a run without --deep
+        probe_info_free(&pf->info);
+        hit = 0;
+    }
+    if (hit)
+        return 0;
+
+    keep |= o->deep_mode;
+    if (ctx->budget) {
+        pf->reserved = probe_memory_estimate(o, st);
+        budget_acquire(ctx->budget, pf->reserved);
+    }
+    int64_t t_probe = av_gettime_relative();
+    int ret = probe_file(filepath, o, head, &pf->info, failed_step, stats, keep ? &pf->input : NULL);
+    probe_latency = av_gettime_relative() - t_probe;
+    if ((!keep || ret < 0) && pf->reserved) {
+        budget_release(ctx->budget, pf->reserved);
+        pf->reserved = 0;
+    }
+    if (ret < 0)
+        return ret;
+    if (o->deep_mode && deep_pending(&pf->info))
+        return 1;
+    if (ctx->cache && st)
+        cache_store(ctx->cache, filepath, st, &pf->info);
+    return 0;
+}
+
+// The --deep stage: reads the first keyframes for what the header didn't say
+void check_deep(ctv_context *ctx, const char *filepath, const struct stat *st, ProbedFile *pf, ProbeStats *stats) {
+    int64_t t0 = av_gettime_relative();
+    ProbeInput *in = &pf->input;
+    deep_read_packets(in->fmt_ctx, &pf->info);
+    if (stats) {
+        stats->deep_us = av_gettime_relative() - t0;
+        probe_input_counters(in, stats);
+    }
+    // Packets have been consumed; --remux opens the file again
+    probe_input_close(in);
+    if (ctx->cache && st)
+        cache_store(ctx->cache, filepath, st, &pf->info);
+}
+
+// Scores a probed file, applies --remux and prints its report; releases what the probe held
+void finish_file(ctv_context *ctx, const char *filepath, const struct stat *st, int show_full_path, ProbedFile *pf, Summary *summary, FILE *out) {
+    const char *filename = show_full_path ? filepath : get_basename(filepath);
+
+    int64_t t_rules = av_gettime_relative();
+
+    // Every requested profile is scored from the same probe, in a single pass over the streams
+    FileAnalysis analysis;
+    analyze_file(&ctx->options, &pf->info, &analysis);
+    if (pf->source) {
+        analysis.source = pf->source;
+        analysis.source_name = show_full_path ? pf->source : get_basename(pf->source);
+        summary->resolved++;
+    }
+    if (ctx->journal && st) {
+        journal_record(ctx->journal, 'F', filepath, st, &pf->info, 0, NULL);
+        if (pf->source)
+            journal_record(ctx->journal, 'R', pf->source, st, NULL, 0, filepath);
+    }
+    probe_info_free(&pf->info);
+    summary_count(summary, &analysis);
+
+    int64_t t_remux = av_gettime_relative();
+    if (remux_mode && remux_wanted(&analysis)) {
+        remux_file(filepath, st, &pf->input, &analysis);
+        if (strcmp(analysis.remux_status, "done") == 0) summary->remuxed++;
+        else if (strcmp(analysis.remux_status, "failed") == 0) summary->remux_failed++;
+    }
+    probe_input_close(&pf->input);
+    if (pf->reserved)
+        budget_release(ctx->budget, pf->reserved);
+    pf->reserved = 0;
+
+    int64_t t_output = av_gettime_relative();
+    char scratch[4096];
+    StrBuf sb;
+    sb_init(&sb, scratch, sizeof(scratch));
+    report_file(out, &sb, filepath, filename, &analysis);
+    if (fix_script)
+        script_add_file(fix_script, &sb, filepath, &analysis);
+    sb_free(&sb);
+    int has_video = 0;
+    for (int i = 0; i < analysis.nb_streams; i++)
+        has_video |= analysis.streams[i].type == AVMEDIA_TYPE_VIDEO;
+
+    int64_t t_end = av_gettime_relative();
+    if (stats_mode)
+        stats_record(filepath, &pf->probe_stats, t_remux - t_rules, t_end - t_output, t_end - pf->t_start);
+    if (metrics_mode)
+        metrics_file(&analysis, &pf->probe_stats, t_remux - t_rules, t_end - t_output, t_end - pf->t_start);
+    analysis_free(&analysis);
+    free(pf->source);
+    pf->source = NULL;
+
+    // After the report and off the probe workers, so the scan doesn't wait for it
+    if (decode_sample && has_video) {
+        if (decode_queue) {
+            FileJob *job = calloc(1, sizeof(FileJob));
+            job->path = strdup(filepath);
+            if (st)
+                job->st = *st;
+            job->decode = 1;
+            queue_push(decode_queue, job);
+        } else {
+            decode_check_file(&ctx->options, filepath, show_full_path, summary, out);
+        }
+    }
+}
+
+// The --deep workers' part of check_path(): the packet stage, then the report
+void deep_check_file(ctv_context *ctx, const char *filepath, const struct stat *st, int show_full_path, ProbedFile *pf, Summary *summary, FILE *out) {
+    check_deep(ctx, filepath, st, pf, stats_mode || metrics_mode ? &pf->probe_stats : NULL);
+    finish_file(ctx, filepath, st, show_full_path, pf, summary, out);
+}
+
+// check_file() of a file with a supported extension; source is set when
+// the file is checked in place of the source it is a fix of
+void check_path(ctv_context *ctx, const char *filepath, const struct stat *st, FileHead *head, const char *source,
+                int show_full_path, Summary *summary, FILE *out) {
+    const char *filename = show_full_path ? filepath : get_basename(filepath);
+
+    if (ctx->journal && st && journal_replay(ctx->journal, &ctx->options, filepath, st, source, summary))
+        return;
+
+    // A file handed to the --deep workers must not move: its AVIOContext points into it
+    ProbedFile local = {0};
+    ProbedFile *pf = deep_queue ? calloc(1, sizeof(ProbedFile)) : &local;
+    pf->t_start = av_gettime_relative();
+
+    if (dedupe && st) {
+        char *original = dedupe_check(dedupe, filepath, st, &pf->probe_stats);
+        if (original) {
+            report_duplicate(out, filepath, filename, original);
+            summary->duplicates++;
+            if (ctx->journal)
+                journal_record(ctx->journal, 'D', filepath, st, NULL, 0, original);
+            free(original);
+            if (stats_mode)
+                stats_record(filepath, &pf->probe_stats, 0, 0, av_gettime_relative() - pf->t_start);
+            if (metrics_mode)
+                metrics_duplicate(&pf->probe_stats, av_gettime_relative() - pf->t_start);
+            if (pf != &local)
+                free(pf);
+            return;
+        }
+    }
+    pf->source = source ? strdup(source) : NULL;
+
+    // --remux takes the open input over from the probe
+    const char *failed_step = NULL;
+    int ret = check_probe(ctx, filepath, st, head, pf, stats_mode || metrics_mode ? &pf->probe_stats : NULL,
+                          remux_mode, &failed_step);
+    if (ret < 0) {
+        report_error(out, filepath, filename, failed_step, ret);
+        summary->errors++;
+        if (ctx->journal && st)
+            journal_record(ctx->journal, 'E', filepath, st, NULL, ret, failed_step);
+        if (stats_mode)
+            stats_record(filepath, &pf->probe_stats, 0, 0, av_gettime_relative() - pf->t_start);
+        if (metrics_mode)
+            metrics_error(failed_step, ret, &pf->probe_stats, av_gettime_relative() - pf->t_start);
+        free(pf->source);
+        if (pf != &local)
+            free(pf);
+        return;
+    }
+    if (ret > 0) {
+        if (deep_queue && st) {
+            FileJob *job = calloc(1, sizeof(FileJob));
+            job->path = strdup(filepath);
+            job->st = *st;
+            job->probed = pf;
+            queue_push(deep_queue, job);
+            return;
+        }
+        deep_check_file(ctx, filepath, st, show_full_path, pf, summary, out);
+    } else {
+        finish_file(ctx, filepath, st, show_full_path, pf, summary, out);
+    }
+    if (pf != &local)
+        free(pf);
+}
+
+/*
+ * --skip-fixed: a source next to a fix of it (the remuxed_ or fixed_ output
+ * the suggested commands, --emit-script and --remux write) that is newer
+ * than the source is not probed.  The fix is checked in its place, through
+ * the cache like any other file, and reported as resolving the source; the
+ * walk in turn skips a fix when it is reported with its source, so a pair
+ * costs one check, or none when the fix's cache entry is still valid.
+ */
+
+// Path of the first fix of filepath that is newer than it; NULL if there is none
+char *fixed_output_find(const CheckOptions *o, const char *filepath, const struct stat *st, struct stat *fixed_st) {
+    char storage[PATH_BUF_SIZE];
+    StrBuf target;
+    sb_init(&target, storage, sizeof(storage));
+    char *found = NULL;
+    // The remux first, then the transcode for each profile
+    for (int p = -1; p < o->num_profiles && !found; p++) {
+        target.len = 0;
+        sb_append_len(&target, filepath, output_dir_length(filepath));
+        append_output_name(&target, filepath, p >= 0, p >= 0 ? output_tag(o, p) : NULL);
+        struct stat tst;
+        if (fixed_dir_has(target.data) && stat(target.data, &tst) == 0 && S_ISREG(tst.st_mode) && stat_newer(&tst, st)) {
+            found = strdup(target.data);
+            if (fixed_st)
+                *fixed_st = tst;
+        }
+    }
+    sb_free(&target);
+    return found;
+}
+
+// Whether filepath, the fix of source, is the one source would be reported through
+int fixed_output_of(const CheckOptions *o, const char *filepath, const char *source) {
+    struct stat st;
+    if (stat(source, &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+    char *found = fixed_output_find(o, source, &st, NULL);
+    int is = found && strcmp(found, filepath) == 0;
+    free(found);
+    return is;
+}
+
+// The source filepath is reported with when it is a fix, or NULL
+char *fixed_output_source(const CheckOptions *o, const char *filepath) {
+    const char *base = get_basename(filepath);
+    size_t dir_len = base - filepath;
+    size_t len = strlen(base);
+    if (len < 4 || strcmp(base + len - 4, ".mkv") != 0)
+        return NULL;
+    char source[PATH_BUF_SIZE];
+    if (strncmp(base, "remuxed_", 8) == 0) {
+        // remuxed_<name>.mkv: the source's whole name is in it
+        snprintf(source, sizeof(source), "%.*s%.*s", (int)dir_len, filepath, (int)(len - 12), base + 8);
+        return has_supported_extension(source) && fixed_dir_has(source) && fixed_output_of(o, filepath, source) ? strdup(source) : NULL;
+    }
+    if (strncmp(base, "fixed_", 6) != 0)
+        return NULL;
+    // fixed_<stem>[.<profile>].mkv: the source's extension is gone, so look for names with that stem
+    const char *stem = base + 6;
+    size_t stems[1 + MAX_PROFILES];
+    int num_stems = 0;
+    stems[num_stems++] = len - 10;
+    for (int p = 0; o->num_profiles > 1 && p < o->num_profiles; p++) {
+        const char *name = o->profiles[p]->def->name;
+        size_t name_len = strlen(name);
+        if (len - 10 > name_len + 1 && stem[len - 11 - name_len] == '.' &&
+            strncmp(stem + len - 10 - name_len, name, name_len) == 0)
+            stems[num_stems++] = len - 11 - name_len;
+    }
+    char *found = NULL;
+    for (int i = 0; i < num_stems && !found; i++) {
+        char **sources = fixed_dir_by_stem(filepath, dir_len, stem, stems[i]);
+        for (char **c = sources; *c && !found; c++) {
+            if (fixed_output_of(o, filepath, *c))
+                found = strdup(*c);
+        }
+        free_string_list(sources);
+    }
+    return found;
+}
+
+// head, if any, is the file's prefetched start; the caller frees what the probe didn't take of it
+void check_file(ctv_context *ctx, const char *filepath, const struct stat *st, FileHead *head, int show_full_path, Summary *summary, FILE *out) {
+    if (!has_supported_extension(filepath))
+        return;
+    if (skip_fixed && st && !is_url(filepath)) {
+        char *source = fixed_output_source(&ctx->options, filepath);
+        if (source) {
+            // Reported with its source
+            free(source);
+            return;
+        }
+        struct stat fixed_st;
+        char *fixed = fixed_output_find(&ctx->options, filepath, st, &fixed_st);
+        if (fixed) {
+            check_path(ctx, fixed, &fixed_st, NULL, filepath, show_full_path, summary, out);
+            free(fixed);
+            return;
+        }
+    }
+    check_path(ctx, filepath, st, head, NULL, show_full_path, summary, out);
+}
+
+/*
+ * --serve SOCKET: a resident checker for hooks that would otherwise start
+ * the CLI for every file.  Clients connect to the Unix socket and write one
+ * path per line.  Each path is checked by the worker pool (with --cache the
+ * cache stays loaded and is saved every SERVE_FLUSH_US) and answered with
+ * its JSON Lines report, in the order the checks finish; the "path" member
+ * tells which request a line answers.  The main thread only accepts and
+ * reads requests, so a full queue holds back the clients, not the workers.
+ * A connection is closed once its client has stopped writing and every
+ * answer is sent.  --client is the matching client.
+ */
+#define SERVE_FLUSH_US (60 * 1000000LL)
+#define SERVE_MAX_CLIENTS 1024
+
+struct ServeClient {
+    int fd;
+    int refs;               // the reader, plus one per request being checked
+    int failed;             // gone away: answers are dropped
+    pthread_mutex_t lock;
+    char line[PATH_BUF_SIZE];
+    size_t line_len;
+    int overlong;           // discarding the rest of a line too long to be a path
+};
+
+volatile sig_atomic_t serve_stop = 0;
+
+void serve_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+void serve_reply(ServeClient *c, const char *data, size_t len) {
+    pthread_mutex_lock(&c->lock);
+    while (len > 0 && !c->failed) {
+        ssize_t n = write(c->fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            c->failed = 1;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void serve_release(ServeClient *c) {
+    pthread_mutex_lock(&c->lock);
+    int last = --c->refs == 0;
+    pthread_mutex_unlock(&c->lock);
+    if (last) {
+        close(c->fd);
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+    }
+}
+
+// Answers a request the main thread can turn down without probing
+void serve_reply_error(ServeClient *c, const char *path, const char *step, int errnum) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (!out)
+        return;
+    print_json_error(out, path, step, errnum);
+    fclose(out);
+    serve_reply(c, buf, len);
+    free(buf);
+}
+
+void serve_request(ServeClient *c, const char *path) {
+    struct stat st = {0};
+    if (!is_url(path)) {
+        if (stat(path, &st) == -1) {
+            serve_reply_error(c, path, "could not stat", AVERROR(errno));
+            return;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            serve_reply_error(c, path, "not a regular file", AVERROR(S_ISDIR(st.st_mode) ? EISDIR : EINVAL));
+            return;
+        }
+    }
+    // check_file() would skip it without a word
+    if (!has_supported_extension(path)) {
+        serve_reply_error(c, path, "unsupported extension", AVERROR(EINVAL));
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    c->refs++;
+    pthread_mutex_unlock(&c->lock);
+    FileJob *job = calloc(1, sizeof(FileJob));
+    job->path = strdup(path);
+    job->st = st;
+    job->client = c;
+    queue_push(work_queue, job);
+}
+
+// Reads what the client sent and queues its complete lines; returns -1 at the end of its requests
+int serve_read(ServeClient *c) {
+    char buf[8192];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if (n <= 0)
+        return -1;
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] != '\n') {
+            if (c->line_len + 1 < sizeof(c->line))
+                c->line[c->line_len++] = buf[i];
+            else
+                c->overlong = 1;
+            continue;
+        }
+        if (c->line_len > 0 && c->line[c->line_len - 1] == '\r')
+            c->line_len--;
+        c->line[c->line_len] = '\0';
+        if (c->overlong)
+            serve_reply_error(c, c->line, "path too long", AVERROR(ENAMETOOLONG));
+        else if (c->line_len > 0)
+            serve_request(c, c->line);
+        c->line_len = 0;
+        c->overlong = 0;
+    }
+    return 0;
+}
+
+int serve_listen(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // Replace a socket left behind by a server that is gone, but not a live one
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A server is already listening on '%s'\n", socket_path);
+        close(fd);
+        return -1;
+    }
+    if (errno == ECONNREFUSED)
+        unlink(socket_path);
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Could not listen on '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Accepts and reads clients until SIGINT/SIGTERM; the work queue must have workers
+int serve_run(ctv_context *ctx, const char *socket_path) {
+    int listen_fd = serve_listen(socket_path);
+    if (listen_fd < 0)
+        return -1;
+    struct sigaction sa = { .sa_handler = serve_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // A client that goes away is noticed by write(), not by a signal
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Listening on '%s'\n", socket_path);
+
+    ServeClient *clients[SERVE_MAX_CLIENTS];
+    struct pollfd fds[SERVE_MAX_CLIENTS + 1];
+    int num_clients = 0;
+    int64_t last_flush = av_gettime_relative();
+    while (!serve_stop) {
+        fds[0].fd = listen_fd;
+        fds[0].events = num_clients < SERVE_MAX_CLIENTS ? POLLIN : 0;
+        for (int i = 0; i < num_clients; i++) {
+            fds[i + 1].fd = clients[i]->fd;
+            fds[i + 1].events = POLLIN;
+        }
+        int64_t wait_us = ctx->cache ? SERVE_FLUSH_US - (av_gettime_relative() - last_flush) : -1;
+        int n = poll(fds, num_clients + 1, wait_us < 0 ? -1 : (int)(wait_us / 1000) + 1);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (ctx->cache && av_gettime_relative() - last_flush >= SERVE_FLUSH_US) {
+            cache_flush(ctx->cache);
+            last_flush = av_gettime_relative();
+        }
+        if (n <= 0)
+            continue;
+
+        // Back to front, so dropping a client doesn't skip the next one
+        for (int i = num_clients - 1; i >= 0; i--) {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (serve_read(clients[i]) < 0) {
+                // Done sending requests; the connection closes after the last answer
+                serve_release(clients[i]);
+                clients[i] = clients[--num_clients];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                ServeClient *c = calloc(1, sizeof(ServeClient));
+                c->fd = fd;
+                c->refs = 1;
+                pthread_mutex_init(&c->lock, NULL);
+                clients[num_clients++] = c;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_clients; i++)
+        serve_release(clients[i]);
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    int num_paths;
+    char **paths;
+} ClientRequests;
+
+// Sends the requests while the main thread reads the answers, so neither side can fill up and stall
+void *client_send(void *arg) {
+    ClientRequests *req = arg;
+    char *line = NULL;
+    size_t cap = 0;
+    for (int i = 0; req->num_paths == 0 || i < req->num_paths; i++) {
+        const char *path;
+        if (req->num_paths > 0) {
+            path = req->paths[i];
+        } else {
+            ssize_t len = getline(&line, &cap, stdin);
+            if (len < 0)
+                break;
+            if (len > 0 && line[len - 1] == '\n')
+                line[--len] = '\0';
+            if (len == 0)
+                continue;
+            path = line;
+        }
+        if (strchr(path, '\n')) {
+            fprintf(stderr, "Skipping a path with a newline: %s\n", path);
+            continue;
+        }
+        // The server runs in a directory of its own
+        char resolved[PATH_MAX];
+        if (!is_url(path) && path[0] != '/' && realpath(path, resolved))
+            path = resolved;
+        size_t len = strlen(path);
+        char *request = malloc(len + 2);
+        memcpy(request, path, len);
+        request[len] = '\n';
+        int failed = 0;
+        for (size_t off = 0; off < len + 1 && !failed; ) {
+            ssize_t n = write(req->fd, request + off, len + 1 - off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                failed = 1;
+            else
+                off += n;
+        }
+        free(request);
+        if (failed)
+            break;
+    }
+    free(line);
+    shutdown(req->fd, SHUT_WR);
+    return NULL;
+}
+
+// --client SOCKET [path...]: checks the paths (or the lines of stdin) on a --serve server
+int serve_client(const char *socket_path, int num_paths, char **paths) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not connect to '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ClientRequests req = { .fd = fd, .num_paths = num_paths, .paths = paths };
+    pthread_t sender;
+    int err = pthread_create(&sender, NULL, client_send, &req);
+    if (err != 0) {
+        fprintf(stderr, "Could not start thread: %s\n", strerror(err));
+        close(fd);
+        return 1;
+    }
+    char buf[16384];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "Could not read from '%s': %s\n", socket_path, strerror(errno));
+            break;
+        }
+        fwrite(buf, 1, n, stdout);
+        fflush(stdout);
+    }
+    pthread_join(sender, NULL);
+    close(fd);
+    return n == 0 ? 0 : 1;
+}
+
+void run_job(FileJob *job, Worker *w, FILE *out) {
+    // A URL sent to --serve has no stat() to key the cache with
+    const struct stat *st = job->client && is_url(job->path) ? NULL : &job->st;
+    if (job->decode)
+        decode_check_file(&w->ctx->options, job->path, w->show_full_path, &w->summary, out);
+    else if (job->probed)
+        deep_check_file(w->ctx, job->path, st, w->show_full_path, job->probed, &w->summary, out);
+    else
+        check_file(w->ctx, job->path, st, job->head, w->show_full_path, &w->summary, out);
+}
+
+void *worker_main(void *arg) {
+    Worker *w = arg;
+    FileJob *job;
+    while ((job = queue_pop(w->queue)) != NULL) {
+        probe_latency = -1;
+        // Buffer the whole report so output of concurrent files never interleaves
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&buf, &len);
+        if (out) {
+            run_job(job, w, out);
+            fclose(out);
+            if (job->client) {
+                serve_reply(job->client, buf, len);
+            } else {
+                pthread_mutex_lock(&output_lock);
+                fwrite(buf, 1, len, stdout);
+                fflush(stdout);
+                pthread_mutex_unlock(&output_lock);
+            }
+            free(buf);
+        } else if (job->client) {
+            serve_reply_error(job->client, job->path, "out of memory", AVERROR(ENOMEM));
+        } else {
+            pthread_mutex_lock(&output_lock);
+            run_job(job, w, stdout);
+            pthread_mutex_unlock(&output_lock);
+        }
+        queue_done(w->queue, job, probe_latency);
+        if (job->client)
+            serve_release(job->client);
+        file_head_free(job->head);
+        free(job->probed);
+        free(job->path);
+        free(job);
+    }
+    return NULL;
+}
+
+void summary_merge(Summary *dst, const Summary *src) {
+    dst->total += src->total;
+    dst->ok += src->ok;
+    dst->not_supported += src->not_supported;
+    dst->errors += src->errors;
+    dst->remuxed += src->remuxed;
+    dst->remux_failed += src->remux_failed;
+    dst->duplicates += src->duplicates;
+    dst->resumed += src->resumed;
+    dst->sampled += src->sampled;
+    dst->sample_errors += src->sample_errors;
+    dst->resolved += src->resolved;
+    for (int p = 0; p < MAX_PROFILES; p++) {
+        dst->profile_ok[p] += src->profile_ok[p];
+        dst->profile_not_supported[p] += src->profile_not_supported[p];
+    }
+}
+
+// Probes the file inline, or hands it to the worker pool when --jobs is active; takes ownership of head
+void dispatch_job(ctv_context *ctx, const char *path, const struct stat *st, FileHead *head, int show_full_path, Summary *summary) {
+    int64_t t0 = stats_mode ? av_gettime_relative() : 0;
+    if (work_queue) {
+        FileJob *job = calloc(1, sizeof(FileJob));
+        job->path = strdup(path);
+        job->st = *st;
+        job->probed = NULL;
+        job->head = head;
+        queue_push(work_queue, job);
+    } else {
+        check_file(ctx, path, st, head, show_full_path, summary, stdout);
+        file_head_free(head);
+        if (output_format == OUTPUT_JSONL)
+            fflush(stdout);
+    }
+    if (stats_mode)
+        scan_stats.dispatch_us += av_gettime_relative() - t0;
+}
+
+#ifdef HAVE_IO_URING
+// --uring: files of the scan waiting for their heads, in the order they were found
+struct {
+    char *paths[URING_BATCH];
+    struct stat st[URING_BATCH];
+    int want[URING_BATCH];  // 0 for files the cache or the journal will answer
+    int count;
+    ctv_context *ctx;
+    int show_full_path;
+    Summary *summary;
+} prefetch_batch;
+
+// Opens the batch's files and reads their heads with two io_uring submissions, then dispatches them
+void dispatch_flush(void) {
+    int n = prefetch_batch.count;
+    FileHead *heads[URING_BATCH] = {0};
+    int res[URING_BATCH];
+    int queued = 0;
+    for (int i = 0; i < n && walk_ring; i++) {
+        if (!prefetch_batch.want[i])
+            continue;
+        struct io_uring_sqe *sqe = uring_sqe(walk_ring, i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)prefetch_batch.paths[i];
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        queued++;
+    }
+    if (queued && uring_run(walk_ring, res) == 0) {
+        // Files that failed to open are left to check_file, which reports why
+        queued = 0;
+        for (int i = 0; i < n; i++) {
+            if (!prefetch_batch.want[i] || res[i] < 0)
+                continue;
+            heads[i] = calloc(1, sizeof(FileHead));
+            heads[i]->fd = res[i];
+            heads[i]->buf = head_pool_get();
+            struct io_uring_sqe *sqe = uring_sqe(walk_ring, i);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = res[i];
+            sqe->addr = (uintptr_t)heads[i]->buf;
+            sqe->len = (unsigned)prefetch_size;
+            sqe->off = 0;
+            queued++;
+        }
+        if (queued && uring_run(walk_ring, res) == 0) {
+            for (int i = 0; i < n; i++) {
+                if (!heads[i])
+                    continue;
+                if (res[i] >= 0) {
+                    heads[i]->len = res[i];
+                } else {
+                    // Still opened: the probe reads it through the descriptor
+                    head_pool_put(heads[i]->buf);
+                    heads[i]->buf = NULL;
+                }
+            }
+            queued = 0;
+        }
+    }
+    if (queued) {
+        fprintf(stderr, "io_uring failed (%s); continuing without --uring\n", strerror(errno));
+        uring_free(walk_ring);
+        walk_ring = NULL;
+        for (int i = 0; i < n; i++) {
+            file_head_free(heads[i]);
+            heads[i] = NULL;
+        }
+    }
+
+    prefetch_batch.count = 0;
+    for (int i = 0; i < n; i++) {
+        dispatch_job(prefetch_batch.ctx, prefetch_batch.paths[i], &prefetch_batch.st[i], heads[i],
+                     prefetch_batch.show_full_path, prefetch_batch.summary);
+        free(prefetch_batch.paths[i]);
+    }
+}
+#endif
+
+void dispatch_file(ctv_context *ctx, const char *path, const struct stat *st, int show_full_path, Summary *summary) {
+#ifdef HAVE_IO_URING
+    if (walk_ring && prefetch_size > 0 && !is_url(path)) {
+        int i = prefetch_batch.count++;
+        prefetch_batch.paths[i] = strdup(path);
+        prefetch_batch.st[i] = *st;
+        prefetch_batch.want[i] = !(ctx->cache && cache_has(ctx->cache, path, st)) &&
+            !(ctx->journal && cache_has(ctx->journal->done, path, st));
+        prefetch_batch.ctx = ctx;
+        prefetch_batch.show_full_path = show_full_path;
+        prefetch_batch.summary = summary;
+        if (prefetch_batch.count == URING_BATCH)
+            dispatch_flush();
+        return;
+    }
+#endif
+    dispatch_job(ctx, path, st, NULL, show_full_path, summary);
+}
+
+/*
+ * --exclude and --exclude-from: the patterns are fnmatch() globs matched
+ * against the whole path of every directory and file.  They are sorted
+ * once, when they are added.  Plain patterns and those whose only wildcard
+ * is a trailing '*' go into a trie of path prefixes.  A leading '*'
+ * followed by plain text goes into a trie of reversed suffixes, "*text*"
+ * into a list of substrings, and only the rest is matched with fnmatch().
+ * A path is looked up in each trie with one pass over its characters,
+ * however many patterns there are.
+ */
+enum {
+    TRIE_EXACT = 1,         // a pattern ends here
+    TRIE_ANY = 2,           // a pattern ends here in '*': whatever follows matches
+};
+
+typedef struct TrieNode {
+    struct TrieNode *child;
+    struct TrieNode *next;  // sibling
+    unsigned char byte;
+    unsigned char flags;
+} TrieNode;
+
+typedef struct {
+    TrieNode prefixes;      // roots; with reversed keys for the suffixes
+    TrieNode suffixes;
+    char **substrings;
+    int num_substrings;
+    char **globs;
+    char **glob_stems;      // a glob without its trailing '*', or NULL
+    int num_globs;
+    int count;
+} ExcludeSet;
+
+void trie_insert(TrieNode *root, const char *key, size_t len, int reverse, int flags) {
+    TrieNode *node = root;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = key[reverse ? len - 1 - i : i];
+        TrieNode *child = node->child;
+        while (child && child->byte != c)
+            child = child->next;
+        if (!child) {
+            child = calloc(1, sizeof(TrieNode));
+            child->byte = c;
+            child->next = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    node->flags |= flags;
+}
+
+// Whether a key of root matches s: an exact key equal to it, or an "any" key it starts with
+// (ends with, for reversed keys); with subtree, only "any" keys count
+int trie_match(const TrieNode *root, const char *s, size_t len, int reverse, int subtree) {
+    const TrieNode *node = root;
+    for (size_t i = 0; ; i++) {
+        if (node->flags & TRIE_ANY)
+            return 1;
+        if (i == len)
+            return !subtree && (node->flags & TRIE_EXACT);
+        unsigned char c = s[reverse ? len - 1 - i : i];
+        const TrieNode *child = node->child;
+        while (child && child->byte != c)
+            child = child->next;
+        if (!child)
+            return 0;
+        node = child;
+    }
+}
+
+void trie_free(TrieNode *node) {
+    while (node) {
+        TrieNode *next = node->next;
+        trie_free(node->child);
+        free(node);
+        node = next;
+    }
+}
+
+void exclude_add(ExcludeSet *set, const char *pattern) {
+    size_t len = strlen(pattern);
+    int lead = len > 0 && pattern[0] == '*';
+    int trail = len > 1 && pattern[len - 1] == '*';
+    const char *text = pattern + lead;
+    size_t text_len = len - lead - trail;
+    int plain = 1;
+    for (size_t i = 0; i < text_len && plain; i++)
+        plain = !strchr("*?[\\", text[i]);
+    set->count++;
+    if (plain && !lead) {
+        trie_insert(&set->prefixes, text, text_len, 0, trail ? TRIE_ANY : TRIE_EXACT);
+    } else if (plain && !trail) {
+        trie_insert(&set->suffixes, text, text_len, 1, TRIE_ANY);
+    } else if (plain) {
+        set->substrings = realloc(set->substrings, (set->num_substrings + 1) * sizeof(char *));
+        set->substrings[set->num_substrings++] = strndup(text, text_len);
+    } else {
+        set->globs = realloc(set->globs, (set->num_globs + 1) * sizeof(char *));
+        set->glob_stems = realloc(set->glob_stems, (set->num_globs + 1) * sizeof(char *));
+        set->globs[set->num_globs] = strdup(pattern);
+        // A '*' that isn't escaped matches everything below a directory its stem matches
+        int any = len > 1 && pattern[len - 1] == '*' && pattern[len - 2] != '\\';
+        set->glob_stems[set->num_globs++] = any ? strndup(pattern, len - 1) : NULL;
+    }
+}
+
+// Adds the patterns in filename, one per line; empty lines and lines starting with '#' are skipped
+int exclude_load(ExcludeSet *set, const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len > 0 && line[0] != '#')
+            exclude_add(set, line);
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+void exclude_free(ExcludeSet *set) {
+    trie_free(set->prefixes.child);
+    trie_free(set->suffixes.child);
+    for (int i = 0; i < set->num_substrings; i++)
+        free(set->substrings[i]);
+    for (int i = 0; i < set->num_globs; i++) {
+        free(set->globs[i]);
+        free(set->glob_stems[i]);
+    }
+    free(set->substrings);
+    free(set->globs);
+    free(set->glob_stems);
+    memset(set, 0, sizeof(*set));
+}
+
+// Whether a pattern matches path itself
+int exclude_match(const ExcludeSet *set, const char *path) {
+    if (!set || !set->count)
+        return 0;
+    size_t len = strlen(path);
+    if (trie_match(&set->prefixes, path, len, 0, 0) || trie_match(&set->suffixes, path, len, 1, 0))
+        return 1;
+    for (int i = 0; i < set->num_substrings; i++) {
+        if (strstr(path, set->substrings[i]))
+            return 1;
+    }
+    for (int i = 0; i < set->num_globs; i++) {
+        if (fnmatch(set->globs[i], path, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Whether a pattern matches everything below the directory dir, so the walk needn't open it
+int exclude_subtree(const ExcludeSet *set, const char *dir) {
+    if (!set || !set->count)
+        return 0;
+    char below[PATH_BUF_SIZE + 1];
+    int len = snprintf(below, sizeof(below), "%s/", dir);
+    if (len >= (int)sizeof(below))
+        return 0;
+    if (trie_match(&set->prefixes, below, len, 0, 1))
+        return 1;
+    for (int i = 0; i < set->num_substrings; i++) {
+        if (strstr(below, set->substrings[i]))
+            return 1;
+    }
+    for (int i = 0; i < set->num_globs; i++) {
+        if (set->glob_stems[i] && fnmatch(set->glob_stems[i], below, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// A directory the walk leaves out: excluded itself, or everything in it is
+int exclude_dir(const ExcludeSet *set, const char *dir) {
+    return exclude_match(set, dir) || exclude_subtree(set, dir);
+}
+
+// Directories still to be visited; replaces recursion so deep trees can't exhaust the stack
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} DirStack;
+
+void dir_stack_push(DirStack *stack, char *path) {
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+        stack->paths = realloc(stack->paths, stack->capacity * sizeof(char *));
+    }
+    stack->paths[stack->count++] = path;
+}
+
+/*
+ * --order: instead of dispatching files in readdir order, the walk collects
+ * them in a binary heap and dispatches them best first once the tree has
+ * been read.  The heap keeps the worst entry on top, so with --limit N only
+ * the N best are ever held: each further file either replaces the top or is
+ * dropped right away.
+ */
+enum { ORDER_WALK, ORDER_NEWEST, ORDER_LARGEST, ORDER_PATH };
+int scan_order = ORDER_WALK;
+long scan_limit = 0;        // 0: no limit
+time_t scan_since = 0;      // 0: no --since
+long scan_dispatched = 0;
+
+typedef struct {
+    FileJob *files;
+    size_t count;
+    size_t capacity;
+} FileHeap;
+
+// Whether a should be checked before b
+int file_before(const FileJob *a, const FileJob *b) {
+    switch (scan_order) {
+    case ORDER_NEWEST:
+        if (a->st.st_mtime != b->st.st_mtime)
+            return a->st.st_mtime > b->st.st_mtime;
+        if (stat_mtime_nsec(&a->st) != stat_mtime_nsec(&b->st))
+            return stat_mtime_nsec(&a->st) > stat_mtime_nsec(&b->st);
+        break;
+    case ORDER_LARGEST:
+        if (a->st.st_size != b->st.st_size)
+            return a->st.st_size > b->st.st_size;
+        break;
+    }
+    return strcmp(a->path, b->path) < 0;
+}
+
+void heap_sift_up(FileHeap *h, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!file_before(&h->files[parent], &h->files[i]))
+            break;
+        FileJob tmp = h->files[i];
+        h->files[i] = h->files[parent];
+        h->files[parent] = tmp;
+        i = parent;
+    }
+}
+
+void heap_sift_down(FileHeap *h, size_t i) {
+    for (;;) {
+        size_t worst = i, l = 2 * i + 1, r = l + 1;
+        if (l < h->count && file_before(&h->files[worst], &h->files[l])) worst = l;
+        if (r < h->count && file_before(&h->files[worst], &h->files[r])) worst = r;
+        if (worst == i)
+            break;
+        FileJob tmp = h->files[i];
+        h->files[i] = h->files[worst];
+        h->files[worst] = tmp;
+        i = worst;
+    }
+}
+
+void heap_push(FileHeap *h, const char *path, const struct stat *st) {
+    FileJob job = { .path = (char *)path, .st = *st };
+    if (scan_limit && h->count == (size_t)scan_limit) {
+        // Full: only something better than the current worst gets in
+        if (!file_before(&job, &h->files[0]))
+            return;
+        free(h->files[0].path);
+        h->files[0] = job;
+        h->files[0].path = strdup(path);
+        heap_sift_down(h, 0);
+        return;
+    }
+    if (h->count == h->capacity) {
+        h->capacity = h->capacity ? h->capacity * 2 : 256;
+        h->files = realloc(h->files, h->capacity * sizeof(FileJob));
+    }
+    h->files[h->count] = job;
+    h->files[h->count].path = strdup(path);
+    heap_sift_up(h, h->count++);
+}
+
+// Dispatches the collected files best first and empties the heap
+void heap_dispatch(ctv_context *ctx, FileHeap *h, int show_full_path, Summary *summary) {
+    // Popping the worst each time fills files[] from the back, leaving it sorted best first
+    size_t n = h->count;
+    while (h->count > 1) {
+        FileJob worst = h->files[0];
+        h->files[0] = h->files[--h->count];
+        heap_sift_down(h, 0);
+        h->files[h->count] = worst;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!scan_interrupted)
+            dispatch_file(ctx, h->files[i].path, &h->files[i].st, show_full_path, summary);
+        free(h->files[i].path);
+    }
+    free(h->files);
+    memset(h, 0, sizeof(*h));
+}
+
+// --since: "YYYY-MM-DD[ HH:MM[:SS]]" (or with a T) in local time, or an age like "7d", "12h" or "30m"
+int parse_since(const char *str, time_t *out) {
+    char *end;
+    errno = 0;
+    long age = strtol(str, &end, 10);
+    if (!errno && end != str && age >= 0 && end[0] && !end[1]) {
+        long unit = end[0] == 'd' ? 86400 : end[0] == 'h' ? 3600 : end[0] == 'm' ? 60 : 0;
+        if (unit) {
+            *out = time(NULL) - age * unit;
+            return 0;
+        }
+    }
+    struct tm tm = {0};
+    char sep = 0, extra = 0;
+    int n = sscanf(str, "%d-%d-%d%c%d:%d:%d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+        &sep, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &extra);
+    if (!(n == 3 || ((n == 6 || n == 7) && (sep == ' ' || sep == 'T'))))
+        return -1;
+    if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31)
+        return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    if (t == (time_t)-1)
+        return -1;
+    *out = t;
+    return 0;
+}
+
+// Whether the walk is done: interrupted with a --journal kept, or --limit files dispatched (unordered walks only)
+static inline int scan_should_stop(void) {
+    return scan_interrupted || (scan_limit && scan_order == ORDER_WALK && scan_dispatched >= scan_limit);
+}
+
+/*
+ * --shard i/N: every node of a cluster scans the whole tree but checks only
+ * the files whose hash modulo N is i.  The hash is of the path below the
+ * scan root, so nodes that mount the library in different places still
+ * split it the same way, and the filter runs before --order and --limit.
+ */
+int shard_index = 0;
+int shard_count = 0;        // 0: no --shard
+const char *shard_root = NULL;
+
+int shard_skip(const char *path) {
+    if (!shard_count)
+        return 0;
+    size_t len = strlen(shard_root);
+    if (strncmp(path, shard_root, len) == 0)
+        path += len;
+    while (*path == '/')
+        path++;
+    return hash_string(path) % shard_count != (uint64_t)shard_index;
+}
+
+// A file the walk found: filtered by --shard and --since, then collected for --order or dispatched
+void scan_found_file(ctv_context *ctx, FileHeap *heap, const char *path, const struct stat *st, int show_full_path, Summary *summary) {
+    if (shard_skip(path))
+        return;
+    if (scan_since && st->st_mtime < scan_since)
+        return;
+    if (scan_order != ORDER_WALK) {
+        heap_push(heap, path, st);
+    } else {
+        dispatch_file(ctx, path, st, show_full_path, summary);
+        scan_dispatched++;
+    }
+}
+
+#ifdef __linux__
+/*
+ * --watch: after the initial scan, follow the tree with inotify and check
+ * only files that are written (IN_CLOSE_WRITE) or moved in (IN_MOVED_TO).
+ * scan_dir() registers every directory it visits, so new directories are
+ * watched by scanning them.  fanotify would need CAP_SYS_ADMIN, and inotify
+ * covers what a media library needs.
+ */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+#define WATCH_CACHE_FLUSH_US (60 * 1000000LL)
+
+typedef struct {
+    int fd;
+    char **paths;       // indexed by watch descriptor
+    int capacity;
+    int warned_limit;
+} Watcher;
+
+Watcher *watcher = NULL;
+volatile sig_atomic_t watch_stop = 0;
+
+void watch_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+void watch_add(Watcher *w, const char *dirpath) {
+    int wd = inotify_add_watch(w->fd, dirpath, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        if (errno == ENOSPC && !w->warned_limit) {
+            fprintf(stderr, "Out of inotify watches; raise fs.inotify.max_user_watches to watch the whole tree.\n");
+            w->warned_limit = 1;
+        } else if (errno != ENOSPC) {
+            fprintf(stderr, "Could not watch directory: %s (%s)\n", dirpath, strerror(errno));
+        }
+        return;
+    }
+    if (wd >= w->capacity) {
+        int capacity = w->capacity ? w->capacity : 64;
+        while (capacity <= wd) capacity *= 2;
+        w->paths = realloc(w->paths, capacity * sizeof(char *));
+        memset(w->paths + w->capacity, 0, (capacity - w->capacity) * sizeof(char *));
+        w->capacity = capacity;
+    }
+    // The same directory reached twice (e.g. through a rename) keeps its descriptor
+    free(w->paths[wd]);
+    w->paths[wd] = strdup(dirpath);
+}
+
+void watch_remove(Watcher *w, int wd) {
+    if (wd >= 0 && wd < w->capacity) {
+        free(w->paths[wd]);
+        w->paths[wd] = NULL;
+    }
+}
+#endif
+
+// Called for every candidate file of the walk; returns nonzero to end it
+typedef int (*WalkFound)(void *opaque, const char *path, const struct stat *st);
+
+#define WALK_BATCH 64
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    int is_dir;             // known from d_type; then there is no stat
+    int stat_ret;
+    struct stat st;
+} WalkEntry;
+
+void walk_stat(int dfd, WalkEntry *batch, int n) {
+#ifdef HAVE_IO_URING
+    if (walk_ring) {
+        struct statx stx[WALK_BATCH];
+        int res[WALK_BATCH];
+        for (int i = 0; i < n; i++) {
+            if (batch[i].is_dir)
+                continue;
+            struct io_uring_sqe *sqe = uring_sqe(walk_ring, i);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dfd;
+            sqe->addr = (uintptr_t)batch[i].name;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uintptr_t)&stx[i];
+        }
+        if (uring_run(walk_ring, res) == 0) {
+            for (int i = 0; i < n; i++) {
+                if (batch[i].is_dir)
+                    continue;
+                batch[i].stat_ret = res[i] < 0 ? -1 : 0;
+                if (res[i] == 0)
+                    stat_from_statx(&batch[i].st, &stx[i]);
+                else if (res[i] == -EINVAL || res[i] == -EOPNOTSUPP)
+                    // A kernel without IORING_OP_STATX
+                    batch[i].stat_ret = fstatat(dfd, batch[i].name, &batch[i].st, 0);
+            }
+            return;
+        }
+        fprintf(stderr, "io_uring failed (%s); continuing without --uring\n", strerror(errno));
+        uring_free(walk_ring);
+        walk_ring = NULL;
+    }
+#endif
+    for (int i = 0; i < n; i++)
+        // Follows symlinks, like the stat() of the full path did
+        if (!batch[i].is_dir)
+            batch[i].stat_ret = fstatat(dfd, batch[i].name, &batch[i].st, 0);
+}
+
+/*
+ * Walks the tree below dirpath and hands every candidate media file to found().
+ * Entries are classified by dirent.d_type where the filesystem provides it,
+ * so directories and files with unsupported extensions cost no syscall at
+ * all.  Candidates (and entries of unknown type or symlinks) are stat()ed
+ * relative to the open directory, which avoids resolving the full path
+ * again for every entry: WALK_BATCH of them at a time, with one io_uring
+ * submission under --uring and with fstatat() otherwise.
+ * Returns 1 if found() ended the walk.
+ */
+int walk_tree(const char *dirpath, const ExcludeSet *excludes, WalkFound found, void *opaque) {
+    DirStack stack = {0};
+    DirStack subdirs = {0};
+    char path[PATH_BUF_SIZE];
+    WalkEntry *batch = malloc(WALK_BATCH * sizeof(WalkEntry));
+    int stop = 0;
+
+    dir_stack_push(&stack, strdup(dirpath));
+    while (stack.count > 0 && !stop && !scan_interrupted) {
+        char *dir = stack.paths[--stack.count];
+        DIR *dp = opendir(dir);
+        if (!dp) {
+            fprintf(stderr, "Could not open directory: %s (%s)\n", dir, strerror(errno));
+            free(dir);
+            continue;
+        }
+#ifdef __linux__
+        if (watcher)
+            watch_add(watcher, dir);
+#endif
+        int dfd = dirfd(dp);
+        size_t dirlen = strlen(dir);
+        memcpy(path, dir, dirlen);
+        path[dirlen] = '/';
+
+        // Entries are read WALK_BATCH at a time so --uring can stat them with one system call
+        struct dirent *entry = NULL;
+        do {
+            int n = 0;
+            while (n < WALK_BATCH && !stop && !scan_interrupted && (entry = readdir(dp)) != NULL) {
+                const char *name = entry->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                    continue;
+                size_t namelen = strlen(name);
+                if (dirlen + 1 + namelen >= sizeof(path)) {
+                    fprintf(stderr, "Path too long, skipping: %s/%s\n", dir, name);
+                    continue;
+                }
 
-void quiet_ffmpeg_log(void *ptr, int level, const char *fmt, va_list vl) {
-    (void)ptr; (void)level; (void)fmt; (void)vl;
+                int is_dir = 0;
+                int known_type = 0;
+#ifdef DT_DIR
+                if (entry->d_type == DT_DIR) {
+                    is_dir = 1;
+                    known_type = 1;
+                } else if (entry->d_type == DT_REG) {
+                    known_type = 1;
+                } else if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+                    continue; // fifo, socket, device
+                }
+#endif
+                if (known_type && !is_dir) {
+                    if (!has_supported_extension(name))
+                        continue;
+                }
+                // Before the stat: an excluded entry costs nothing more, file or directory
+                memcpy(path + dirlen + 1, name, namelen + 1);
+                if (exclude_match(excludes, path))
+                    continue;
+                memcpy(batch[n].name, name, namelen + 1);
+                batch[n].is_dir = is_dir;
+                n++;
+            }
+            walk_stat(dfd, batch, n);
+
+            for (int i = 0; i < n && !stop && !scan_interrupted; i++) {
+                WalkEntry *e = &batch[i];
+                memcpy(path + dirlen + 1, e->name, strlen(e->name) + 1);
+                int is_dir = e->is_dir;
+                if (!is_dir) {
+                    if (e->stat_ret == -1) continue;
+                    is_dir = S_ISDIR(e->st.st_mode);
+                    if (!is_dir && (!S_ISREG(e->st.st_mode) || !has_supported_extension(e->name)))
+                        continue;
+                }
+
+                if (is_dir) {
+                    if (exclude_subtree(excludes, path)) continue;
+                    dir_stack_push(&subdirs, strdup(path));
+                } else {
+                    stop = found(opaque, path, &e->st);
+                }
+            }
+        } while (entry && !stop && !scan_interrupted);
+        closedir(dp);
+        free(dir);
+
+        // Push in reverse so subdirectories are visited in readdir order
+        while (subdirs.count > 0)
+            dir_stack_push(&stack, subdirs.paths[--subdirs.count]);
+    }
+    // Left over when the walk was ended early
+    while (stack.count > 0)
+        free(stack.paths[--stack.count]);
+    while (subdirs.count > 0)
+        free(subdirs.paths[--subdirs.count]);
+    free(stack.paths);
+    free(subdirs.paths);
+    free(batch);
+    return stop;
 }
 
-int is_video_codec_supported(AVCodecParameters *par) {
-    enum AVCodecID id = par->codec_id;
-
-    return id == AV_CODEC_ID_H264 ||
-           id == AV_CODEC_ID_HEVC ||
-           id == AV_CODEC_ID_MPEG2VIDEO ||
-           id == AV_CODEC_ID_VP9 ||
-           id == AV_CODEC_ID_AV1 ||
-           id == AV_CODEC_ID_MJPEG ||
-           id == AV_CODEC_ID_PNG ||
-           (id == AV_CODEC_ID_MPEG4 &&
-            par->codec_tag != MKTAG('X','V','I','D') &&
-            par->codec_tag != MKTAG('x','v','i','d') &&
-            par->codec_tag != MKTAG('D','I','V','X') &&
-            par->codec_tag != MKTAG('d','i','v','x') &&
-            par->codec_tag != MKTAG('D','X','5','0') &&
-            par->codec_tag != MKTAG('M','P','4','V') &&
-            par->codec_tag != MKTAG('m','p','4','v') &&
-            par->codec_tag != MKTAG('F','M','P','4') &&
-            par->codec_tag != MKTAG('f','m','p','4') &&
-            !(par->profile == FF_PROFILE_MPEG4_ADVANCED_SIMPLE ||
-              par->profile == FF_PROFILE_MPEG4_SIMPLE_STUDIO)
-           );
-}
-
-int is_audio_codec_supported(enum AVCodecID id) {
-    return id == AV_CODEC_ID_AAC ||
-           id == AV_CODEC_ID_AC3 ||
-           id == AV_CODEC_ID_EAC3 ||
-           id == AV_CODEC_ID_MP3 ||
-           id == AV_CODEC_ID_PCM_S16LE ||
-           id == AV_CODEC_ID_FLAC ||
-           id == AV_CODEC_ID_VORBIS ||
-           id == AV_CODEC_ID_OPUS ||
-           id == AV_CODEC_ID_WMAV2;
-}
-
-int is_container_supported(const char *format_name) {
-    return format_name &&
-           (strstr(format_name, "matroska") || // MKV
-            strstr(format_name, "mp4") ||
-            strstr(format_name, "mov") ||
-            strstr(format_name, "mpegts") ||
-            strstr(format_name, "webm") ||
-            strstr(format_name, "avi") ||
-            strstr(format_name, "asf") ||
-            strstr(format_name, "wav") ||
-            strstr(format_name, "flac") ||
-            strstr(format_name, "mp3") ||
-            strstr(format_name, "ogg") ||
-            strstr(format_name, "wmv"));
-}
-
-int is_subtitle_codec_supported(enum AVCodecID id) {
-    return id == AV_CODEC_ID_SUBRIP ||   // .srt
-           id == AV_CODEC_ID_ASS ||      // .ass
-           id == AV_CODEC_ID_SSA ||      // .ssa
-           id == AV_CODEC_ID_WEBVTT ||   // .vtt
-           id == AV_CODEC_ID_MOV_TEXT || // .movtext
-           id == AV_CODEC_ID_MICRODVD || // .sub
-           id == AV_CODEC_ID_TEXT;
+typedef struct {
+    FileHeap heap;
+    ctv_context *ctx;
+    int show_full_path;
+    Summary *summary;
+} ScanState;
+
+int scan_found(void *opaque, const char *path, const struct stat *st) {
+    ScanState *state = opaque;
+    scan_found_file(state->ctx, &state->heap, path, st, state->show_full_path, state->summary);
+    return scan_should_stop();
 }
 
-int is_text_subtitle(enum AVCodecID id) {
-    return id == AV_CODEC_ID_SUBRIP ||
-           id == AV_CODEC_ID_ASS ||
-           id == AV_CODEC_ID_SSA ||
-           id == AV_CODEC_ID_WEBVTT ||
-           id == AV_CODEC_ID_MOV_TEXT ||
-           id == AV_CODEC_ID_MICRODVD ||
-           id == AV_CODEC_ID_TEXT;
+void scan_dir(ctv_context *ctx, const char *dirpath, const ExcludeSet *excludes, int show_full_path, Summary *summary) {
+    ScanState state = { .ctx = ctx, .show_full_path = show_full_path, .summary = summary };
+    walk_tree(dirpath, excludes, scan_found, &state);
+    if (state.heap.count > 0)
+        heap_dispatch(ctx, &state.heap, show_full_path, summary);
+#ifdef HAVE_IO_URING
+    if (prefetch_batch.count > 0)
+        dispatch_flush();
+#endif
 }
 
-int is_bitmap_subtitle(enum AVCodecID id) {
-    return id == AV_CODEC_ID_HDMV_PGS_SUBTITLE ||
-           id == AV_CODEC_ID_DVD_SUBTITLE;
+/*
+ * s3://bucket/prefix inputs.  The bucket is listed with ListObjectsV2 on
+ * the S3 endpoint, path style and signed when credentials are set (see
+ * s3_sign_request), and every object with a supported extension is checked
+ * through its URL on the same endpoint.  Size and LastModified from the
+ * listing stand in for the stat() of a local file, so --cache, --since,
+ * --order and --limit work the same; --exclude patterns see the objects'
+ * "directories" as s3://bucket/dir.
+ */
+
+// Percent-encodes s; RFC 3986 unreserved characters stay, and '/' when keep_slash
+void sb_append_url_encoded(StrBuf *sb, const char *s, int keep_slash) {
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keep_slash && c == '/'))
+            sb_append_len(sb, s, 1);
+        else
+            sb_appendf(sb, "%%%02X", c);
+    }
 }
 
-int has_supported_extension(const char *filename) {
-    static const char *exts[] = {
-        ".mkv", ".mp4", ".mov", ".webm", ".avi"
+// Text of the first <tag> element in [p, end) with entities decoded, or NULL; the caller frees it
+char *xml_element(const char *p, const char *end, const char *tag) {
+    static const struct { const char *name; char c; } entities[] = {
+        { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' },
     };
-    const char *dot = strrchr(filename, '.');
-    if (!dot) return 0;
-    for (size_t i = 0; i < sizeof(exts)/sizeof(exts[0]); ++i) {
-        if (strcasecmp(dot, exts[i]) == 0)
-            return 1;
+    char open[64], close[64];
+    snprintf(open, sizeof(open), "<%s>", tag);
+    snprintf(close, sizeof(close), "</%s>", tag);
+    const char *s = strstr(p, open);
+    if (!s || s >= end)
+        return NULL;
+    s += strlen(open);
+    const char *e = strstr(s, close);
+    if (!e || e > end)
+        return NULL;
+
+    char *text = malloc(e - s + 1);
+    char *o = text;
+    while (s < e) {
+        size_t i = 0;
+        if (*s == '&') {
+            for (; i < sizeof(entities) / sizeof(entities[0]); i++) {
+                size_t len = strlen(entities[i].name);
+                if ((size_t)(e - s) >= len && strncmp(s, entities[i].name, len) == 0) {
+                    *o++ = entities[i].c;
+                    s += len;
+                    break;
+                }
+            }
+            if (i == sizeof(entities) / sizeof(entities[0]) && s[1] == '#') {
+                // Character references: S3 uses them for control characters only
+                char *ref_end;
+                long c = strtol(s + 2 + (s[2] == 'x'), &ref_end, s[2] == 'x' ? 16 : 10);
+                if (ref_end < e && *ref_end == ';' && c > 0 && c < 128) {
+                    *o++ = (char)c;
+                    s = ref_end + 1;
+                    continue;
+                }
+            }
+            if (i < sizeof(entities) / sizeof(entities[0]))
+                continue;
+        }
+        *o++ = *s++;
     }
-    return 0;
+    *o = '\0';
+    return text;
 }
 
-const char *get_basename(const char *path) {
-    const char *slash = strrchr(path, '/');
-    return slash ? slash + 1 : path;
+// LastModified, e.g. 2024-05-01T12:34:56.000Z
+time_t parse_iso8601(const char *str) {
+    struct tm tm = {0};
+    if (sscanf(str, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
 }
 
-void print_ffmpeg_error(const char *prefix, int errnum) {
-    char errbuf[256];
-    av_strerror(errnum, errbuf, sizeof(errbuf));
-    printf("%s: " COLOR_YELLOW "error: %s" COLOR_RESET "\n", prefix, errbuf);
+int s3_excluded(const char *bucket, const char *key, const ExcludeSet *excludes) {
+    if (!excludes->count)
+        return 0;
+    char path[PATH_BUF_SIZE];
+    int len = snprintf(path, sizeof(path), "s3://%s/", bucket);
+    for (const char *slash = strchr(key, '/'); slash; slash = strchr(slash + 1, '/')) {
+        snprintf(path + len, sizeof(path) - len, "%.*s", (int)(slash - key), key);
+        if (exclude_dir(excludes, path))
+            return 1;
+    }
+    snprintf(path + len, sizeof(path) - len, "%s", key);
+    return exclude_match(excludes, path);
 }
 
-int is_media_stream(enum AVMediaType type) {
-    return type == AVMEDIA_TYPE_VIDEO ||
-           type == AVMEDIA_TYPE_AUDIO ||
-           type == AVMEDIA_TYPE_SUBTITLE;
+// Lists s3://bucket/prefix page by page and dispatches its media objects; returns -1 when listing failed
+int scan_s3(ctv_context *ctx, const char *input, const ExcludeSet *excludes, int show_full_path, Summary *summary) {
+    const char *location = input + strlen("s3://");
+    size_t bucket_len = strcspn(location, "/");
+    char bucket[256];
+    if (bucket_len == 0 || bucket_len >= sizeof(bucket)) {
+        fprintf(stderr, "Invalid S3 location '%s' (expected s3://bucket[/prefix])\n", input);
+        return -1;
+    }
+    memcpy(bucket, location, bucket_len);
+    bucket[bucket_len] = '\0';
+    const char *prefix = location[bucket_len] ? location + bucket_len + 1 : "";
+
+    pthread_once(&s3_signer_once, s3_signer_setup);
+    const char *endpoint = s3_signer.endpoint;
+
+    char url_storage[PATH_BUF_SIZE], body_storage[16384], object_storage[PATH_BUF_SIZE];
+    StrBuf url, body, object;
+    sb_init(&url, url_storage, sizeof(url_storage));
+    sb_init(&body, body_storage, sizeof(body_storage));
+    sb_init(&object, object_storage, sizeof(object_storage));
+    FileHeap heap = {0};
+    char *token = NULL;
+    int ret = 0;
+
+    while (!scan_should_stop()) {
+        // Parameters sorted by name, as the signature's canonical query wants them
+        sb_reset(&url);
+        sb_appendf(&url, "%s/%s?", endpoint, bucket);
+        if (token) {
+            sb_append(&url, "continuation-token=");
+            sb_append_url_encoded(&url, token, 0);
+            sb_append(&url, "&");
+        }
+        sb_append(&url, "list-type=2&prefix=");
+        sb_append_url_encoded(&url, prefix, 0);
+        sb_reset(&body);
+        ret = remote_get(url.data, &body);
+        if (ret == AVERROR_HTTP_FORBIDDEN && !s3_signer.key_id[0]) {
+            fprintf(stderr, "Could not list '%s': anonymous access denied (set AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY for a private bucket)\n", input);
+            break;
+        }
+        if (ret < 0) {
+            print_ffmpeg_error(stderr, input, ret);
+            break;
+        }
+        const char *end = body.data + body.len;
+        if (!strstr(body.data, "<ListBucketResult")) {
+            // An S3 error that came with a non-error status, such as a redirect to the bucket's region
+            char *code = xml_element(body.data, end, "Code");
+            fprintf(stderr, "Could not list '%s': %s%s\n", input, code ? code : "unexpected response",
+                code && strcmp(code, "PermanentRedirect") == 0 ? " (set AWS_REGION to the bucket's region, or --s3-endpoint)" : "");
+            free(code);
+            ret = -1;
+            break;
+        }
+
+        for (const char *c = strstr(body.data, "<Contents>"); c && !scan_should_stop(); c = strstr(c, "<Contents>")) {
+            const char *c_end = strstr(c, "</Contents>");
+            if (!c_end)
+                break;
+            char *key = xml_element(c, c_end, "Key");
+            char *size = xml_element(c, c_end, "Size");
+            char *modified = xml_element(c, c_end, "LastModified");
+            if (key && size && has_supported_extension(key) && !s3_excluded(bucket, key, excludes)) {
+                sb_reset(&object);
+                sb_appendf(&object, "%s/%s/", endpoint, bucket);
+                sb_append_url_encoded(&object, key, 1);
+                struct stat st = {0};
+                st.st_mode = S_IFREG | 0444;
+                st.st_size = strtoll(size, NULL, 10);
+                st.st_mtime = modified ? parse_iso8601(modified) : 0;
+                st.st_ino = hash_string(object.data);  // keys the --cache entry together with size and mtime
+                scan_found_file(ctx, &heap, object.data, &st, show_full_path, summary);
+            }
+            free(key);
+            free(size);
+            free(modified);
+            c = c_end;
+        }
+
+        free(token);
+        token = NULL;
+        char *truncated = xml_element(body.data, end, "IsTruncated");
+        if (truncated && strcmp(truncated, "true") == 0)
+            token = xml_element(body.data, end, "NextContinuationToken");
+        free(truncated);
+        if (!token)
+            break;
+    }
+    free(token);
+    sb_free(&url);
+    sb_free(&body);
+    sb_free(&object);
+    if (heap.count > 0)
+        heap_dispatch(ctx, &heap, show_full_path, summary);
+    return ret < 0 ? -1 : 0;
 }
 
-// Returns a newly allocated string with shell-safe single-quote escaping
-char *shell_escape_single(const char *input) {
-    size_t len = strlen(input);
-    // Worst case: every character is a single quote, so 4x size + 3 for outer quotes + 1 for null
-    char *out = malloc(len * 4 + 4);
-    char *p = out;
-    *p++ = '\'';
-    for (; *input; input++) {
-        if (*input == '\'') {
-            strcpy(p, "'\\''");
-            p += 4;
-        } else {
-            *p++ = *input;
+#ifdef __linux__
+// Waits for inotify events below the scanned tree until SIGINT/SIGTERM
+void watch_run(ctv_context *ctx, Watcher *w, const char *root, const ExcludeSet *excludes, int show_full_path, Summary *summary) {
+    // Aligned for struct inotify_event, as inotify(7) recommends
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_BUF_SIZE];
+    int64_t last_flush = av_gettime_relative();
+
+    if (!brief_mode && output_format == OUTPUT_TEXT) {
+        printf("\nWatching %s for changes (Ctrl+C to stop)\n", root);
+        fflush(stdout);
+    }
+    while (!watch_stop) {
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Could not read inotify events: %s\n", strerror(errno));
+            break;
+        }
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were dropped; the only safe recovery is a full rescan
+                fprintf(stderr, "inotify queue overflowed, rescanning %s\n", root);
+                scan_dir(ctx, root, excludes, show_full_path, summary);
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                watch_remove(w, ev->wd);
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= w->capacity || !w->paths[ev->wd] || ev->len == 0)
+                continue;
+            if (snprintf(path, sizeof(path), "%s/%s", w->paths[ev->wd], ev->name) >= (int)sizeof(path))
+                continue;
+
+            if (ev->mask & IN_ISDIR) {
+                // New or moved-in directory: scanning it also starts watching it
+                if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && !exclude_dir(excludes, path))
+                    scan_dir(ctx, path, excludes, show_full_path, summary);
+                continue;
+            }
+            if (!has_supported_extension(ev->name) || exclude_match(excludes, path))
+                continue;
+            if (skip_fixed)
+                fixed_dir_forget(path);
+            struct stat st;
+            if (ev->mask & IN_CREATE) {
+                // Regular files are checked once they are closed; symlinks never will be
+                if (lstat(path, &st) == -1 || !S_ISLNK(st.st_mode))
+                    continue;
+            }
+            if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) || shard_skip(path))
+                continue;
+            // A fix that was just written reports its source as resolved
+            char *source = skip_fixed ? fixed_output_source(&ctx->options, path) : NULL;
+            // One at a time: there is no batch of heads to prefetch
+            if (source && stat(source, &st) == 0)
+                dispatch_job(ctx, source, &st, NULL, show_full_path, summary);
+            else if (!source)
+                dispatch_job(ctx, path, &st, NULL, show_full_path, summary);
+            free(source);
+        }
+        if (!work_queue)
+            fflush(stdout);
+
+        if (ctx->cache && av_gettime_relative() - last_flush > WATCH_CACHE_FLUSH_US) {
+            cache_flush(ctx->cache);
+            last_flush = av_gettime_relative();
         }
     }
-    *p++ = '\'';
-    *p = '\0';
-    return out;
 }
+#endif
 
-void check_file(const char *filepath, int show_full_path, Summary *summary) {
-    AVFormatContext *fmt_ctx = NULL;
-    int ret, i;
-    int has_unsupported = 0;
-    char line[8192] = {0}; // For brief output line
-    size_t linelen = 0;
-    const char *filename = show_full_path ? filepath : get_basename(filepath);
+/*
+ * --merge FILE...: one report from the results of the --shard nodes.  A
+ * FILE is either a node's --journal, whose records are scored again with
+ * this run's --profile and reported like the files of a scan (so the
+ * Summary totals are those of the whole library), or a node's --format
+ * jsonl output, whose lines are passed through.  A path named more than
+ * once, as when a node was run twice or two runs overlapped, is reported
+ * once, from the last FILE naming it.  Files come out in path order; a
+ * source a node resolved through its fix (a journal's R record) is reported
+ * with the fix, in the source's place.
+ */
+typedef struct {
+    char *path;             // unescaped, so journal and JSON Lines records of a file meet
+    CacheEntry *entry;      // from a journal
+    char *line;             // from JSON Lines output
+    int order;              // later records replace earlier ones
+    int resolved;           // a fix reported with its source's R record
+} MergeItem;
 
-    if (!has_supported_extension(filepath))
-        return;
+typedef struct {
+    MergeItem *items;
+    size_t count;
+    size_t capacity;
+} MergeSet;
 
-    if ((ret = avformat_open_input(&fmt_ctx, filepath, NULL, NULL)) < 0) {
-        if (!brief_mode)
-            print_ffmpeg_error(filename, ret);
-        else
-            printf("%s: " COLOR_YELLOW "error: could not open (%d)\n" COLOR_RESET, filename, ret);
-        summary->errors++;
-        return;
+void merge_add(MergeSet *set, char *path, CacheEntry *entry, char *line) {
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity ? set->capacity * 2 : 256;
+        set->items = realloc(set->items, set->capacity * sizeof(MergeItem));
     }
-    if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0) {
-        if (!brief_mode)
-            print_ffmpeg_error(filename, ret);
+    set->items[set->count] = (MergeItem){ path, entry, line, (int)set->count, 0 };
+    set->count++;
+}
+
+int compare_merge_items(const void *a, const void *b) {
+    const MergeItem *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : x->order - y->order;
+}
+
+// Index of the record reported for path in the sorted set, -1 if there is none
+long merge_find(const MergeSet *set, const char *path) {
+    size_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(set->items[mid].path, path) <= 0)
+            lo = mid + 1;
         else
-            printf("%s: " COLOR_YELLOW "error: could not read stream info (%d)\n" COLOR_RESET, filename, ret);
-        avformat_close_input(&fmt_ctx);
-        summary->errors++;
-        return;
+            hi = mid;
     }
+    return lo > 0 && strcmp(set->items[lo - 1].path, path) == 0 ? (long)lo - 1 : -1;
+}
 
-    const char *container = (fmt_ctx->iformat && fmt_ctx->iformat->name) ? fmt_ctx->iformat->name : "unknown";
-    int container_ok = is_container_supported(container);
-
-    if (brief_mode) {
-        // Brief output: one line per file, all tracks, color-coded
-        if (!container_ok) {
-            linelen += snprintf(line + linelen, sizeof(line) - linelen, COLOR_RED "[container:%s]" COLOR_RESET, container);
-            has_unsupported = 1;
-        }
-        for (i = 0; i < fmt_ctx->nb_streams; i++) {
-            AVStream *st = fmt_ctx->streams[i];
-            AVCodecParameters *par = st->codecpar;
-            if (!is_media_stream(par->codec_type)) continue;
-            const char *lang = NULL;
-            AVDictionaryEntry *tag = av_dict_get(st->metadata, "language", NULL, 0);
-            if (tag) lang = tag->value;
-            else lang = "und";
-            const char *codec = avcodec_get_name(par->codec_id);
-            int supported = 1;
-            const char *type = NULL;
+// The fix an R record names, while its F record is the same file; -1 if there is none
+long merge_fix_of(const MergeSet *set, const CacheEntry *r) {
+    long i = r->detail ? merge_find(set, r->detail) : -1;
+    const CacheEntry *e = i >= 0 ? set->items[i].entry : NULL;
+    if (!e || e->kind != 'F' || e->dev != r->dev || e->ino != r->ino || e->size != r->size ||
+        e->mtime_sec != r->mtime_sec || e->mtime_nsec != r->mtime_nsec)
+        return -1;
+    return i;
+}
 
-            if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
-                type = "video";
-                supported = is_video_codec_supported(par);
-            } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
-                type = "audio";
-                supported = is_audio_codec_supported(par->codec_id);
-            } else if (par->codec_type == AVMEDIA_TYPE_SUBTITLE) {
-                type = "subtitle";
-                supported = is_subtitle_codec_supported(par->codec_id);
-            }
-
-            if (!supported) has_unsupported = 1;
-            linelen += snprintf(line + linelen, sizeof(line) - linelen,
-                "%s[%d:%s:%s:%s]%s",
-                supported ? COLOR_GREEN : COLOR_RED,
-                i, type, codec, lang,
-                COLOR_RESET
-            );
-        }
-        avformat_close_input(&fmt_ctx);
-
-        if (has_unsupported) {
-            printf("%s:%s\n", filename, line);
-            summary->not_supported++;
-        } else {
-            summary->ok++;
+// The lines of a --format jsonl report, keyed by their "path" member; returns -1 if it isn't one
+int merge_load_jsonl(MergeSet *set, const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int ret = 0;
+    while (ret == 0 && (len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        // Every record starts with its path
+        const char *prefix = "{\"path\":";
+        char *path = NULL;
+        if (strncmp(line, prefix, strlen(prefix)) == 0)
+            path = json_read_string(line + strlen(prefix), NULL);
+        if (!path) {
+            fprintf(stderr, "'%s' is neither a check_tv_compat journal nor a --format jsonl report\n", filename);
+            ret = -1;
+            break;
         }
-        summary->total++;
-        return;
+        merge_add(set, path, NULL, strdup(line));
     }
+    free(line);
+    fclose(fp);
+    return ret;
+}
 
-    // Verbose/tree output
-    int all_supported = container_ok;
-    int has_video = 0, has_audio = 0;
-    int can_transcode = 0;
-    int has_unsupported_bitmap_subtitle = 0;
-    // First pass: determine if all supported, and count real streams
-    for (i = 0; i < fmt_ctx->nb_streams; i++) {
-        AVStream *st = fmt_ctx->streams[i];
-        AVCodecParameters *par = st->codecpar;
-        if (!is_media_stream(par->codec_type)) continue;
-        int supported = 1;
-        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
-            supported = is_video_codec_supported(par);
-            has_video = 1;
-            if (!supported) can_transcode = 1;
-        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
-            supported = is_audio_codec_supported(par->codec_id);
-            has_audio = 1;
-            if (!supported) can_transcode = 1;
-        } else if (par->codec_type == AVMEDIA_TYPE_SUBTITLE) {
-            supported = is_subtitle_codec_supported(par->codec_id);
-            if (!supported) {
-                if (is_bitmap_subtitle(par->codec_id))
-                    has_unsupported_bitmap_subtitle = 1;
-                else
-                    can_transcode = 1;
+// A --journal's records; returns 0 if loaded, 1 if filename isn't a journal and -1 on errors
+int merge_load_journal(MergeSet *set, const char *filename) {
+    ProbeCache *records = cache_create(filename);
+    off_t end = cache_load(records, JOURNAL_MAGIC);
+    if (end == -1)
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(ENOENT));
+    if (end >= 0) {
+        for (size_t i = 0; i < records->capacity; i++) {
+            CacheEntry *e = records->slots[i];
+            if (e) {
+                merge_add(set, e->path, e, NULL);
+                records->slots[i] = NULL;
             }
         }
-        if (!supported) all_supported = 0;
     }
-    if (skip_ok && all_supported) {
-        avformat_close_input(&fmt_ctx);
-        summary->ok++;
-        summary->total++;
-        return;
+    cache_close(records);
+    return end >= 0 ? 0 : end == -3 ? 1 : -1;
+}
+
+// Reports the merged records of files on stdout and counts them in summary
+int merge_reports(ctv_context *ctx, char **files, int num_files, int show_full_path, Summary *summary) {
+    MergeSet set = {0};
+    int ret = 0;
+    int jsonl = 0;
+    for (int i = 0; i < num_files && ret == 0; i++) {
+        int r = merge_load_journal(&set, files[i]);
+        if (r == 1) {
+            r = merge_load_jsonl(&set, files[i]);
+            jsonl = 1;
+        }
+        if (r < 0)
+            ret = -1;
     }
-    if (skip_unfixable && !all_supported && !can_transcode && has_unsupported_bitmap_subtitle) {
-        avformat_close_input(&fmt_ctx);
-        summary->not_supported++;
-        summary->total++;
-        return;
+    if (ret == 0 && jsonl && output_format != OUTPUT_JSONL) {
+        // Their lines can only be passed through; scoring them again needs the journals
+        fprintf(stderr, "--merge of --format jsonl reports needs --format jsonl.\n");
+        ret = -1;
     }
 
-    printf("----------------\n\n%s\n", filename);
-    printf("  container: %s | %s\n", container, container_ok ? COLOR_GREEN "OK" COLOR_RESET : COLOR_RED "NOT SUPPORTED" COLOR_RESET);
-    for (i = 0; i < fmt_ctx->nb_streams; i++) {
-        AVStream *st = fmt_ctx->streams[i];
-        AVCodecParameters *par = st->codecpar;
-        if (!is_media_stream(par->codec_type)) continue;
-        const char *lang = NULL;
-        AVDictionaryEntry *tag = av_dict_get(st->metadata, "language", NULL, 0);
-        if (tag) lang = tag->value;
-        else lang = "und";
-        const char *codec = avcodec_get_name(par->codec_id);
-        int supported = 1;
-        const char *type = NULL;
-
-        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
-            type = "video";
-            supported = is_video_codec_supported(par);
-        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
-            type = "audio";
-            supported = is_audio_codec_supported(par->codec_id);
-        } else if (par->codec_type == AVMEDIA_TYPE_SUBTITLE) {
-            type = "subtitle";
-            supported = is_subtitle_codec_supported(par->codec_id);
-        }
-
-        printf("    [%d] %s | %s | %s | %s%s%s\n",
-            i, type, codec, lang,
-            supported ? COLOR_GREEN : COLOR_RED,
-            supported ? "OK" : "NOT SUPPORTED",
-            COLOR_RESET
-        );
-        if (!supported && par->codec_type == AVMEDIA_TYPE_SUBTITLE && is_bitmap_subtitle(par->codec_id)) {
-            printf(COLOR_YELLOW "  Note: Subtitle stream %d (%s) is bitmap-based and cannot be converted to srt. It will be copied as-is (may not be supported on your TV).\n" COLOR_RESET, i, avcodec_get_name(par->codec_id));
-        }
-    }
-    printf("  overall: %s%s%s\n", 
-        all_supported ? COLOR_GREEN : COLOR_RED,
-        all_supported ? "ALL TRACKS SUPPORTED" : "SOME TRACKS UNSUPPORTED",
-        COLOR_RESET);
-
-    // Suggested remuxing command for unsupported files (only if video or audio present)
-    if (!all_supported && (has_video || has_audio)) {
-        char remux_cmd[8192] = {0};
-        char remuxed_basename[PATH_BUF_SIZE];
-        snprintf(remuxed_basename, sizeof(remuxed_basename), "remuxed_%s.mkv", get_basename(filepath));
-        char *escaped_in = shell_escape_single(filepath);
-        char *escaped_out = shell_escape_single(remuxed_basename);
-        snprintf(remux_cmd, sizeof(remux_cmd),
-            "ffmpeg -i %s -map 0 -c copy %s",
-            escaped_in, escaped_out);
-        printf("\n  Suggested remuxing command:\n    %s\n", remux_cmd);
-        printf(COLOR_YELLOW "    (This changes only the container; streams are copied without re-encoding)\n" COLOR_RESET);
-        free(escaped_in);
-        free(escaped_out);
+    qsort(set.items, set.count, sizeof(MergeItem), compare_merge_items);
+    // Fixes that come with their source are reported there
+    for (size_t i = 0; i < set.count; i++) {
+        const CacheEntry *e = set.items[i].entry;
+        int last = i + 1 == set.count || strcmp(set.items[i].path, set.items[i + 1].path) != 0;
+        long fix = last && e && e->kind == 'R' ? merge_fix_of(&set, e) : -1;
+        if (fix >= 0)
+            set.items[fix].resolved = 1;
     }
-
-    // Only suggest ffmpeg command if re-encoding can help
-    if (!all_supported && (has_video || has_audio) && can_transcode) {
-        char cmd[8192] = {0};
-        char fixed_basename[PATH_BUF_SIZE];
-        // Always output to .mkv for transcoded files
-        const char *base = get_basename(filepath);
-        const char *dot = strrchr(base, '.');
-        if (dot) {
-            snprintf(fixed_basename, sizeof(fixed_basename), "fixed_%.*s.mkv", (int)(dot - base), base);
-        } else {
-            snprintf(fixed_basename, sizeof(fixed_basename), "fixed_%s.mkv", base);
+    char scratch[4096];
+    StrBuf sb;
+    sb_init(&sb, scratch, sizeof(scratch));
+    for (size_t i = 0; i < set.count; i++) {
+        MergeItem *item = &set.items[i];
+        int last = i + 1 == set.count || strcmp(item->path, set.items[i + 1].path) != 0;
+        if (ret == 0 && last) {
+            const char *filename = show_full_path ? item->path : get_basename(item->path);
+            CacheEntry *e = item->entry;
+            const char *source = NULL;
+            if (e && e->kind == 'R') {
+                // Reported as its fix, which resolves it
+                long fix = merge_fix_of(&set, e);
+                source = item->path;
+                e = fix >= 0 ? set.items[fix].entry : NULL;
+            }
+            if (item->line) {
+                puts(item->line);
+            } else if (!e || item->resolved) {
+                // An R record without its fix, or a fix printed with its source
+            } else if (e->kind == 'E') {
+                report_error(stdout, item->path, filename, e->detail ? e->detail : "could not probe", e->errnum);
+                summary->errors++;
+            } else if (e->kind == 'D') {
+                if (e->detail)
+                    report_duplicate(stdout, item->path, filename, e->detail);
+                summary->duplicates++;
+            } else {
+                FileAnalysis analysis;
+                analyze_file(&ctx->options, &e->info, &analysis);
+                if (source) {
+                    analysis.source = source;
+                    analysis.source_name = show_full_path ? source : get_basename(source);
+                    summary->resolved++;
+                }
+                summary_count(summary, &analysis);
+                sb_reset(&sb);
+                const char *path = source ? e->path : item->path;
+                report_file(stdout, &sb, path, show_full_path ? path : get_basename(path), &analysis);
+                if (fix_script)
+                    script_add_file(fix_script, &sb, path, &analysis);
+                analysis_free(&analysis);
+            }
         }
-        char *escaped_in = shell_escape_single(filepath);
-        char *escaped_out = shell_escape_single(fixed_basename);
+    }
+    // An R record may have used a fix that sorts before it
+    for (size_t i = 0; i < set.count; i++) {
+        MergeItem *item = &set.items[i];
+        if (item->entry)
+            cache_entry_free(item->entry);
+        else
+            free(item->path);
+        free(item->line);
+    }
+    sb_free(&sb);
+    free(set.items);
+    return ret;
+}
 
-        snprintf(cmd, sizeof(cmd), "ffmpeg -i %s", escaped_in);
+/*
+ * Library API (check_tv_compat.h).  ctv_check() runs the same probe and
+ * --deep stage as check_path(), on the context's CheckOptions and cache; the
+ * command line's reporting (output modes, --remux, --dedupe, the worker
+ * pools) is not involved.  The command line is a context too, made by main()
+ * with ctv_context_new().
+ */
+void ctv_options_init(ctv_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+}
 
-        int v_cnt = 0, a_cnt = 0, s_cnt = 0;
-        char v_opts[1024] = {0}, a_opts[1024] = {0}, s_opts[1024] = {0};
-        int had_video = 0, had_audio = 0, had_sub = 0;
+const char *const *ctv_list_profiles(void) {
+    static const char *names[NUM_PROFILES + 1];
+    for (size_t i = 0; i < NUM_PROFILES; i++)
+        names[i] = profile_defs[i].name;
+    return names;
+}
 
-        for (i = 0; i < fmt_ctx->nb_streams; i++) {
-            AVStream *st = fmt_ctx->streams[i];
-            AVCodecParameters *par = st->codecpar;
-            if (!is_media_stream(par->codec_type)) continue;
-            int supported = 1;
-            if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
-                supported = is_video_codec_supported(par);
-                if (!had_video) { strcat(cmd, " -map 0:v"); had_video = 1; }
-                snprintf(v_opts + strlen(v_opts), sizeof(v_opts) - strlen(v_opts),
-                    " -c:v:%d %s", v_cnt, supported ? "copy" : "libx264");
-                v_cnt++;
-            } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
-                supported = is_audio_codec_supported(par->codec_id);
-                if (!had_audio) { strcat(cmd, " -map 0:a"); had_audio = 1; }
-                snprintf(a_opts + strlen(a_opts), sizeof(a_opts) - strlen(a_opts),
-                    " -c:a:%d %s", a_cnt, supported ? "copy" : "aac");
-                a_cnt++;
-            } else if (par->codec_type == AVMEDIA_TYPE_SUBTITLE) {
-                supported = is_subtitle_codec_supported(par->codec_id);
-                if (!had_sub) { strcat(cmd, " -map 0:s"); had_sub = 1; }
-                if (!supported) {
-                    if (is_text_subtitle(par->codec_id)) {
-                        snprintf(s_opts + strlen(s_opts), sizeof(s_opts) - strlen(s_opts),
-                            " -c:s:%d srt", s_cnt);
-                    } else {
-                        snprintf(s_opts + strlen(s_opts), sizeof(s_opts) - strlen(s_opts),
-                            " -c:s:%d copy", s_cnt);
-                    }
-                } else {
-                    snprintf(s_opts + strlen(s_opts), sizeof(s_opts) - strlen(s_opts),
-                        " -c:s:%d copy", s_cnt);
-                }
-                s_cnt++;
-            }
-        }
+ctv_context *ctv_context_new(const ctv_options *opts) {
+    ctv_context *ctx = calloc(1, sizeof(ctv_context));
+    CheckOptions *o = &ctx->options;
+    int ret = check_options_set_profiles(o, opts->profiles ? opts->profiles : "frame2024");
+    if (ret >= 0 && o->num_profiles == 0) {
+        fprintf(stderr, "No profile specified.\n");
+        ret = -1;
+    }
+    if (ret < 0) {
+        check_options_free(o);
+        free(ctx);
+        return NULL;
+    }
+    o->fast_probe = opts->fast;
+    o->probesize_limit = opts->probesize;
+    o->analyzeduration_limit = opts->analyzeduration;
+    o->io_buffer_size = opts->io_buffer_size;
+    if (o->io_buffer_size && o->io_buffer_size < IO_BUFFER_MIN)
+        o->io_buffer_size = IO_BUFFER_MIN;
+    if (o->io_buffer_size > IO_BUFFER_MAX)
+        o->io_buffer_size = IO_BUFFER_MAX;
+    o->mmap_head = opts->mmap_head;
+    o->deep_mode = opts->deep;
+    if (opts->cache_file)
+        ctx->cache = cache_open(opts->cache_file);
+    return ctx;
+}
 
-        strcat(cmd, v_opts);
-        strcat(cmd, a_opts);
-        strcat(cmd, s_opts);
+void ctv_context_free(ctv_context *ctx) {
+    if (!ctx) return;
+    if (ctx->cache)
+        cache_close(ctx->cache);
+    check_options_free(&ctx->options);
+    free(ctx);
+}
 
-        snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), " %s", escaped_out);
+int ctv_num_profiles(const ctv_context *ctx) {
+    return ctx->options.num_profiles;
+}
 
-        printf("\n  Suggested ffmpeg command:\n    %s\n", cmd);
+const char *ctv_profile_name(const ctv_context *ctx, int p) {
+    return p >= 0 && p < ctx->options.num_profiles ? ctx->options.profiles[p]->def->name : NULL;
+}
 
-        free(escaped_in);
-        free(escaped_out);
+void ctv_result_fill(ctv_result *r, const FileAnalysis *a, int num_profiles) {
+    snprintf(r->container, sizeof(r->container), "%s", a->container);
+    r->streams = calloc(a->nb_streams ? a->nb_streams : 1, sizeof(ctv_stream));
+    r->nb_streams = a->nb_streams;
+    for (int i = 0; i < a->nb_streams; i++) {
+        const StreamAnalysis *sa = &a->streams[i];
+        ctv_stream *cs = &r->streams[i];
+        cs->index = sa->index;
+        cs->type = sa->type == AVMEDIA_TYPE_VIDEO ? CTV_VIDEO :
+                   sa->type == AVMEDIA_TYPE_AUDIO ? CTV_AUDIO : CTV_SUBTITLE;
+        cs->codec = sa->codec_name;
+        snprintf(cs->lang, sizeof(cs->lang), "%s", sa->lang);
+        cs->supported = sa->supported;
+        cs->deep = sa->deep;
+        cs->profile = sa->profile;
+        cs->level = sa->level;
+        cs->bit_depth = sa->bit_depth;
+        cs->dovi_profile = sa->dovi_profile;
     }
-
-    printf("\n");
-    avformat_close_input(&fmt_ctx);
-    if (all_supported) summary->ok++;
-    else summary->not_supported++;
-    summary->total++;
+    for (int p = 0; p < num_profiles; p++) {
+        r->verdicts[p].container_ok = a->verdicts[p].container_ok;
+        r->verdicts[p].all_supported = a->verdicts[p].all_supported;
+        r->verdicts[p].fix = verdict_fix(&a->verdicts[p]);
+    }
+    r->all_profiles_ok = a->all_profiles_ok;
 }
 
-void scan_dir(const char *dirpath, char **excludes, int num_excludes, int show_full_path, Summary *summary);
+// check_path() without the reporting: cache, probe, --deep stage, score
+int ctv_check(ctv_context *ctx, const char *path, const struct stat *st, ctv_result *result) {
+    memset(result, 0, sizeof(*result));
+    result->num_profiles = ctx->options.num_profiles;
 
-int is_excluded(const char *path, char **excludes, int num_excludes) {
-    for (int i = 0; i < num_excludes; ++i) {
-        // Match directory or file name with pattern
-        if (fnmatch(excludes[i], path, 0) == 0)
-            return 1;
+    ProbedFile pf = {0};
+    int ret = check_probe(ctx, path, st, NULL, &pf, NULL, 0, &result->failed_step);
+    if (ret < 0) {
+        result->error = ret;
+        return ret;
     }
+    if (ret > 0)
+        check_deep(ctx, path, st, &pf, NULL);
+    probe_input_close(&pf.input);
+
+    FileAnalysis analysis;
+    analyze_file(&ctx->options, &pf.info, &analysis);
+    probe_info_free(&pf.info);
+    ctv_result_fill(result, &analysis, ctx->options.num_profiles);
+    analysis_free(&analysis);
     return 0;
 }
 
-void scan_dir(const char *dirpath, char **excludes, int num_excludes, int show_full_path, Summary *summary) {
-    struct dirent *entry;
-    DIR *dp = opendir(dirpath);
-    if (!dp) {
-        fprintf(stderr, "Could not open directory: %s (%s)\n", dirpath, strerror(errno));
-        return;
-    }
-    while ((entry = readdir(dp)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-        char path[PATH_BUF_SIZE];
-        snprintf(path, sizeof(path), "%s/%s", dirpath, entry->d_name);
+int ctv_check_file(ctv_context *ctx, const char *path, ctv_result *result) {
+    struct stat st;
+    int local = !is_url(path) && stat(path, &st) == 0;
+    return ctv_check(ctx, path, local ? &st : NULL, result);
+}
 
-        struct stat st;
-        if (stat(path, &st) == -1) continue;
-        if (S_ISDIR(st.st_mode)) {
-            if (is_excluded(path, excludes, num_excludes)) continue;
-            scan_dir(path, excludes, num_excludes, show_full_path, summary);
-        } else if (S_ISREG(st.st_mode)) {
-            check_file(path, show_full_path, summary);
-        }
+void ctv_result_free(ctv_result *result) {
+    free(result->streams);
+    result->streams = NULL;
+    result->nb_streams = 0;
+}
+
+typedef struct {
+    ctv_context *ctx;
+    ctv_scan_callback scan;
+    ctv_walk_callback walk;
+    void *opaque;
+} ApiWalk;
+
+int api_walk_found(void *opaque, const char *path, const struct stat *st) {
+    ApiWalk *w = opaque;
+    if (w->walk)
+        return w->walk(w->opaque, path);
+    ctv_result result;
+    ctv_check(w->ctx, path, st, &result);
+    int stop = w->scan(w->opaque, path, &result);
+    ctv_result_free(&result);
+    return stop;
+}
+
+int api_walk(ApiWalk *w, const char *dir, const char *const *excludes, int num_excludes) {
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        fprintf(stderr, "Could not open directory: %s (%s)\n", dir, strerror(errno));
+        return -1;
     }
-    closedir(dp);
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "'%s' is not a directory.\n", dir);
+        return -1;
+    }
+    ExcludeSet set = {0};
+    for (int i = 0; i < num_excludes; i++)
+        exclude_add(&set, excludes[i]);
+    int ret = walk_tree(dir, &set, api_walk_found, w);
+    exclude_free(&set);
+    return ret;
+}
+
+int ctv_scan(ctv_context *ctx, const char *dir, const char *const *excludes, int num_excludes,
+             ctv_scan_callback callback, void *opaque) {
+    ApiWalk w = { .ctx = ctx, .scan = callback, .opaque = opaque };
+    return api_walk(&w, dir, excludes, num_excludes);
+}
+
+int ctv_walk(const char *dir, const char *const *excludes, int num_excludes,
+             ctv_walk_callback callback, void *opaque) {
+    ApiWalk w = { .walk = callback, .opaque = opaque };
+    return api_walk(&w, dir, excludes, num_excludes);
 }
 
-int main(int argc, char *argv[]) {
+// The check_tv_compat command (main.c): a ctv_context for the options, and the reporting around its checks
+int ctv_cli_main(int argc, char *argv[]) {
     av_log_set_callback(quiet_ffmpeg_log);
 
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file-or-directory> [--exclude dir1 ...] [--fullpath] [--brief] [--skip-ok] [--skip-unfixable]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <file-directory-or-url> [--exclude PATTERN ...] [--exclude-from FILE] [--fullpath] [--brief] [--skip-ok] [--skip-unfixable] [--jobs N|auto] [--cache FILE] [--format text|jsonl] [--profile NAME[,NAME...]] [--list-profiles] [--fast] [--probesize BYTES] [--analyzeduration USEC] [--io-buffer SIZE] [--mmap-head] [--uring] [--prefetch SIZE] [--max-inflight-bytes SIZE] [--emit-script FILE] [--remux] [--remux-jobs N] [--deep] [--deep-jobs N] [--dedupe] [--skip-fixed] [--decode-sample] [--decode-jobs N] [--decode-rate SIZE] [--hwaccel TYPE] [--order newest|largest|path] [--limit N] [--since DATE] [--s3-endpoint URL] [--journal FILE] [--shard I/N] [--stats] [--watch] [--metrics [HOST:]PORT]\n"
+                        "       %s [options] --merge FILE...\n"
+                        "       %s --serve SOCKET [options]\n"
+                        "       %s --client SOCKET [path...]\n", argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    char **excludes = NULL;
-    int num_excludes = 0;
+    ExcludeSet excludes = {0};
     int show_full_path = 0;
     const char *input = NULL;
+    ctv_options check_opts;
+    ctv_options_init(&check_opts);
+    const char *journal_file = NULL;
+    const char *serve_path = NULL;
+    const char *metrics_addr = NULL;
+    char **merge_files = NULL;
+    int num_merge_files = 0;
+    int jobs_given = 0;
+    const char *script_file = NULL;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--exclude") == 0 && i + 1 < argc) {
-            excludes = realloc(excludes, (num_excludes + 1) * sizeof(char *));
-            excludes[num_excludes++] = argv[++i];
+            exclude_add(&excludes, argv[++i]);
+        } else if (strcmp(argv[i], "--exclude-from") == 0 && i + 1 < argc) {
+            if (exclude_load(&excludes, argv[++i]) < 0)
+                return 1;
         } else if (strcmp(argv[i], "--fullpath") == 0) {
             show_full_path = 1;
         } else if (strcmp(argv[i], "--brief") == 0) {
@@ -494,42 +7593,507 @@ int main(int argc, char *argv[]) {
             skip_ok = 1;
         } else if (strcmp(argv[i], "--skip-unfixable") == 0) {
             skip_unfixable = 1;
+        } else if ((strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            jobs_given = 1;
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            if (strcmp(argv[++i], "auto") == 0) {
+                // Enough threads for every device to reach the limit it can take
+                adaptive_jobs = 1;
+                num_jobs = ncpu > 2 ? 4 * (int)ncpu : 8;
+            } else {
+                adaptive_jobs = 0;
+                num_jobs = atoi(argv[i]);
+                if (num_jobs <= 0)
+                    num_jobs = ncpu > 0 ? (int)ncpu : 1;
+            }
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            check_opts.cache_file = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journal_file = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            // Everything after the socket is a path to check
+            return serve_client(argv[i + 1], argc - i - 2, argv + i + 2);
+        } else if (strcmp(argv[i], "--merge") == 0 && i + 1 < argc) {
+            // Everything after it is a report to merge
+            merge_files = argv + i + 1;
+            num_merge_files = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+            char end;
+            if (sscanf(argv[++i], "%d/%d%c", &shard_index, &shard_count, &end) != 2 ||
+                shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+                fprintf(stderr, "Invalid --shard '%s' (expected i/N with 0 <= i < N)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            const char *fmt = argv[++i];
+            if (strcmp(fmt, "text") == 0) {
+                output_format = OUTPUT_TEXT;
+            } else if (strcmp(fmt, "jsonl") == 0) {
+                output_format = OUTPUT_JSONL;
+            } else {
+                fprintf(stderr, "Unknown output format '%s' (expected text or jsonl).\n", fmt);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            // A comma-separated list; each file is probed once and scored against all
+            check_opts.profiles = argv[++i];
+        } else if (strcmp(argv[i], "--list-profiles") == 0) {
+            for (size_t p = 0; p < NUM_PROFILES; p++)
+                printf("%-14s %s\n", profile_defs[p].name, profile_defs[p].description);
+            return 0;
+        } else if (strcmp(argv[i], "--remux") == 0) {
+            remux_mode = 1;
+        } else if (strcmp(argv[i], "--remux-jobs") == 0 && i + 1 < argc) {
+            remux_slots.limit = atoi(argv[++i]);
+            if (remux_slots.limit < 1)
+                remux_slots.limit = 1;
+        } else if (strcmp(argv[i], "--deep") == 0) {
+            check_opts.deep = 1;
+        } else if (strcmp(argv[i], "--deep-jobs") == 0 && i + 1 < argc) {
+            deep_jobs = atoi(argv[++i]);
+            if (deep_jobs < 1)
+                deep_jobs = 1;
+        } else if (strcmp(argv[i], "--dedupe") == 0) {
+            dedupe_mode = 1;
+        } else if (strcmp(argv[i], "--skip-fixed") == 0) {
+            skip_fixed = 1;
+        } else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc) {
+            const char *order = argv[++i];
+            if (strcmp(order, "newest") == 0) {
+                scan_order = ORDER_NEWEST;
+            } else if (strcmp(order, "largest") == 0) {
+                scan_order = ORDER_LARGEST;
+            } else if (strcmp(order, "path") == 0) {
+                scan_order = ORDER_PATH;
+            } else {
+                fprintf(stderr, "Unknown order '%s' (expected newest, largest or path).\n", order);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            scan_limit = atol(argv[++i]);
+            if (scan_limit < 1) {
+                fprintf(stderr, "Invalid --limit '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+            if (parse_since(argv[++i], &scan_since) < 0) {
+                fprintf(stderr, "Invalid --since '%s' (expected YYYY-MM-DD[ HH:MM[:SS]] or an age like 7d, 12h, 30m)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--s3-endpoint") == 0 && i + 1 < argc) {
+            s3_endpoint = argv[++i];
+            if (!is_http_url(s3_endpoint)) {
+                fprintf(stderr, "Invalid --s3-endpoint '%s' (expected an http:// or https:// URL)\n", s3_endpoint);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--emit-script") == 0 && i + 1 < argc) {
+            script_file = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats_mode = 1;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_addr = argv[++i];
+            metrics_mode = 1;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+#ifdef __linux__
+            watch_mode = 1;
+#else
+            fprintf(stderr, "--watch needs inotify and is only available on Linux.\n");
+            return 1;
+#endif
+        } else if (strcmp(argv[i], "--uring") == 0) {
+#ifdef HAVE_IO_URING
+            uring_mode = 1;
+#else
+            fprintf(stderr, "--uring needs io_uring and is only available on Linux.\n");
+            return 1;
+#endif
+        } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &prefetch_size) < 0 || prefetch_size > IO_BUFFER_MAX) {
+                fprintf(stderr, "Invalid --prefetch size '%s' (0 to 64M)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--decode-sample") == 0) {
+            decode_sample = 1;
+        } else if (strcmp(argv[i], "--decode-jobs") == 0 && i + 1 < argc) {
+            decode_jobs = atoi(argv[++i]);
+            if (decode_jobs < 1)
+                decode_jobs = 1;
+        } else if (strcmp(argv[i], "--decode-rate") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &decode_rate) < 0) {
+                fprintf(stderr, "Invalid --decode-rate size '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--hwaccel") == 0 && i + 1 < argc) {
+            hwaccel_name = argv[++i];
+            if (strcmp(hwaccel_name, "auto") != 0 && strcmp(hwaccel_name, "none") != 0 &&
+                av_hwdevice_find_type_by_name(hwaccel_name) == AV_HWDEVICE_TYPE_NONE) {
+                fprintf(stderr, "Unknown --hwaccel '%s' (expected auto, none, vaapi, cuda or another FFmpeg device type).\n", hwaccel_name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            check_opts.fast = 1;
+        } else if (strcmp(argv[i], "--probesize") == 0 && i + 1 < argc) {
+            check_opts.probesize = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--io-buffer") == 0 && i + 1 < argc) {
+            int64_t size;
+            if (parse_size(argv[++i], &size) < 0 || size < IO_BUFFER_MIN || size > IO_BUFFER_MAX) {
+                fprintf(stderr, "Invalid --io-buffer size '%s' (4K to 64M)\n", argv[i]);
+                return 1;
+            }
+            check_opts.io_buffer_size = (int)size;
+        } else if (strcmp(argv[i], "--max-inflight-bytes") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &probe_budget.limit) < 0) {
+                fprintf(stderr, "Invalid --max-inflight-bytes size '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--mmap-head") == 0) {
+            check_opts.mmap_head = 1;
+        } else if (strcmp(argv[i], "--analyzeduration") == 0 && i + 1 < argc) {
+            check_opts.analyzeduration = strtoll(argv[++i], NULL, 10);
         } else if (!input) {
             input = argv[i];
         }
     }
 
-    if (!input) {
-        fprintf(stderr, "No file or directory specified.\n");
+    if (!input && !serve_path && !merge_files) {
+        fprintf(stderr, "No file, directory or URL specified.\n");
+        return 1;
+    }
+    if (serve_path) {
+        if (input || watch_mode || journal_file || script_file || dedupe_mode || decode_sample || skip_fixed) {
+            fprintf(stderr, "--serve takes no input and can't be combined with --watch, --journal, --emit-script, --dedupe, --decode-sample or --skip-fixed.\n");
+            return 1;
+        }
+        // Answers are always JSON Lines, one for every request
+        output_format = OUTPUT_JSONL;
+        skip_ok = skip_unfixable = 0;
+        if (!jobs_given) {
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            num_jobs = ncpu > 0 ? (int)ncpu : 1;
+        }
+    }
+    if (metrics_mode && !serve_path && !watch_mode) {
+        fprintf(stderr, "--metrics is for long-running checkers and needs --watch or --serve.\n");
+        return 1;
+    }
+    if (merge_files && (input || serve_path || watch_mode || journal_file || remux_mode || dedupe_mode || shard_count || decode_sample)) {
+        fprintf(stderr, "--merge takes the reports as its input and can't be combined with --serve, --watch, --journal, --remux, --dedupe, --shard or --decode-sample.\n");
         return 1;
     }
 
-    struct stat st;
-    if (stat(input, &st) == -1) {
-        fprintf(stderr, "Could not stat '%s': %s\n", input, strerror(errno));
+    ctv_context *ctx = ctv_context_new(&check_opts);
+    if (!ctx)
         return 1;
+    ctx->budget = &probe_budget;
+
+    // URLs are probed remotely; s3:// names a bucket (prefix) to list and scan like a directory
+    int remote = input && is_url(input);
+    int bucket = input && strncmp(input, "s3://", 5) == 0;
+    int scan = bucket;
+    struct stat st = {0};
+    if (input && !remote) {
+        if (stat(input, &st) == -1) {
+            fprintf(stderr, "Could not stat '%s': %s\n", input, strerror(errno));
+            return 1;
+        }
+        scan = S_ISDIR(st.st_mode);
     }
 
     Summary summary = {0};
+    int64_t t_start = av_gettime_relative();
+    int64_t walk_us = -1;
 
-    if (S_ISDIR(st.st_mode)) {
-        scan_dir(input, excludes, num_excludes, show_full_path, &summary);
-    } else if (S_ISREG(st.st_mode)) {
-        check_file(input, show_full_path, &summary);
-    } else {
+    if (script_file) {
+        fix_script = calloc(1, sizeof(FixScript));
+        pthread_mutex_init(&fix_script->lock, NULL);
+    }
+
+    if (input && !remote && !S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
         fprintf(stderr, "'%s' is not a regular file or directory.\n", input);
         return 1;
     }
+    if (watch_mode && (remote || !S_ISDIR(st.st_mode))) {
+        fprintf(stderr, "--watch needs a directory.\n");
+        return 1;
+    }
+    if (dedupe_mode && S_ISDIR(st.st_mode))
+        dedupe = dedupe_create();
+    if (shard_count) {
+        if (!scan) {
+            fprintf(stderr, "--shard needs a directory or bucket to scan.\n");
+            return 1;
+        }
+        shard_root = input;
+    }
+    if (journal_file) {
+        if (!scan) {
+            fprintf(stderr, "--journal needs a directory or bucket to scan.\n");
+            return 1;
+        }
+        ctx->journal = journal_open(journal_file);
+        if (!ctx->journal)
+            return 1;
+        if (!watch_mode) {
+            // A second Ctrl-C kills as usual
+            struct sigaction sa = { .sa_handler = journal_signal, .sa_flags = SA_RESETHAND | SA_RESTART };
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGINT, &sa, NULL);
+            sigaction(SIGTERM, &sa, NULL);
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (uring_mode && scan && !bucket) {
+        walk_ring = uring_new(URING_BATCH);
+        if (!walk_ring)
+            fprintf(stderr, "Could not set up io_uring (%s); continuing without --uring\n", strerror(errno));
+        // Reading ahead more than the probe takes would be wasted
+        if (prefetch_size > probe_head_size(&ctx->options))
+            prefetch_size = probe_head_size(&ctx->options);
+    }
+#endif
+
+#ifdef __linux__
+    Watcher watch = { .fd = -1 };
+    if (watch_mode) {
+        // Watches are added while the initial scan walks the tree, so nothing created meanwhile is missed
+        watch.fd = inotify_init1(IN_CLOEXEC);
+        if (watch.fd < 0) {
+            fprintf(stderr, "Could not initialize inotify: %s\n", strerror(errno));
+            return 1;
+        }
+        watcher = &watch;
+        struct sigaction sa = { .sa_handler = watch_signal };
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+#endif
+
+    if (metrics_addr && metrics_start(metrics_addr, ctx->cache) < 0)
+        return 1;
+
+    PathQueue queue;
+    Worker *workers = NULL;
+    char *device_stats = NULL;
+    int started = 0;
+    if ((scan && num_jobs > 1) || serve_path) {
+        workers = calloc(num_jobs, sizeof(Worker));
+        queue_init(&queue, num_jobs * 4, adaptive_jobs ? num_jobs : 0);
+        work_queue = &queue;
+        for (int i = 0; i < num_jobs; ++i) {
+            workers[i].queue = &queue;
+            workers[i].ctx = ctx;
+            workers[i].show_full_path = show_full_path;
+            int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+            if (err != 0) {
+                fprintf(stderr, "Could not start worker thread: %s\n", strerror(err));
+                break;
+            }
+            started++;
+        }
+        if (started == 0)
+            work_queue = NULL;
+    }
 
-    if (!brief_mode) {
+    // --deep: files whose header left something open go on to their own pool
+    PathQueue deep_files;
+    Worker *deep_workers = NULL;
+    int deep_started = 0;
+    if (!deep_jobs) {
+        // The packet stage is mostly CPU; the threads --jobs auto starts are for waiting on I/O
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        deep_jobs = adaptive_jobs && ncpu > 0 ? (int)ncpu : num_jobs;
+    }
+    if (ctx->options.deep_mode && scan && (work_queue || deep_jobs > 1)) {
+        deep_workers = calloc(deep_jobs, sizeof(Worker));
+        queue_init(&deep_files, deep_jobs * 4, 0);
+        deep_queue = &deep_files;
+        for (int i = 0; i < deep_jobs; ++i) {
+            deep_workers[i].queue = &deep_files;
+            deep_workers[i].ctx = ctx;
+            deep_workers[i].show_full_path = show_full_path;
+            int err = pthread_create(&deep_workers[i].thread, NULL, worker_main, &deep_workers[i]);
+            if (err != 0) {
+                fprintf(stderr, "Could not start worker thread: %s\n", strerror(err));
+                break;
+            }
+            deep_started++;
+        }
+        if (deep_started == 0)
+            deep_queue = NULL;
+    }
+
+    // --decode-sample: a pool of its own, whatever --jobs is
+    PathQueue decode_files;
+    Worker *decode_workers = NULL;
+    int decode_started = 0;
+    if (decode_sample) {
+        hw_device_open(hwaccel_name);
+        decode_workers = calloc(decode_jobs, sizeof(Worker));
+        queue_init(&decode_files, 64, 0);
+        decode_files.unbounded = 1;
+        decode_queue = &decode_files;
+        for (int i = 0; i < decode_jobs; ++i) {
+            decode_workers[i].queue = &decode_files;
+            decode_workers[i].ctx = ctx;
+            decode_workers[i].show_full_path = show_full_path;
+            int err = pthread_create(&decode_workers[i].thread, NULL, worker_main, &decode_workers[i]);
+            if (err != 0) {
+                fprintf(stderr, "Could not start worker thread: %s\n", strerror(err));
+                break;
+            }
+            decode_started++;
+        }
+        if (decode_started == 0)
+            decode_queue = NULL;
+    }
+
+    int status = 0;
+    if (merge_files) {
+        // Nothing is reported unless every file could be read
+        if (merge_reports(ctx, merge_files, num_merge_files, show_full_path, &summary) < 0)
+            return 1;
+    } else if (serve_path) {
+        if (!work_queue || serve_run(ctx, serve_path) < 0)
+            status = 1;
+    } else if (bucket) {
+        int64_t t_walk = av_gettime_relative();
+        if (scan_s3(ctx, input, &excludes, show_full_path, &summary) < 0)
+            status = 1;
+        walk_us = av_gettime_relative() - t_walk - scan_stats.dispatch_us;
+    } else if (S_ISDIR(st.st_mode)) {
+        int64_t t_walk = av_gettime_relative();
+        scan_dir(ctx, input, &excludes, show_full_path, &summary);
+        walk_us = av_gettime_relative() - t_walk - scan_stats.dispatch_us;
+#ifdef __linux__
+        if (watcher) {
+            if (ctx->cache)
+                cache_flush(ctx->cache);
+            // --order, --limit and --since shape the initial scan only
+            scan_order = ORDER_WALK;
+            scan_limit = 0;
+            scan_since = 0;
+            watch_run(ctx, watcher, input, &excludes, show_full_path, &summary);
+            watcher = NULL;
+            close(watch.fd);
+            for (int i = 0; i < watch.capacity; i++)
+                free(watch.paths[i]);
+            free(watch.paths);
+        }
+#endif
+    } else {
+        check_file(ctx, input, remote ? NULL : &st, NULL, show_full_path, &summary, stdout);
+    }
+    metrics_stop();
+
+    if (workers) {
+        queue_close(&queue);
+        for (int i = 0; i < started; ++i) {
+            pthread_join(workers[i].thread, NULL);
+            summary_merge(&summary, &workers[i].summary);
+        }
+        work_queue = NULL;
+        if (stats_mode && adaptive_jobs) {
+            size_t len;
+            FILE *f = open_memstream(&device_stats, &len);
+            if (f) {
+                queue_print_devices(f, &queue);
+                fclose(f);
+            }
+        }
+        queue_destroy(&queue);
+        free(workers);
+    }
+    // Only after the probe workers: they are the ones feeding this pool
+    if (deep_workers) {
+        queue_close(&deep_files);
+        for (int i = 0; i < deep_started; ++i) {
+            pthread_join(deep_workers[i].thread, NULL);
+            summary_merge(&summary, &deep_workers[i].summary);
+        }
+        deep_queue = NULL;
+        queue_destroy(&deep_files);
+        free(deep_workers);
+    }
+    // Last: every other stage finishes files into it
+    if (decode_workers) {
+        queue_close(&decode_files);
+        for (int i = 0; i < decode_started; ++i) {
+            pthread_join(decode_workers[i].thread, NULL);
+            summary_merge(&summary, &decode_workers[i].summary);
+        }
+        decode_queue = NULL;
+        queue_destroy(&decode_files);
+        free(decode_workers);
+    }
+    av_buffer_unref(&hw_device);
+
+    if (ctx->journal) {
+        if (scan_interrupted) {
+            fprintf(stderr, "Interrupted; run again with --journal %s to resume.\n", journal_file);
+            status = 1;
+        }
+        // A shard's journal is its result for --merge
+        journal_close(ctx->journal, !scan_interrupted && !shard_count);
+        ctx->journal = NULL;
+    }
+
+    if (!brief_mode && output_format == OUTPUT_TEXT) {
         printf("\n--- Summary ---\n");
         printf("Total checked: %d\n", summary.total);
         printf(COLOR_GREEN "OK: %d\n" COLOR_RESET, summary.ok);
         printf(COLOR_RED "NOT SUPPORTED: %d\n" COLOR_RESET, summary.not_supported);
         printf(COLOR_YELLOW "Errors: %d\n" COLOR_RESET, summary.errors);
+        if (ctx->options.num_profiles > 1) {
+            for (int p = 0; p < ctx->options.num_profiles; p++)
+                printf("  %-14s OK: %d, NOT SUPPORTED: %d\n", ctx->options.profiles[p]->def->name,
+                    summary.profile_ok[p], summary.profile_not_supported[p]);
+        }
+        if (remux_mode)
+            printf("Remuxed: %d, failed: %d\n", summary.remuxed, summary.remux_failed);
+        if (dedupe_mode || summary.duplicates)
+            printf("Duplicates skipped: %d\n", summary.duplicates);
+        if (skip_fixed || summary.resolved)
+            printf("Resolved by a newer fix: %d\n", summary.resolved);
+        if (journal_file)
+            printf("Resumed from journal: %d\n", summary.resumed);
+        if (decode_sample)
+            printf("Decode sampled: %d, with errors: %d\n", summary.sampled, summary.sample_errors);
+        if (ctx->cache)
+            printf("Cache hits: %d, misses: %d\n", ctx->cache->hits, ctx->cache->misses);
     }
 
-    free(excludes);
-    return 0;
+    if (fix_script) {
+        if (script_write(fix_script, script_file, input ? input : "the merged reports") < 0)
+            status = 1;
+        script_free(fix_script);
+        fix_script = NULL;
+    }
+
+    if (stats_mode) {
+        // Keep machine-readable stdout clean
+        int text_summary = !brief_mode && output_format == OUTPUT_TEXT;
+        print_stats(text_summary ? stdout : stderr, &ctx->options, av_gettime_relative() - t_start, walk_us);
+        if (device_stats)
+            fputs(device_stats, text_summary ? stdout : stderr);
+        free(device_stats);
+        stats_free();
+    }
+
+    ctv_context_free(ctx);
+    if (dedupe)
+        dedupe_free(dedupe);
+    fixed_dirs_free();
+#ifdef HAVE_IO_URING
+    uring_free(walk_ring);
+    walk_ring = NULL;
+#endif
+    head_pool_drain();
+    exclude_free(&excludes);
+    return status;
 }
 /* vim: set ts=4 sts=4 sw=4 et : */
@@ -0,0 +1,124 @@
+/*
+ * libcheck_tv_compat: the checker as a library
+ * --------------------------------------------
+ * Checks video files against one or more TV profiles without starting the
+ * check_tv_compat executable.  A ctv_context holds everything a check
+ * depends on (profiles, probe limits, the optional cache); it is created
+ * once and can then be used from any number of threads at the same time,
+ * so a host application can run checks on its own thread pool.
+ *
+ *   ctv_options opts;
+ *   ctv_options_init(&opts);
+ *   opts.profiles = "frame2024,webos";
+ *   ctv_context *ctx = ctv_context_new(&opts);
+ *
+ *   ctv_result r;
+ *   if (ctv_check_file(ctx, "movie.mkv", &r) == 0 && !r.all_profiles_ok)
+ *       printf("%s: %s\n", ctv_profile_name(ctx, 0), r.verdicts[0].fix);
+ *   ctv_result_free(&r);
+ *
+ *   ctv_context_free(ctx);
+ *
+ * Errors are reported on stderr, like the command line tool does.
+ */
+#ifndef CHECK_TV_COMPAT_H
+#define CHECK_TV_COMPAT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(CTV_LIBRARY) && defined(__GNUC__)
+#define CTV_API __attribute__((visibility("default")))
+#else
+#define CTV_API
+#endif
+
+#define CTV_MAX_PROFILES 16
+
+typedef struct ctv_context ctv_context;
+
+typedef struct {
+    const char *profiles;           // comma-separated profile names (see ctv_list_profiles); NULL: "frame2024"
+    int fast;                       // header-only probing where the container header suffices (--fast)
+    long long probesize;            // bytes, 0: FFmpeg default (--probesize)
+    long long analyzeduration;      // microseconds, 0: FFmpeg default (--analyzeduration)
+    int io_buffer_size;             // bytes, 0: FFmpeg's file protocol (--io-buffer)
+    int mmap_head;                  // --mmap-head
+    int deep;                       // profile, level, bit depth and Dolby Vision checks (--deep)
+    const char *cache_file;         // probe cache shared with --cache; NULL: none
+} ctv_options;
+
+enum { CTV_VIDEO, CTV_AUDIO, CTV_SUBTITLE };
+
+typedef struct {
+    int index;                      // stream index in the file, as used by ffmpeg -map
+    int type;                       // CTV_VIDEO, CTV_AUDIO or CTV_SUBTITLE
+    const char *codec;              // FFmpeg codec name; static
+    char lang[16];
+    unsigned supported;             // bit p set when profile p plays the stream
+    // Only set for video streams looked at by ctv_options.deep
+    int deep;
+    int profile;                    // FFmpeg profile id (FF_PROFILE_*)
+    int level;                      // as FFmpeg reports it (51 for H.264 5.1, 153 for HEVC 5.1), -99 if not found
+    int bit_depth;                  // 0 if not found
+    int dovi_profile;               // Dolby Vision profile, -1 without a configuration record
+} ctv_stream;
+
+typedef struct {
+    int container_ok;
+    int all_supported;              // the container and every stream
+    const char *fix;                // "none", "remux", "transcode" or "unfixable"; static
+} ctv_verdict;
+
+typedef struct {
+    int error;                      // 0, or the (negative) FFmpeg error the probe failed with
+    const char *failed_step;        // with error: "could not open" or "could not read stream info"
+    char container[64];             // FFmpeg demuxer name, e.g. "matroska,webm"
+    int nb_streams;                 // video, audio and subtitle streams only
+    ctv_stream *streams;
+    // Without an error
+    int num_profiles;
+    ctv_verdict verdicts[CTV_MAX_PROFILES];   // in the order of ctv_options.profiles
+    int all_profiles_ok;
+} ctv_result;
+
+// Called by ctv_scan for every checked file; returning nonzero ends the scan.
+// result is only valid during the call.
+typedef int (*ctv_scan_callback)(void *opaque, const char *path, const ctv_result *result);
+// Called by ctv_walk for every candidate file; returning nonzero ends the walk
+typedef int (*ctv_walk_callback)(void *opaque, const char *path);
+
+CTV_API void ctv_options_init(ctv_options *opts);
+
+// Names of the built-in profiles, NULL-terminated
+CTV_API const char *const *ctv_list_profiles(void);
+
+// NULL if opts names an unknown profile
+CTV_API ctv_context *ctv_context_new(const ctv_options *opts);
+// Saves the cache, if any
+CTV_API void ctv_context_free(ctv_context *ctx);
+
+CTV_API int ctv_num_profiles(const ctv_context *ctx);
+CTV_API const char *ctv_profile_name(const ctv_context *ctx, int p);
+
+// Probes and scores path (a local file or an http(s) URL); returns result->error.
+// The result has to be freed with ctv_result_free in either case.
+CTV_API int ctv_check_file(ctv_context *ctx, const char *path, ctv_result *result);
+CTV_API void ctv_result_free(ctv_result *result);
+
+// Walks dir like the command line's directory scan (supported extensions
+// only, directories and files matching an exclude pattern skipped) and
+// checks every file on the calling thread; returns -1 if dir can't be
+// opened, 1 if the callback ended it
+CTV_API int ctv_scan(ctv_context *ctx, const char *dir, const char *const *excludes, int num_excludes,
+                     ctv_scan_callback callback, void *opaque);
+// The same walk without checking, for hosts that check the files on their own threads
+CTV_API int ctv_walk(const char *dir, const char *const *excludes, int num_excludes,
+                     ctv_walk_callback callback, void *opaque);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * ctv_example: checks the files named on the command line through
+ * libcheck_tv_compat, on a few threads sharing one context.
+ *
+ *   ctv_example [--profile NAME[,NAME...]] [--deep] [--cache FILE] FILE...
+ *
+ * Prints one line per file and profile: the fix it needs, or why it could
+ * not be checked.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "check_tv_compat.h"
+
+#define NUM_THREADS 4
+
+typedef struct {
+    ctv_context *ctx;
+    char **paths;
+    int num_paths;
+    int next;               // next path to take
+    int failed;
+    pthread_mutex_t lock;
+} Checks;
+
+void print_result(const ctv_context *ctx, const char *path, const ctv_result *r) {
+    if (r->error) {
+        printf("%s: %s\n", path, r->failed_step);
+        return;
+    }
+    for (int p = 0; p < r->num_profiles; p++) {
+        printf("%s [%s]: %s (%s", path, ctv_profile_name(ctx, p), r->verdicts[p].fix, r->container);
+        for (int i = 0; i < r->nb_streams; i++) {
+            const ctv_stream *s = &r->streams[i];
+            printf(", %s%s", s->codec, (s->supported >> p) & 1 ? "" : " unsupported");
+        }
+        printf(")\n");
+    }
+}
+
+void *check_main(void *arg) {
+    Checks *c = arg;
+    for (;;) {
+        pthread_mutex_lock(&c->lock);
+        int i = c->next < c->num_paths ? c->next++ : -1;
+        pthread_mutex_unlock(&c->lock);
+        if (i < 0)
+            return NULL;
+
+        // The context is shared; the result is the thread's own
+        ctv_result r;
+        int ret = ctv_check_file(c->ctx, c->paths[i], &r);
+        pthread_mutex_lock(&c->lock);
+        print_result(c->ctx, c->paths[i], &r);
+        if (ret < 0)
+            c->failed = 1;
+        pthread_mutex_unlock(&c->lock);
+        ctv_result_free(&r);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    ctv_options opts;
+    ctv_options_init(&opts);
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            opts.profiles = argv[++i];
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            opts.cache_file = argv[++i];
+        else if (strcmp(argv[i], "--deep") == 0)
+            opts.deep = 1;
+        else
+            break;
+    }
+    if (i == argc) {
+        fprintf(stderr, "Usage: %s [--profile NAME[,NAME...]] [--deep] [--cache FILE] FILE...\n", argv[0]);
+        return 1;
+    }
+
+    ctv_context *ctx = ctv_context_new(&opts);
+    if (!ctx)
+        return 1;
+    Checks c = { .ctx = ctx, .paths = argv + i, .num_paths = argc - i };
+    pthread_mutex_init(&c.lock, NULL);
+
+    pthread_t threads[NUM_THREADS];
+    int started = 0;
+    for (; started < NUM_THREADS && started < c.num_paths; started++) {
+        if (pthread_create(&threads[started], NULL, check_main, &c) != 0)
+            break;
+    }
+    if (started == 0)
+        check_main(&c);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    pthread_mutex_destroy(&c.lock);
+    ctv_context_free(ctx);
+    return c.failed;
+}
+/* vim: set ts=4 sts=4 sw=4 et : */
@@ -0,0 +1,11 @@
+/*
+ * check_tv_compat: the command line tool.  Everything it does is in
+ * check_tv_compat.c, which libcheck_tv_compat is built from as well.
+ */
+
+int ctv_cli_main(int argc, char *argv[]);
+
+int main(int argc, char *argv[]) {
+    return ctv_cli_main(argc, argv);
+}
+/* vim: set ts=4 sts=4 sw=4 et : */